@@ -0,0 +1,315 @@
+#include "compressed_image.h"
+#include "file_reader.h"
+
+#include <endian.h>
+#include <zlib.h>
+
+int compressed_image_probe(FILE *file) {
+    if (file == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    char magic[8];
+    if (fseek(file, 0, SEEK_SET) != 0) {
+        return -1;
+    }
+    size_t got = fread(magic, 1, sizeof(magic), file);
+    fseek(file, 0, SEEK_SET);
+    return got == sizeof(magic) && memcmp(magic, COMPRESSED_IMAGE_MAGIC, sizeof(magic)) == 0;
+}
+
+// Drops every cached block unless a read is using the cache right now
+static size_t compressed_image_reclaim(struct fat_memory_owner_t *owner) {
+    struct compressed_image_t *image = (struct compressed_image_t *) ((uint8_t *) owner -
+                                                                      offsetof(struct compressed_image_t, memory));
+    if (pthread_mutex_trylock(&image->lock) != 0) {
+        return 0;
+    }
+    size_t freed = 0;
+    for (int i = 0; i < COMPRESSED_IMAGE_CACHE_SLOTS; i++) {
+        if (image->cache[i].data != NULL) {
+            free(image->cache[i].data);
+            image->cache[i].data = NULL;
+            image->cache[i].last_used = 0;
+            freed += image->header.block_size;
+        }
+    }
+    pthread_mutex_unlock(&image->lock);
+    return freed;
+}
+
+struct compressed_image_t *compressed_image_open(FILE *file) {
+    if (file == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct compressed_image_t *image = calloc(1, sizeof(struct compressed_image_t));
+    if (image == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    image->file = file;
+    // Everything the header and index claim is checked against the real file before it is trusted
+    uint64_t file_size = 0;
+    if (fseeko(file, 0, SEEK_END) == 0) {
+        off_t end = ftello(file);
+        file_size = end > 0 ? (uint64_t) end : 0;
+    }
+    fseeko(file, 0, SEEK_SET);
+    struct compressed_image_header *header = &image->header;
+    if (fread(header, sizeof(struct compressed_image_header), 1, file) != 1 ||
+        memcmp(header->magic, COMPRESSED_IMAGE_MAGIC, sizeof(header->magic)) != 0) {
+        free(image);
+        errno = EINVAL;
+        return NULL;
+    }
+    header->version = le32toh(header->version);
+    header->block_size = le32toh(header->block_size);
+    header->image_size = le64toh(header->image_size);
+    header->block_count = le32toh(header->block_count);
+    uint64_t index_count = (uint64_t) header->block_count + 1;
+    uint64_t data_start = sizeof(struct compressed_image_header) + index_count * sizeof(uint64_t);
+    if (header->version != COMPRESSED_IMAGE_VERSION || header->block_size == 0 ||
+        header->block_size % SECTOR_SIZE != 0 ||
+        header->block_count != (header->image_size + header->block_size - 1) / header->block_size ||
+        data_start > file_size) {
+        free(image);
+        errno = EINVAL;
+        return NULL;
+    }
+    image->index = malloc((size_t) (index_count * sizeof(uint64_t)));
+    image->scratch = malloc(header->block_size);
+    if (image->index == NULL || image->scratch == NULL) {
+        free(image->index);
+        free(image->scratch);
+        free(image);
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (fread(image->index, sizeof(uint64_t), (size_t) index_count, file) != index_count) {
+        free(image->index);
+        free(image->scratch);
+        free(image);
+        errno = EINVAL;
+        return NULL;
+    }
+    for (uint64_t i = 0; i < index_count; i++) {
+        image->index[i] = le64toh(image->index[i]);
+    }
+    int valid = image->index[0] >= data_start && image->index[header->block_count] <= file_size;
+    for (uint32_t i = 0; i < header->block_count && valid; i++) {
+        valid = image->index[i + 1] >= image->index[i] &&
+                image->index[i + 1] - image->index[i] <= header->block_size;
+    }
+    if (!valid) {
+        free(image->index);
+        free(image->scratch);
+        free(image);
+        errno = EINVAL;
+        return NULL;
+    }
+    pthread_mutex_init(&image->lock, NULL);
+    fat_memory_register(&image->memory, compressed_image_reclaim);
+    return image;
+}
+
+static uint8_t *compressed_image_block(struct compressed_image_t *image, uint32_t block) {
+    struct compressed_block_cache_t *victim = image->cache;
+    for (int i = 0; i < COMPRESSED_IMAGE_CACHE_SLOTS; i++) {
+        struct compressed_block_cache_t *slot = image->cache + i;
+        if (slot->last_used != 0 && slot->block == block) {
+            slot->last_used = ++image->clock;
+            return slot->data;
+        }
+        if (slot->last_used < victim->last_used) {
+            victim = slot;
+        }
+    }
+    if (victim->data == NULL) {
+        victim->data = malloc(image->header.block_size);
+        if (victim->data == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        fat_memory_charge(&image->memory, 0, image->header.block_size);
+    }
+    victim->last_used = 0;
+
+    uint64_t length = image->index[block + 1] - image->index[block];
+    if (length == 0) {
+        memset(victim->data, 0, image->header.block_size);
+    } else {
+        uint8_t *target = length == image->header.block_size ? victim->data : image->scratch;
+        if (fseeko(image->file, (off_t) image->index[block], SEEK_SET) != 0 ||
+            fread(target, 1, length, image->file) != length) {
+            errno = EIO;
+            return NULL;
+        }
+        if (target == image->scratch) {
+            uLongf out_length = image->header.block_size;
+            if (uncompress(victim->data, &out_length, image->scratch, length) != Z_OK) {
+                errno = EIO;
+                return NULL;
+            }
+            memset(victim->data + out_length, 0, image->header.block_size - out_length);
+        }
+    }
+    victim->block = block;
+    victim->last_used = ++image->clock;
+    return victim->data;
+}
+
+int compressed_image_read(struct compressed_image_t *image, uint64_t offset, void *buffer, size_t length) {
+    if (image == NULL || buffer == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (offset + length > image->header.image_size) {
+        errno = ERANGE;
+        return -1;
+    }
+    uint8_t *result = buffer;
+    uint32_t block_size = image->header.block_size;
+    fat_memory_touch(&image->memory);
+    pthread_mutex_lock(&image->lock);
+    while (length > 0) {
+        uint32_t block = (uint32_t) (offset / block_size);
+        uint32_t in_block = (uint32_t) (offset % block_size);
+        size_t chunk = block_size - in_block;
+        if (chunk > length) {
+            chunk = length;
+        }
+        uint8_t *data = compressed_image_block(image, block);
+        if (data == NULL) {
+            pthread_mutex_unlock(&image->lock);
+            return -1;
+        }
+        memcpy(result, data + in_block, chunk);
+        result += chunk;
+        offset += chunk;
+        length -= chunk;
+    }
+    pthread_mutex_unlock(&image->lock);
+    return 0;
+}
+
+void compressed_image_close(struct compressed_image_t *image) {
+    if (image == NULL) {
+        return;
+    }
+    fat_memory_unregister(&image->memory);
+    for (int i = 0; i < COMPRESSED_IMAGE_CACHE_SLOTS; i++) {
+        free(image->cache[i].data);
+    }
+    pthread_mutex_destroy(&image->lock);
+    free(image->index);
+    free(image->scratch);
+    free(image);
+}
+
+int disk_compress_image(const char *raw_file_name, const char *compressed_file_name, uint32_t block_size) {
+    if (raw_file_name == NULL || compressed_file_name == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (block_size == 0 || block_size % SECTOR_SIZE != 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    FILE *raw = fopen(raw_file_name, "rb");
+    if (raw == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    fseeko(raw, 0, SEEK_END);
+    struct compressed_image_header header;
+    memcpy(header.magic, COMPRESSED_IMAGE_MAGIC, sizeof(header.magic));
+    header.version = COMPRESSED_IMAGE_VERSION;
+    header.block_size = block_size;
+    header.image_size = (uint64_t) ftello(raw);
+    uint64_t block_count = (header.image_size + block_size - 1) / block_size;
+    if (block_count >= UINT32_MAX) {
+        fclose(raw);
+        errno = EFBIG;
+        return -1;
+    }
+    header.block_count = (uint32_t) block_count;
+    fseeko(raw, 0, SEEK_SET);
+
+    uLong bound = compressBound(block_size);
+    uint64_t *index = calloc(header.block_count + 1, sizeof(uint64_t)); //Zeroed, it is written out as the placeholder
+    uint8_t *block = malloc(block_size);
+    uint8_t *packed = malloc(bound);
+    if (index == NULL || block == NULL || packed == NULL) {
+        free(index);
+        free(block);
+        free(packed);
+        fclose(raw);
+        errno = ENOMEM;
+        return -1;
+    }
+    FILE *out = fopen(compressed_file_name, "wb");
+    if (out == NULL) {
+        free(index);
+        free(block);
+        free(packed);
+        fclose(raw);
+        return -1;
+    }
+    // The index is written twice: a placeholder now, the real offsets once all blocks are stored.
+    uint64_t position = sizeof(header) + sizeof(uint64_t) * (header.block_count + 1);
+    struct compressed_image_header stored = header;
+    stored.version = htole32(header.version);
+    stored.block_size = htole32(header.block_size);
+    stored.image_size = htole64(header.image_size);
+    stored.block_count = htole32(header.block_count);
+    int error = fwrite(&stored, sizeof(stored), 1, out) != 1 ||
+                fwrite(index, sizeof(uint64_t), header.block_count + 1, out) != header.block_count + 1;
+    for (uint32_t i = 0; i < header.block_count && !error; i++) {
+        index[i] = position;
+        size_t got = fread(block, 1, block_size, raw);
+        if (got == 0) {
+            error = 1;
+            break;
+        }
+        memset(block + got, 0, block_size - got);
+        int zero = 1;
+        for (size_t j = 0; j < block_size; j++) {
+            if (block[j] != 0) {
+                zero = 0;
+                break;
+            }
+        }
+        if (zero) {
+            continue;
+        }
+        uLongf packed_length = bound;
+        if (compress2(packed, &packed_length, block, block_size, Z_BEST_COMPRESSION) != Z_OK ||
+            packed_length >= block_size) {
+            error = fwrite(block, 1, block_size, out) != block_size;
+            position += block_size;
+        } else {
+            error = fwrite(packed, 1, packed_length, out) != packed_length;
+            position += packed_length;
+        }
+    }
+    index[header.block_count] = position;
+    for (uint32_t i = 0; i <= header.block_count; i++) {
+        index[i] = htole64(index[i]);
+    }
+    if (!error) {
+        error = fseeko(out, sizeof(header), SEEK_SET) != 0 ||
+                fwrite(index, sizeof(uint64_t), header.block_count + 1, out) != header.block_count + 1;
+    }
+    error |= fclose(out) != 0;
+    fclose(raw);
+    free(index);
+    free(block);
+    free(packed);
+    if (error) {
+        remove(compressed_file_name);
+        errno = EIO;
+        return -1;
+    }
+    return 0;
+}
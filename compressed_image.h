@@ -0,0 +1,59 @@
+#ifndef MY_FAT_16_READER_COMPRESSED_IMAGE_H
+#define MY_FAT_16_READER_COMPRESSED_IMAGE_H
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "fat_memory.h"
+
+#define COMPRESSED_IMAGE_MAGIC "FAT16CMP"
+#define COMPRESSED_IMAGE_VERSION 1
+#define COMPRESSED_IMAGE_DEFAULT_BLOCK_SIZE (64 * 1024)
+#define COMPRESSED_IMAGE_CACHE_SLOTS 16
+
+/*
+ * Layout of a compressed image:
+ *   header | index (block_count + 1 little-endian uint64 offsets) | blocks
+ * Block i occupies bytes [index[i], index[i + 1]) of the file. A block of length 0 is all zeros,
+ * a block of length block_size is stored raw, anything else is a zlib stream.
+ */
+struct __attribute__((__packed__)) compressed_image_header {
+    char magic[8]; //COMPRESSED_IMAGE_MAGIC, not null terminated
+    uint32_t version; //COMPRESSED_IMAGE_VERSION
+    uint32_t block_size; //Uncompressed size of every block (multiple of SECTOR_SIZE)
+    uint64_t image_size; //Size of the raw image in bytes
+    uint32_t block_count; //Number of blocks, the last one may be partially used
+};
+
+struct compressed_block_cache_t {
+    uint32_t block;
+    uint64_t last_used; //0 = slot empty
+    uint8_t *data;
+};
+
+struct compressed_image_t {
+    FILE *file;
+    struct compressed_image_header header;
+    uint64_t *index;
+    uint8_t *scratch; //Compressed bytes of the block being decoded
+    struct compressed_block_cache_t cache[COMPRESSED_IMAGE_CACHE_SLOTS];
+    uint64_t clock;
+    pthread_mutex_t lock; //Guards file position, scratch and cache
+    struct fat_memory_owner_t memory; //Cached blocks are reclaimable
+};
+
+int compressed_image_probe(FILE *file);
+
+struct compressed_image_t *compressed_image_open(FILE *file);
+
+int compressed_image_read(struct compressed_image_t *image, uint64_t offset, void *buffer, size_t length);
+
+void compressed_image_close(struct compressed_image_t *image);
+
+int disk_compress_image(const char *raw_file_name, const char *compressed_file_name, uint32_t block_size);
+
+#endif //MY_FAT_16_READER_COMPRESSED_IMAGE_H
@@ -0,0 +1,436 @@
+#include "fat_client.h"
+
+#include <sys/mman.h>
+
+struct fat_client_t *fat_client_connect(const char *socket_path) {
+    if (socket_path == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct fat_client_t *client = calloc(1, sizeof(struct fat_client_t));
+    if (client == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    client->fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (client->fd < 0) {
+        free(client);
+        return NULL;
+    }
+    if (connect(client->fd, (struct sockaddr *) &address, sizeof(address)) != 0) {
+        int error = errno;
+        close(client->fd);
+        free(client);
+        errno = error;
+        return NULL;
+    }
+
+    struct fat_server_reply hello;
+    struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+    char control[CMSG_SPACE(sizeof(int))];
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = &iov;
+    message.msg_iovlen = 1;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+    ssize_t received = recvmsg(client->fd, &message, MSG_CMSG_CLOEXEC);
+    struct cmsghdr *cmsg = received == (ssize_t) sizeof(hello) ? CMSG_FIRSTHDR(&message) : NULL;
+    if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS || hello.status <= 0) {
+        close(client->fd);
+        free(client);
+        errno = EPROTO;
+        return NULL;
+    }
+    int shm_fd;
+    memcpy(&shm_fd, CMSG_DATA(cmsg), sizeof(int));
+    client->shm_size = (size_t) hello.status;
+    client->shm = mmap(NULL, client->shm_size, PROT_READ, MAP_SHARED, shm_fd, 0);
+    close(shm_fd);
+    if (client->shm == MAP_FAILED) {
+        int error = errno;
+        close(client->fd);
+        free(client);
+        errno = error;
+        return NULL;
+    }
+    pthread_mutex_init(&client->lock, NULL);
+    return client;
+}
+
+int fat_client_close(struct fat_client_t *client) {
+    if (client == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    // The server releases every handle still open on this connection when it sees the hang up
+    munmap(client->shm, client->shm_size);
+    close(client->fd);
+    pthread_mutex_destroy(&client->lock);
+    free(client);
+    return 0;
+}
+
+// Sends one request and waits for its reply; the caller holds client->lock while it uses the window
+static int client_call(struct fat_client_t *client, struct fat_server_request *request, const char *path,
+                       struct fat_server_reply *reply) {
+    size_t path_length = path != NULL ? strlen(path) : 0;
+    if (path_length > FAT_SERVER_MAX_PATH) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    request->path_length = (uint16_t) path_length;
+    struct iovec iov[2] = {
+            {.iov_base = request, .iov_len = sizeof(struct fat_server_request)},
+            {.iov_base = (void *) path, .iov_len = path_length}
+    };
+    struct msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_iov = iov;
+    message.msg_iovlen = path_length > 0 ? 2 : 1;
+    if (sendmsg(client->fd, &message, MSG_NOSIGNAL) < 0) {
+        return -1;
+    }
+    ssize_t received = recv(client->fd, reply, sizeof(struct fat_server_reply), 0);
+    if (received != (ssize_t) sizeof(struct fat_server_reply)) {
+        errno = received == 0 ? ECONNRESET : EPROTO;
+        return -1;
+    }
+    if (reply->status < 0) {
+        errno = -reply->status;
+        return -1;
+    }
+    return 0;
+}
+
+static int client_call_locked(struct fat_client_t *client, struct fat_server_request *request, const char *path,
+                              struct fat_server_reply *reply) {
+    pthread_mutex_lock(&client->lock);
+    int result = client_call(client, request, path, reply);
+    int error = errno;
+    pthread_mutex_unlock(&client->lock);
+    errno = error;
+    return result;
+}
+
+struct remote_volume_t *remote_fat_open(struct fat_client_t *client, const char *volume_name) {
+    if (client == NULL || volume_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct fat_server_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = FAT_SERVER_OP_MOUNT;
+    struct fat_server_reply reply;
+    if (client_call_locked(client, &request, volume_name, &reply) != 0) {
+        return NULL;
+    }
+    struct remote_volume_t *volume = malloc(sizeof(struct remote_volume_t));
+    if (volume == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    volume->client = client;
+    volume->index = (uint32_t) reply.status;
+    return volume;
+}
+
+int remote_fat_close(struct remote_volume_t *pvolume) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    free(pvolume);
+    return 0;
+}
+
+struct remote_file_t *remote_file_open(struct remote_volume_t *pvolume, const char *file_name) {
+    if (pvolume == NULL || file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct fat_server_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = FAT_SERVER_OP_FILE_OPEN;
+    request.volume = pvolume->index;
+    struct fat_server_reply reply;
+    if (client_call_locked(pvolume->client, &request, file_name, &reply) != 0) {
+        return NULL;
+    }
+    struct remote_file_t *file = malloc(sizeof(struct remote_file_t));
+    if (file == NULL) {
+        request.op = FAT_SERVER_OP_FILE_CLOSE;
+        request.handle = (uint32_t) reply.status;
+        client_call_locked(pvolume->client, &request, NULL, &reply);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(&file->entry, &reply.entry, sizeof(struct SFN));
+    file->volume = pvolume;
+    file->handle = (uint32_t) reply.status;
+    file->offset = 0;
+    return file;
+}
+
+int remote_file_close(struct remote_file_t *stream) {
+    if (stream == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    struct fat_server_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = FAT_SERVER_OP_FILE_CLOSE;
+    request.handle = stream->handle;
+    struct fat_server_reply reply;
+    int result = client_call_locked(stream->volume->client, &request, NULL, &reply);
+    free(stream);
+    return result;
+}
+
+size_t remote_file_read(void *ptr, size_t size, size_t nmemb, struct remote_file_t *stream) {
+    if (ptr == NULL || stream == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (stream->offset >= stream->entry.size || size == 0) {
+        return 0;
+    }
+    size_t length = size * nmemb;
+    if (length > stream->entry.size - stream->offset) {
+        length = stream->entry.size - stream->offset;
+    }
+    // Whole elements only, like file_read
+    length = length / size * size;
+    struct fat_client_t *client = stream->volume->client;
+    struct fat_server_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = FAT_SERVER_OP_FILE_READ;
+    request.handle = stream->handle;
+    size_t done = 0;
+    pthread_mutex_lock(&client->lock);
+    while (done < length) {
+        size_t chunk = length - done < client->shm_size ? length - done : client->shm_size;
+        request.offset = stream->offset + (uint32_t) done;
+        request.length = (uint32_t) chunk;
+        struct fat_server_reply reply;
+        if (client_call(client, &request, NULL, &reply) != 0) {
+            break;
+        }
+        memcpy((uint8_t *) ptr + done, client->shm, (size_t) reply.status);
+        done += (size_t) reply.status;
+        if ((size_t) reply.status < chunk) {
+            break;
+        }
+    }
+    pthread_mutex_unlock(&client->lock);
+    stream->offset += (uint32_t) (done / size * size);
+    return done / size;
+}
+
+int32_t remote_file_seek(struct remote_file_t *stream, int32_t offset, int whence) {
+    if (stream == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    int64_t position;
+    if (whence == SEEK_SET) {
+        position = offset;
+    } else if (whence == SEEK_CUR) {
+        position = (int64_t) stream->offset + offset;
+    } else if (whence == SEEK_END) {
+        position = (int64_t) stream->entry.size + offset;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    // The offset is sent with every read, so seeking never talks to the server
+    if (position < 0 || position > stream->entry.size) {
+        errno = ENXIO;
+        return -1;
+    }
+    stream->offset = (uint32_t) position;
+    return (int32_t) stream->offset;
+}
+
+struct remote_dir_t *remote_dir_open(struct remote_volume_t *pvolume, const char *dir_path) {
+    if (pvolume == NULL || dir_path == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct fat_server_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = FAT_SERVER_OP_DIR_OPEN;
+    request.volume = pvolume->index;
+    struct fat_server_reply reply;
+    if (client_call_locked(pvolume->client, &request, dir_path, &reply) != 0) {
+        return NULL;
+    }
+    struct remote_dir_t *dir = calloc(1, sizeof(struct remote_dir_t));
+    if (dir == NULL) {
+        request.op = FAT_SERVER_OP_DIR_CLOSE;
+        request.handle = (uint32_t) reply.status;
+        client_call_locked(pvolume->client, &request, NULL, &reply);
+        errno = ENOMEM;
+        return NULL;
+    }
+    dir->volume = pvolume;
+    dir->handle = (uint32_t) reply.status;
+    return dir;
+}
+
+// Replaces the buffered records with the next listing from the server
+static int remote_dir_fetch(struct remote_dir_t *pdir) {
+    struct fat_client_t *client = pdir->volume->client;
+    struct fat_server_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = FAT_SERVER_OP_DIR_READ;
+    request.handle = pdir->handle;
+    struct fat_server_reply reply;
+    pthread_mutex_lock(&client->lock);
+    if (client_call(client, &request, NULL, &reply) != 0) {
+        int error = errno;
+        pthread_mutex_unlock(&client->lock);
+        errno = error;
+        return -1;
+    }
+    size_t size = 0;
+    for (int32_t i = 0; i < reply.status; i++) {
+        struct fat_server_dir_record record;
+        memcpy(&record, client->shm + size, sizeof(record));
+        size += sizeof(record) + record.long_name_length;
+    }
+    if (size > pdir->records_size) {
+        uint8_t *records = realloc(pdir->records, size);
+        if (records == NULL) {
+            pthread_mutex_unlock(&client->lock);
+            errno = ENOMEM;
+            return -1;
+        }
+        pdir->records = records;
+        pdir->records_size = size;
+    }
+    if (size > 0) {
+        memcpy(pdir->records, client->shm, size);
+    }
+    pthread_mutex_unlock(&client->lock);
+    pdir->record_count = (uint32_t) reply.status;
+    pdir->record_index = 0;
+    pdir->record_offset = 0;
+    pdir->finished = reply.status == 0;
+    return 0;
+}
+
+int remote_dir_read(struct remote_dir_t *pdir, struct dir_entry_t *pentry) {
+    if (pdir == NULL || pentry == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (pdir->record_index == pdir->record_count) {
+        if (pdir->finished) {
+            return 1;
+        }
+        if (remote_dir_fetch(pdir) != 0) {
+            return -1;
+        }
+        if (pdir->finished) {
+            return 1;
+        }
+    }
+    struct fat_server_dir_record record;
+    memcpy(&record, pdir->records + pdir->record_offset, sizeof(record));
+    const char *long_name = (const char *) pdir->records + pdir->record_offset + sizeof(record);
+    memcpy(pentry->name, record.name, sizeof(pentry->name));
+    pentry->size = record.size;
+    pentry->is_archived = (record.flags & FAT_SERVER_DIR_ARCHIVED) != 0;
+    pentry->is_readonly = (record.flags & FAT_SERVER_DIR_READONLY) != 0;
+    pentry->is_system = (record.flags & FAT_SERVER_DIR_SYSTEM) != 0;
+    pentry->is_hidden = (record.flags & FAT_SERVER_DIR_HIDDEN) != 0;
+    pentry->is_directory = (record.flags & FAT_SERVER_DIR_DIRECTORY) != 0;
+    pentry->has_long_name = (record.flags & FAT_SERVER_DIR_LONG_NAME) != 0;
+    pentry->long_name = NULL;
+    pentry->entry = NULL;
+    if (pentry->has_long_name) {
+        // Kept until remote_dir_close, like the names dir_read hands out
+        char *name = malloc((size_t) record.long_name_length + 1);
+        char **lfn = realloc(pdir->lfn, sizeof(char *) * (pdir->lfn_count + 1));
+        if (name == NULL || lfn == NULL) {
+            free(name);
+            if (lfn != NULL) {
+                pdir->lfn = lfn;
+            }
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(name, long_name, record.long_name_length);
+        name[record.long_name_length] = '\0';
+        pdir->lfn = lfn;
+        pdir->lfn[pdir->lfn_count++] = name;
+        pentry->long_name = name;
+    }
+    pdir->record_offset += sizeof(record) + record.long_name_length;
+    pdir->record_index++;
+    return 0;
+}
+
+int remote_dir_close(struct remote_dir_t *pdir) {
+    if (pdir == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    struct fat_server_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = FAT_SERVER_OP_DIR_CLOSE;
+    request.handle = pdir->handle;
+    struct fat_server_reply reply;
+    int result = client_call_locked(pdir->volume->client, &request, NULL, &reply);
+    for (uint32_t i = 0; i < pdir->lfn_count; i++) {
+        free(pdir->lfn[i]);
+    }
+    free(pdir->lfn);
+    free(pdir->records);
+    free(pdir);
+    return result;
+}
+
+int remote_stat(struct remote_volume_t *pvolume, const char *path, struct dir_entry_t *pentry) {
+    if (pvolume == NULL || path == NULL || pentry == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    struct fat_server_request request;
+    memset(&request, 0, sizeof(request));
+    request.op = FAT_SERVER_OP_STAT;
+    request.volume = pvolume->index;
+    struct fat_server_reply reply;
+    if (client_call_locked(pvolume->client, &request, path, &reply) != 0) {
+        return -1;
+    }
+    memset(pentry, 0, sizeof(struct dir_entry_t));
+    size_t length = 0;
+    for (int k = 0; k < 11; k++) {
+        char letter = reply.entry.filename[k];
+        if (isprint(letter) && letter != ' ') {
+            if (k >= 8 && length > 0 && strchr(pentry->name, '.') == NULL) {
+                pentry->name[length++] = '.';
+            }
+            pentry->name[length++] = letter;
+        }
+    }
+    pentry->size = reply.entry.size;
+    uint8_t attributes = reply.entry.file_attributes;
+    pentry->is_readonly = (attributes & FAT_ATTR_READONLY) != 0;
+    pentry->is_hidden = (attributes & FAT_ATTR_HIDDEN) != 0;
+    pentry->is_system = (attributes & FAT_ATTR_SYSTEM) != 0;
+    pentry->is_archived = (attributes & FAT_ATTR_ARCHIVE) != 0;
+    pentry->is_directory = reply.is_directory != 0;
+    return 0;
+}
@@ -0,0 +1,64 @@
+#ifndef MY_FAT_16_READER_FAT_CLIENT_H
+#define MY_FAT_16_READER_FAT_CLIENT_H
+
+#include "fat_server.h"
+
+// One connection to a fat_server; calls on it may come from several threads and are serialised
+struct fat_client_t {
+    int fd;
+    uint8_t *shm; //Window shared with the server, read only on this side
+    size_t shm_size;
+    pthread_mutex_t lock;
+};
+
+struct remote_volume_t {
+    struct fat_client_t *client;
+    uint32_t index;
+};
+
+struct remote_file_t {
+    struct SFN entry;
+    struct remote_volume_t *volume;
+    uint32_t handle;
+    uint32_t offset;
+};
+
+struct remote_dir_t {
+    struct remote_volume_t *volume;
+    uint32_t handle;
+    uint8_t *records; //Copy of the last listing received from the server
+    size_t records_size;
+    uint32_t record_count;
+    uint32_t record_index;
+    size_t record_offset;
+    bool finished;
+    uint32_t lfn_count;
+    char **lfn;
+};
+
+struct fat_client_t *fat_client_connect(const char *socket_path);
+
+int fat_client_close(struct fat_client_t *client);
+
+struct remote_volume_t *remote_fat_open(struct fat_client_t *client, const char *volume_name);
+
+int remote_fat_close(struct remote_volume_t *pvolume);
+
+struct remote_file_t *remote_file_open(struct remote_volume_t *pvolume, const char *file_name);
+
+int remote_file_close(struct remote_file_t *stream);
+
+size_t remote_file_read(void *ptr, size_t size, size_t nmemb, struct remote_file_t *stream);
+
+int32_t remote_file_seek(struct remote_file_t *stream, int32_t offset, int whence);
+
+struct remote_dir_t *remote_dir_open(struct remote_volume_t *pvolume, const char *dir_path);
+
+int remote_dir_read(struct remote_dir_t *pdir, struct dir_entry_t *pentry);
+
+int remote_dir_close(struct remote_dir_t *pdir);
+
+// Fills pentry for a file or directory without opening it; long_name is always NULL
+int remote_stat(struct remote_volume_t *pvolume, const char *path, struct dir_entry_t *pentry);
+
+#endif //MY_FAT_16_READER_FAT_CLIENT_H
@@ -0,0 +1,17 @@
+#include "compressed_image.h"
+
+int main(int argc, char **argv) {
+    if (argc != 3 && argc != 4) {
+        fprintf(stderr, "usage: %s <raw image> <compressed image> [block size]\n", argv[0]);
+        return 2;
+    }
+    uint32_t block_size = COMPRESSED_IMAGE_DEFAULT_BLOCK_SIZE;
+    if (argc == 4) {
+        block_size = (uint32_t) strtoul(argv[3], NULL, 10);
+    }
+    if (disk_compress_image(argv[1], argv[2], block_size) != 0) {
+        perror("disk_compress_image");
+        return 1;
+    }
+    return 0;
+}
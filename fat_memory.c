@@ -0,0 +1,209 @@
+#define _GNU_SOURCE
+
+#include "fat_memory.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct memory_candidate_t {
+    uint64_t last_used;
+    struct fat_memory_owner_t *owner;
+};
+
+// Totals are updated with atomics so charging does not take the lock; the list and eviction are under it
+struct memory_state_t {
+    pthread_mutex_t lock;
+    size_t budget;
+    size_t used;
+    size_t reclaimable;
+    size_t peak;
+    size_t owners;
+    uint64_t evictions;
+    uint64_t evicted_bytes;
+    uint64_t reloads;
+    struct fat_memory_owner_t *head;
+    struct memory_candidate_t *candidates; //Scratch for eviction, one slot per owner
+    size_t candidate_capacity;
+};
+
+static struct memory_state_t memory = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static pthread_once_t memory_once = PTHREAD_ONCE_INIT;
+
+static void memory_init(void) {
+    const char *value = getenv(FAT_MEMORY_BUDGET_VARIABLE);
+    if (value == NULL) {
+        return;
+    }
+    char *end;
+    unsigned long long budget = strtoull(value, &end, 10);
+    switch (*end) {
+        case 'G':
+        case 'g':
+            budget <<= 10;
+            // fall through
+        case 'M':
+        case 'm':
+            budget <<= 10;
+            // fall through
+        case 'K':
+        case 'k':
+            budget <<= 10;
+            break;
+        default:
+            break;
+    }
+    __atomic_store_n(&memory.budget, (size_t) budget, __ATOMIC_RELAXED);
+}
+
+static int candidate_compare(const void *a, const void *b) {
+    const struct memory_candidate_t *first = a;
+    const struct memory_candidate_t *second = b;
+    return first->last_used < second->last_used ? -1 : first->last_used > second->last_used;
+}
+
+// Evicts least recently used owners until at most target bytes are used; memory.lock must be held
+static size_t memory_evict(size_t target) {
+    if (__atomic_load_n(&memory.used, __ATOMIC_RELAXED) <= target) {
+        return 0;
+    }
+    size_t count = 0;
+    for (struct fat_memory_owner_t *owner = memory.head; owner != NULL && count < memory.candidate_capacity;
+         owner = owner->next) {
+        if (owner->reclaim != NULL && __atomic_load_n(&owner->reclaimable, __ATOMIC_RELAXED) > 0) {
+            memory.candidates[count].last_used = __atomic_load_n(&owner->last_used, __ATOMIC_RELAXED);
+            memory.candidates[count].owner = owner;
+            count++;
+        }
+    }
+    qsort(memory.candidates, count, sizeof(struct memory_candidate_t), candidate_compare);
+    size_t total = 0;
+    for (size_t i = 0; i < count && __atomic_load_n(&memory.used, __ATOMIC_RELAXED) > target; i++) {
+        struct fat_memory_owner_t *owner = memory.candidates[i].owner;
+        size_t freed = owner->reclaim(owner);
+        if (freed == 0) {
+            // In use right now
+            continue;
+        }
+        __atomic_sub_fetch(&owner->reclaimable, freed, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&memory.reclaimable, freed, __ATOMIC_RELAXED);
+        __atomic_sub_fetch(&memory.used, freed, __ATOMIC_RELAXED);
+        memory.evictions++;
+        memory.evicted_bytes += freed;
+        total += freed;
+    }
+    return total;
+}
+
+int fat_memory_set_budget(size_t bytes) {
+    pthread_once(&memory_once, memory_init);
+    pthread_mutex_lock(&memory.lock);
+    __atomic_store_n(&memory.budget, bytes, __ATOMIC_RELAXED);
+    if (bytes != FAT_MEMORY_UNLIMITED) {
+        memory_evict(bytes);
+    }
+    pthread_mutex_unlock(&memory.lock);
+    return 0;
+}
+
+int fat_memory_stats(struct fat_memory_stats_t *stats) {
+    if (stats == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    pthread_once(&memory_once, memory_init);
+    pthread_mutex_lock(&memory.lock);
+    stats->budget = __atomic_load_n(&memory.budget, __ATOMIC_RELAXED);
+    stats->used = __atomic_load_n(&memory.used, __ATOMIC_RELAXED);
+    stats->reclaimable = __atomic_load_n(&memory.reclaimable, __ATOMIC_RELAXED);
+    stats->peak = __atomic_load_n(&memory.peak, __ATOMIC_RELAXED);
+    stats->owners = memory.owners;
+    stats->evictions = memory.evictions;
+    stats->evicted_bytes = memory.evicted_bytes;
+    stats->reloads = __atomic_load_n(&memory.reloads, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&memory.lock);
+    return 0;
+}
+
+size_t fat_memory_trim(void) {
+    pthread_mutex_lock(&memory.lock);
+    size_t freed = memory_evict(0);
+    pthread_mutex_unlock(&memory.lock);
+    return freed;
+}
+
+void fat_memory_register(struct fat_memory_owner_t *owner, fat_memory_reclaim_t reclaim) {
+    pthread_once(&memory_once, memory_init);
+    memset(owner, 0, sizeof(struct fat_memory_owner_t));
+    owner->reclaim = reclaim;
+    fat_memory_touch(owner);
+    pthread_mutex_lock(&memory.lock);
+    if (memory.owners == memory.candidate_capacity) {
+        size_t capacity = memory.candidate_capacity ? memory.candidate_capacity * 2 : 64;
+        struct memory_candidate_t *candidates = realloc(memory.candidates,
+                                                        sizeof(struct memory_candidate_t) * capacity);
+        // On failure eviction only considers the owners that fit
+        if (candidates != NULL) {
+            memory.candidates = candidates;
+            memory.candidate_capacity = capacity;
+        }
+    }
+    owner->next = memory.head;
+    if (memory.head != NULL) {
+        memory.head->prev = owner;
+    }
+    memory.head = owner;
+    memory.owners++;
+    pthread_mutex_unlock(&memory.lock);
+}
+
+void fat_memory_unregister(struct fat_memory_owner_t *owner) {
+    pthread_mutex_lock(&memory.lock);
+    if (owner->prev != NULL) {
+        owner->prev->next = owner->next;
+    } else {
+        memory.head = owner->next;
+    }
+    if (owner->next != NULL) {
+        owner->next->prev = owner->prev;
+    }
+    memory.owners--;
+    size_t reclaimable = __atomic_load_n(&owner->reclaimable, __ATOMIC_RELAXED);
+    size_t pinned = __atomic_load_n(&owner->pinned, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memory.reclaimable, reclaimable, __ATOMIC_RELAXED);
+    __atomic_sub_fetch(&memory.used, reclaimable + pinned, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&memory.lock);
+    owner->prev = NULL;
+    owner->next = NULL;
+}
+
+void fat_memory_charge(struct fat_memory_owner_t *owner, ssize_t pinned, ssize_t reclaimable) {
+    __atomic_add_fetch(&owner->pinned, (size_t) pinned, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&owner->reclaimable, (size_t) reclaimable, __ATOMIC_RELAXED);
+    __atomic_add_fetch(&memory.reclaimable, (size_t) reclaimable, __ATOMIC_RELAXED);
+    size_t used = __atomic_add_fetch(&memory.used, (size_t) (pinned + reclaimable), __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&memory.peak, __ATOMIC_RELAXED);
+    while (used > peak && !__atomic_compare_exchange_n(&memory.peak, &peak, used, true, __ATOMIC_RELAXED,
+                                                       __ATOMIC_RELAXED)) {
+    }
+    size_t budget = __atomic_load_n(&memory.budget, __ATOMIC_RELAXED);
+    if (pinned + reclaimable > 0 && budget != FAT_MEMORY_UNLIMITED && used > budget) {
+        pthread_mutex_lock(&memory.lock);
+        memory_evict(budget);
+        pthread_mutex_unlock(&memory.lock);
+    }
+}
+
+void fat_memory_reloaded(struct fat_memory_owner_t *owner, size_t bytes) {
+    __atomic_add_fetch(&memory.reloads, 1, __ATOMIC_RELAXED);
+    fat_memory_charge(owner, 0, (ssize_t) bytes);
+}
+
+void fat_memory_touch(struct fat_memory_owner_t *owner) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &now);
+    __atomic_store_n(&owner->last_used, (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec,
+                     __ATOMIC_RELAXED);
+}
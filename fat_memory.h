@@ -0,0 +1,70 @@
+#ifndef MY_FAT_16_READER_FAT_MEMORY_H
+#define MY_FAT_16_READER_FAT_MEMORY_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/*
+ * Process-wide memory governor. Every volume and compressed image is an owner that accounts the buffers it keeps
+ * between calls: FATs and compressed block caches as reclaimable, directories of open dir_t handles, chains of open
+ * files and writer state as pinned. Once the accounted total goes over the budget, reclaimable data of the least
+ * recently used owners is freed until it fits again; an evicted FAT is read back by the next fat_acquire.
+ * The budget can only be exceeded by pinned data and by FATs that are in use.
+ * Buffers that only live for the duration of one call are not accounted.
+ */
+
+#define FAT_MEMORY_UNLIMITED 0
+#define FAT_MEMORY_BUDGET_VARIABLE "FAT_MEMORY_BUDGET" //Initial budget in bytes, with an optional K, M or G suffix
+
+#define FAT_MEMORY_RECLAIMING 0x80000000u //Set in volume_t::fat_users while its FAT is being freed
+
+struct fat_memory_owner_t;
+
+// Frees whatever owner can give back right now and returns the number of bytes freed; called with the governor lock
+// held, so it must not wait for locks that are held while memory is charged
+typedef size_t (*fat_memory_reclaim_t)(struct fat_memory_owner_t *owner);
+
+struct fat_memory_owner_t {
+    fat_memory_reclaim_t reclaim; //NULL when nothing the owner holds can be reloaded
+    size_t pinned;
+    size_t reclaimable;
+    uint64_t last_used; //CLOCK_MONOTONIC_COARSE nanoseconds, orders owners for eviction
+    struct fat_memory_owner_t *prev;
+    struct fat_memory_owner_t *next;
+};
+
+struct fat_memory_stats_t {
+    size_t budget; //FAT_MEMORY_UNLIMITED if none
+    size_t used; //Pinned plus reclaimable bytes of every owner
+    size_t reclaimable;
+    size_t peak;
+    size_t owners;
+    uint64_t evictions; //Reclaim calls that freed something
+    uint64_t evicted_bytes;
+    uint64_t reloads; //FATs read back after an eviction
+};
+
+// Sets the budget and evicts down to it at once; FAT_MEMORY_UNLIMITED turns eviction off
+int fat_memory_set_budget(size_t bytes);
+
+int fat_memory_stats(struct fat_memory_stats_t *stats);
+
+// Evicts every reclaimable buffer not in use, regardless of the budget; returns the bytes freed
+size_t fat_memory_trim(void);
+
+// Library internals: owners register once, then charge and uncharge as their buffers come and go
+void fat_memory_register(struct fat_memory_owner_t *owner, fat_memory_reclaim_t reclaim);
+
+// Drops the owner and everything still charged to it
+void fat_memory_unregister(struct fat_memory_owner_t *owner);
+
+void fat_memory_charge(struct fat_memory_owner_t *owner, ssize_t pinned, ssize_t reclaimable);
+
+// Charges bytes read back after an eviction as reclaimable and counts the reload
+void fat_memory_reloaded(struct fat_memory_owner_t *owner, size_t bytes);
+
+void fat_memory_touch(struct fat_memory_owner_t *owner);
+
+#endif //MY_FAT_16_READER_FAT_MEMORY_H
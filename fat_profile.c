@@ -0,0 +1,345 @@
+#define _GNU_SOURCE
+
+#include "fat_profile.h"
+
+#ifdef FAT_PROFILE
+
+#include <time.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+// Implementations in file_reader.c, renamed there when FAT_PROFILE is defined
+struct volume_t *fat_open_unprofiled(struct disk_t *pdisk, uint32_t first_sector);
+
+int fat_close_unprofiled(struct volume_t *pvolume);
+
+struct file_t *file_open_unprofiled(struct volume_t *pvolume, const char *file_name);
+
+size_t file_read_unprofiled(void *ptr, size_t size, size_t nmemb, struct file_t *stream);
+
+int dir_read_unprofiled(struct dir_t *pdir, struct dir_entry_t *pentry);
+
+static const char *const api_names[FAT_PROFILE_API_COUNT] = {"fat_open", "file_open", "dir_read", "file_read"};
+
+static const struct {
+    uint32_t type;
+    uint64_t config;
+} counter_events[FAT_PROFILE_COUNTER_COUNT] = {
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_CACHE_MISSES},
+        {PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+        {PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES}
+};
+
+// Counters of the calling thread, read together through the group leader
+struct thread_counters_t {
+    bool initialized;
+    int fds[FAT_PROFILE_COUNTER_COUNT]; //-1 where the kernel or the hardware refused the event
+    int leader;
+    uint64_t ids[FAT_PROFILE_COUNTER_COUNT];
+};
+
+struct profile_sample_t {
+    struct timespec start;
+    uint64_t values[FAT_PROFILE_COUNTER_COUNT];
+    bool valid[FAT_PROFILE_COUNTER_COUNT];
+};
+
+struct profile_volume_t {
+    const struct volume_t *volume; //NULL once the volume is closed
+    char label[12];
+    uint32_t serial;
+    struct fat_profile_stats_t stats[FAT_PROFILE_API_COUNT];
+    struct profile_volume_t *next;
+};
+
+static __thread struct thread_counters_t thread_counters;
+static __thread struct profile_volume_t *thread_last_volume;
+
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct profile_volume_t *registry;
+static pthread_key_t counters_key;
+static pthread_once_t profile_once = PTHREAD_ONCE_INIT;
+
+static void close_counters(void *arg) {
+    struct thread_counters_t *counters = arg;
+    for (int i = 0; i < FAT_PROFILE_COUNTER_COUNT; i++) {
+        if (counters->fds[i] >= 0) {
+            close(counters->fds[i]);
+            counters->fds[i] = -1;
+        }
+    }
+}
+
+static void report_at_exit(void) {
+    fat_profile_report(stderr);
+}
+
+static void profile_init(void) {
+    pthread_key_create(&counters_key, close_counters);
+    if (getenv("FAT_PROFILE_REPORT") != NULL) {
+        atexit(report_at_exit);
+    }
+}
+
+static struct thread_counters_t *counters_get(void) {
+    struct thread_counters_t *counters = &thread_counters;
+    if (counters->initialized) {
+        return counters;
+    }
+    pthread_once(&profile_once, profile_init);
+    counters->initialized = true;
+    counters->leader = -1;
+    for (int i = 0; i < FAT_PROFILE_COUNTER_COUNT; i++) {
+        struct perf_event_attr attr;
+        memset(&attr, 0, sizeof(attr));
+        attr.size = sizeof(attr);
+        attr.type = counter_events[i].type;
+        attr.config = counter_events[i].config;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_ID;
+        // The library's own time in the kernel (syscalls, page faults) is part of what is being measured
+        counters->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, counters->leader, PERF_FLAG_FD_CLOEXEC);
+        if (counters->fds[i] < 0) {
+            attr.exclude_kernel = 1;
+            counters->fds[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, counters->leader, PERF_FLAG_FD_CLOEXEC);
+        }
+        if (counters->fds[i] >= 0) {
+            if (counters->leader < 0) {
+                counters->leader = counters->fds[i];
+            }
+            if (ioctl(counters->fds[i], PERF_EVENT_IOC_ID, counters->ids + i) != 0) {
+                close(counters->fds[i]);
+                counters->fds[i] = -1;
+            }
+        }
+    }
+    pthread_setspecific(counters_key, counters);
+    return counters;
+}
+
+static void counters_read(struct profile_sample_t *sample) {
+    struct thread_counters_t *counters = counters_get();
+    memset(sample->valid, 0, sizeof(sample->valid));
+    if (counters->leader < 0) {
+        return;
+    }
+    // PERF_FORMAT_GROUP | PERF_FORMAT_ID: nr, then a {value, id} pair per counter
+    uint64_t buffer[1 + 2 * FAT_PROFILE_COUNTER_COUNT];
+    ssize_t got = read(counters->leader, buffer, sizeof(buffer));
+    if (got < (ssize_t) sizeof(uint64_t)) {
+        return;
+    }
+    for (uint64_t k = 0; k < buffer[0] && k < FAT_PROFILE_COUNTER_COUNT; k++) {
+        for (int i = 0; i < FAT_PROFILE_COUNTER_COUNT; i++) {
+            if (counters->fds[i] >= 0 && counters->ids[i] == buffer[2 + 2 * k]) {
+                sample->values[i] = buffer[1 + 2 * k];
+                sample->valid[i] = true;
+            }
+        }
+    }
+}
+
+static void profile_begin(struct profile_sample_t *sample) {
+    counters_read(sample);
+    clock_gettime(CLOCK_MONOTONIC, &sample->start);
+}
+
+static struct profile_volume_t *volume_record(const struct volume_t *pvolume) {
+    struct profile_volume_t *record = thread_last_volume;
+    if (record != NULL && __atomic_load_n(&record->volume, __ATOMIC_ACQUIRE) == pvolume) {
+        return record;
+    }
+    pthread_mutex_lock(&registry_lock);
+    for (record = registry; record != NULL && record->volume != pvolume; record = record->next);
+    pthread_mutex_unlock(&registry_lock);
+    thread_last_volume = record;
+    return record;
+}
+
+static void profile_end(struct profile_sample_t *sample, const struct volume_t *pvolume, int api) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    struct profile_sample_t finish;
+    counters_read(&finish);
+    struct profile_volume_t *record = volume_record(pvolume);
+    if (record == NULL) {
+        return;
+    }
+    struct fat_profile_stats_t *stats = record->stats + api;
+    int64_t nanoseconds = (end.tv_sec - sample->start.tv_sec) * 1000000000LL + (end.tv_nsec - sample->start.tv_nsec);
+    __atomic_fetch_add(&stats->calls, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&stats->nanoseconds, (uint64_t) nanoseconds, __ATOMIC_RELAXED);
+    for (int i = 0; i < FAT_PROFILE_COUNTER_COUNT; i++) {
+        if (sample->valid[i] && finish.valid[i]) {
+            __atomic_fetch_add(stats->counters + i, finish.values[i] - sample->values[i], __ATOMIC_RELAXED);
+            __atomic_fetch_add(stats->counted_calls + i, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
+    struct profile_sample_t sample;
+    profile_begin(&sample);
+    struct volume_t *volume = fat_open_unprofiled(pdisk, first_sector);
+    if (volume == NULL) {
+        return NULL;
+    }
+    int error = errno;
+    struct profile_volume_t *record = calloc(1, sizeof(struct profile_volume_t));
+    if (record != NULL) {
+        memcpy(record->label, volume->super.label, sizeof(volume->super.label));
+        record->serial = volume->super.serial_number;
+        record->volume = volume;
+        pthread_mutex_lock(&registry_lock);
+        struct profile_volume_t **tail = &registry;
+        while (*tail != NULL) {
+            tail = &(*tail)->next;
+        }
+        *tail = record;
+        pthread_mutex_unlock(&registry_lock);
+        profile_end(&sample, volume, FAT_PROFILE_API_FAT_OPEN);
+    }
+    errno = error;
+    return volume;
+}
+
+int fat_close(struct volume_t *pvolume) {
+    pthread_mutex_lock(&registry_lock);
+    for (struct profile_volume_t *record = registry; record != NULL; record = record->next) {
+        if (record->volume == pvolume) {
+            // Kept for the report; a later volume at the same address gets a record of its own
+            __atomic_store_n(&record->volume, NULL, __ATOMIC_RELEASE);
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return fat_close_unprofiled(pvolume);
+}
+
+struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
+    struct profile_sample_t sample;
+    profile_begin(&sample);
+    struct file_t *file = file_open_unprofiled(pvolume, file_name);
+    int error = errno;
+    if (pvolume != NULL) {
+        profile_end(&sample, pvolume, FAT_PROFILE_API_FILE_OPEN);
+    }
+    errno = error;
+    return file;
+}
+
+size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+    struct profile_sample_t sample;
+    profile_begin(&sample);
+    size_t read = file_read_unprofiled(ptr, size, nmemb, stream);
+    int error = errno;
+    if (stream != NULL) {
+        profile_end(&sample, stream->volume, FAT_PROFILE_API_FILE_READ);
+    }
+    errno = error;
+    return read;
+}
+
+int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
+    struct profile_sample_t sample;
+    profile_begin(&sample);
+    int result = dir_read_unprofiled(pdir, pentry);
+    int error = errno;
+    if (pdir != NULL) {
+        profile_end(&sample, pdir->volume, FAT_PROFILE_API_DIR_READ);
+    }
+    errno = error;
+    return result;
+}
+
+int fat_profile_get(const struct volume_t *pvolume, int api, struct fat_profile_stats_t *stats) {
+    if (pvolume == NULL || stats == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (api < 0 || api >= FAT_PROFILE_API_COUNT) {
+        errno = EINVAL;
+        return -1;
+    }
+    struct profile_volume_t *record = volume_record(pvolume);
+    if (record == NULL) {
+        errno = ENOENT;
+        return -1;
+    }
+    struct fat_profile_stats_t *source = record->stats + api;
+    stats->calls = __atomic_load_n(&source->calls, __ATOMIC_RELAXED);
+    stats->nanoseconds = __atomic_load_n(&source->nanoseconds, __ATOMIC_RELAXED);
+    for (int i = 0; i < FAT_PROFILE_COUNTER_COUNT; i++) {
+        stats->counters[i] = __atomic_load_n(source->counters + i, __ATOMIC_RELAXED);
+        stats->counted_calls[i] = __atomic_load_n(source->counted_calls + i, __ATOMIC_RELAXED);
+    }
+    return 0;
+}
+
+static void print_counter(FILE *out, const struct fat_profile_stats_t *stats, int counter) {
+    if (stats->counted_calls[counter] == 0) {
+        fprintf(out, " %12s", "n/a");
+    } else {
+        fprintf(out, " %12.1f", (double) stats->counters[counter] / (double) stats->counted_calls[counter]);
+    }
+}
+
+int fat_profile_report(FILE *out) {
+    if (out == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    pthread_mutex_lock(&registry_lock);
+    for (struct profile_volume_t *record = registry; record != NULL; record = record->next) {
+        fprintf(out, "volume \"%.11s\" serial %08" PRIX32 "%s\n", record->label, record->serial,
+                record->volume == NULL ? " (closed)" : "");
+        fprintf(out, "  %-10s %10s %12s %12s %12s %12s %12s %12s  (per call)\n", "api", "calls", "ns", "cycles",
+                "instructions", "cache-miss", "branch-miss", "ctx-switch");
+        for (int api = 0; api < FAT_PROFILE_API_COUNT; api++) {
+            struct fat_profile_stats_t stats;
+            struct fat_profile_stats_t *source = record->stats + api;
+            memcpy(&stats, source, sizeof(stats));
+            if (stats.calls == 0) {
+                continue;
+            }
+            fprintf(out, "  %-10s %10" PRIu64 " %12.1f", api_names[api], stats.calls,
+                    (double) stats.nanoseconds / (double) stats.calls);
+            for (int counter = 0; counter < FAT_PROFILE_COUNTER_COUNT; counter++) {
+                print_counter(out, &stats, counter);
+            }
+            fprintf(out, "\n");
+        }
+    }
+    pthread_mutex_unlock(&registry_lock);
+    return 0;
+}
+
+void fat_profile_reset(void) {
+    pthread_mutex_lock(&registry_lock);
+    for (struct profile_volume_t *record = registry; record != NULL; record = record->next) {
+        memset(record->stats, 0, sizeof(record->stats));
+    }
+    pthread_mutex_unlock(&registry_lock);
+}
+
+#else
+
+int fat_profile_get(const struct volume_t *pvolume, int api, struct fat_profile_stats_t *stats) {
+    (void) pvolume;
+    (void) api;
+    (void) stats;
+    errno = ENOSYS;
+    return -1;
+}
+
+int fat_profile_report(FILE *out) {
+    (void) out;
+    errno = ENOSYS;
+    return -1;
+}
+
+void fat_profile_reset(void) {
+}
+
+#endif
@@ -0,0 +1,41 @@
+#ifndef MY_FAT_16_READER_FAT_PROFILE_H
+#define MY_FAT_16_READER_FAT_PROFILE_H
+
+#include "file_reader.h"
+
+/*
+ * Profiling build: compile every file with -DFAT_PROFILE and link fat_profile.c. fat_open, file_open, dir_read and
+ * file_read are then timed with perf_event_open counters of the calling thread, per API and per volume.
+ * Setting FAT_PROFILE_REPORT in the environment prints the report to stderr at exit.
+ * Without FAT_PROFILE the functions below fail with ENOSYS and the library has no profiling cost.
+ */
+
+#define FAT_PROFILE_API_FAT_OPEN 0
+#define FAT_PROFILE_API_FILE_OPEN 1
+#define FAT_PROFILE_API_DIR_READ 2
+#define FAT_PROFILE_API_FILE_READ 3
+#define FAT_PROFILE_API_COUNT 4
+
+#define FAT_PROFILE_CYCLES 0
+#define FAT_PROFILE_INSTRUCTIONS 1
+#define FAT_PROFILE_CACHE_MISSES 2
+#define FAT_PROFILE_BRANCH_MISSES 3
+#define FAT_PROFILE_CONTEXT_SWITCHES 4
+#define FAT_PROFILE_COUNTER_COUNT 5
+
+struct fat_profile_stats_t {
+    uint64_t calls;
+    uint64_t nanoseconds;
+    uint64_t counters[FAT_PROFILE_COUNTER_COUNT];
+    uint64_t counted_calls[FAT_PROFILE_COUNTER_COUNT]; //Calls the counter was available for; 0 = not supported here
+};
+
+// Stats of one API on an open volume, accumulated since it was opened or since fat_profile_reset
+int fat_profile_get(const struct volume_t *pvolume, int api, struct fat_profile_stats_t *stats);
+
+// One block per volume ever opened, closed volumes included
+int fat_profile_report(FILE *out);
+
+void fat_profile_reset(void);
+
+#endif //MY_FAT_16_READER_FAT_PROFILE_H
@@ -0,0 +1,55 @@
+#include "fat_trace.h"
+
+int main(int argc, char **argv) {
+    int threads = 1;
+    int flags = 0;
+    int arg = 1;
+    for (; arg < argc && argv[arg][0] == '-'; arg++) {
+        if (strcmp(argv[arg], "-m") == 0) {
+            flags |= FAT_REPLAY_MAX_SPEED;
+        } else if (strcmp(argv[arg], "-t") == 0 && arg + 1 < argc) {
+            threads = (int) strtol(argv[++arg], NULL, 10);
+        } else {
+            break;
+        }
+    }
+    if (argc - arg != 2 || threads <= 0) {
+        fprintf(stderr, "usage: %s [-t <threads>] [-m] <image>[@<first sector>] <trace>\n", argv[0]);
+        fprintf(stderr, "  -m  replay at maximum speed instead of the recorded timing\n");
+        return 2;
+    }
+    char *image = argv[arg];
+    uint32_t first_sector = 0;
+    char *at = strrchr(image, '@');
+    if (at != NULL) {
+        *at = '\0';
+        first_sector = (uint32_t) strtoul(at + 1, NULL, 10);
+    }
+    struct fat_trace_t *trace = fat_trace_load(argv[arg + 1]);
+    if (trace == NULL) {
+        perror(argv[arg + 1]);
+        return 1;
+    }
+    struct disk_t *disk = disk_open_from_file(image);
+    struct volume_t *volume = disk != NULL ? fat_open(disk, first_sector) : NULL;
+    if (volume == NULL) {
+        perror(image);
+        if (disk != NULL) {
+            disk_close(disk);
+        }
+        fat_trace_free(trace);
+        return 1;
+    }
+    struct fat_replay_t replay;
+    int status = 0;
+    if (fat_trace_replay(volume, trace, threads, flags, &replay) != 0) {
+        perror("fat_trace_replay");
+        status = 1;
+    } else {
+        fat_replay_write(&replay, stdout);
+    }
+    fat_close(volume);
+    disk_close(disk);
+    fat_trace_free(trace);
+    return status;
+}
@@ -0,0 +1,576 @@
+#define _GNU_SOURCE
+
+#include "fat_server.h"
+
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+struct fat_server_handle_t {
+    uint32_t volume;
+    struct file_t *file;
+    struct dir_t *dir;
+};
+
+struct fat_server_connection_t {
+    int fd;
+    int shm_fd;
+    uint8_t *shm;
+    struct fat_server_handle_t *handles;
+    uint32_t handle_capacity;
+    bool has_pending; //Reply that hit EAGAIN, sent once the socket is writable
+    struct fat_server_reply pending;
+    struct fat_server_connection_t *prev;
+    struct fat_server_connection_t *next;
+};
+
+struct fat_server_t *fat_server_create(const char *socket_path) {
+    if (socket_path == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (strlen(socket_path) >= sizeof(address.sun_path)) {
+        errno = ENAMETOOLONG;
+        return NULL;
+    }
+    strcpy(address.sun_path, socket_path);
+
+    struct fat_server_t *server = calloc(1, sizeof(struct fat_server_t));
+    if (server == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    server->listen_fd = -1;
+    server->epoll_fd = -1;
+    server->stop_fd = -1;
+    server->socket_path = strdup(socket_path);
+    if (server->socket_path == NULL) {
+        free(server);
+        errno = ENOMEM;
+        return NULL;
+    }
+    server->listen_fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    server->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    server->stop_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (server->listen_fd < 0 || server->epoll_fd < 0 || server->stop_fd < 0) {
+        fat_server_free(server);
+        return NULL;
+    }
+    unlink(socket_path);
+    if (bind(server->listen_fd, (struct sockaddr *) &address, sizeof(address)) != 0 ||
+        listen(server->listen_fd, SOMAXCONN) != 0) {
+        int error = errno;
+        fat_server_free(server);
+        errno = error;
+        return NULL;
+    }
+    // The listening socket and the stop eventfd are told apart from connections by their data.ptr
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = &server->listen_fd;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->listen_fd, &event) != 0) {
+        fat_server_free(server);
+        return NULL;
+    }
+    event.data.ptr = &server->stop_fd;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, server->stop_fd, &event) != 0) {
+        fat_server_free(server);
+        return NULL;
+    }
+    return server;
+}
+
+int fat_server_add_volume(struct fat_server_t *server, const char *name, struct volume_t *pvolume) {
+    if (server == NULL || name == NULL || pvolume == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (strlen(name) >= FAT_SERVER_MAX_NAME) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+    struct fat_server_volume_t *volumes = realloc(server->volumes,
+                                                  sizeof(struct fat_server_volume_t) * (server->volume_count + 1));
+    if (volumes == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    server->volumes = volumes;
+    strcpy(volumes[server->volume_count].name, name);
+    volumes[server->volume_count].volume = pvolume;
+    return (int) server->volume_count++;
+}
+
+static void connection_close(struct fat_server_t *server, struct fat_server_connection_t *connection) {
+    for (uint32_t i = 0; i < connection->handle_capacity; i++) {
+        if (connection->handles[i].file != NULL) {
+            file_close(connection->handles[i].file);
+        }
+        if (connection->handles[i].dir != NULL) {
+            dir_close(connection->handles[i].dir);
+        }
+    }
+    free(connection->handles);
+    if (connection->shm != NULL) {
+        munmap(connection->shm, FAT_SERVER_SHM_SIZE);
+    }
+    if (connection->shm_fd >= 0) {
+        close(connection->shm_fd);
+    }
+    epoll_ctl(server->epoll_fd, EPOLL_CTL_DEL, connection->fd, NULL);
+    close(connection->fd);
+    if (connection->prev != NULL) {
+        connection->prev->next = connection->next;
+    } else {
+        server->connections = connection->next;
+    }
+    if (connection->next != NULL) {
+        connection->next->prev = connection->prev;
+    }
+    free(connection);
+}
+
+// Sends reply, parking it on the connection when the client's socket buffer is full
+static int connection_reply(struct fat_server_t *server, struct fat_server_connection_t *connection,
+                            const struct fat_server_reply *reply) {
+    ssize_t sent = send(connection->fd, reply, sizeof(struct fat_server_reply), MSG_NOSIGNAL);
+    if (sent == (ssize_t) sizeof(struct fat_server_reply)) {
+        return 0;
+    }
+    if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        connection->pending = *reply;
+        connection->has_pending = true;
+        struct epoll_event event;
+        event.events = EPOLLOUT;
+        event.data.ptr = connection;
+        return epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event);
+    }
+    return -1;
+}
+
+static void server_accept(struct fat_server_t *server) {
+    while (1) {
+        int fd = accept4(server->listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct fat_server_connection_t *connection = calloc(1, sizeof(struct fat_server_connection_t));
+        if (connection == NULL) {
+            close(fd);
+            continue;
+        }
+        connection->fd = fd;
+        connection->shm_fd = memfd_create("fat_server", MFD_CLOEXEC);
+        if (connection->shm_fd < 0 || ftruncate(connection->shm_fd, FAT_SERVER_SHM_SIZE) != 0) {
+            if (connection->shm_fd >= 0) {
+                close(connection->shm_fd);
+            }
+            free(connection);
+            close(fd);
+            continue;
+        }
+        // Pages are only backed once a read or listing touches them, so idle clients cost no memory
+        connection->shm = mmap(NULL, FAT_SERVER_SHM_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, connection->shm_fd, 0);
+        if (connection->shm == MAP_FAILED) {
+            close(connection->shm_fd);
+            free(connection);
+            close(fd);
+            continue;
+        }
+        connection->next = server->connections;
+        if (server->connections != NULL) {
+            server->connections->prev = connection;
+        }
+        server->connections = connection;
+
+        struct epoll_event event;
+        event.events = EPOLLIN;
+        event.data.ptr = connection;
+        if (epoll_ctl(server->epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            connection_close(server, connection);
+            continue;
+        }
+
+        struct fat_server_reply hello;
+        memset(&hello, 0, sizeof(hello));
+        hello.status = FAT_SERVER_SHM_SIZE;
+        struct iovec iov = {.iov_base = &hello, .iov_len = sizeof(hello)};
+        char control[CMSG_SPACE(sizeof(int))];
+        memset(control, 0, sizeof(control));
+        struct msghdr message;
+        memset(&message, 0, sizeof(message));
+        message.msg_iov = &iov;
+        message.msg_iovlen = 1;
+        message.msg_control = control;
+        message.msg_controllen = sizeof(control);
+        struct cmsghdr *cmsg = CMSG_FIRSTHDR(&message);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+        memcpy(CMSG_DATA(cmsg), &connection->shm_fd, sizeof(int));
+        if (sendmsg(fd, &message, MSG_NOSIGNAL) != (ssize_t) sizeof(hello)) {
+            connection_close(server, connection);
+        }
+    }
+}
+
+static int handle_new(struct fat_server_connection_t *connection) {
+    for (uint32_t i = 0; i < connection->handle_capacity; i++) {
+        if (connection->handles[i].file == NULL && connection->handles[i].dir == NULL) {
+            return (int) i;
+        }
+    }
+    if (connection->handle_capacity == FAT_SERVER_MAX_HANDLES) {
+        errno = EMFILE;
+        return -1;
+    }
+    uint32_t capacity = connection->handle_capacity ? connection->handle_capacity * 2 : 8;
+    struct fat_server_handle_t *handles = realloc(connection->handles, sizeof(struct fat_server_handle_t) * capacity);
+    if (handles == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(handles + connection->handle_capacity, 0,
+           sizeof(struct fat_server_handle_t) * (capacity - connection->handle_capacity));
+    connection->handles = handles;
+    int handle = (int) connection->handle_capacity;
+    connection->handle_capacity = capacity;
+    return handle;
+}
+
+static struct fat_server_handle_t *handle_get(struct fat_server_connection_t *connection, uint32_t handle) {
+    if (handle >= connection->handle_capacity) {
+        errno = EBADF;
+        return NULL;
+    }
+    return connection->handles + handle;
+}
+
+// Packs as many entries as fit into the window
+static int serve_dir_read(struct fat_server_connection_t *connection, struct dir_t *pdir) {
+    size_t used = 0;
+    int count = 0;
+    while (FAT_SERVER_SHM_SIZE - used >= sizeof(struct fat_server_dir_record) + LFN_MAX_NAME_LENGTH) {
+        struct dir_entry_t entry;
+        int result = dir_read(pdir, &entry);
+        if (result < 0) {
+            return count == 0 ? -1 : count;
+        }
+        if (result == 1) {
+            break;
+        }
+        struct fat_server_dir_record record;
+        memcpy(record.name, entry.name, sizeof(record.name));
+        record.size = entry.size;
+        record.flags = (entry.is_archived ? FAT_SERVER_DIR_ARCHIVED : 0) |
+                       (entry.is_readonly ? FAT_SERVER_DIR_READONLY : 0) |
+                       (entry.is_system ? FAT_SERVER_DIR_SYSTEM : 0) |
+                       (entry.is_hidden ? FAT_SERVER_DIR_HIDDEN : 0) |
+                       (entry.is_directory ? FAT_SERVER_DIR_DIRECTORY : 0) |
+                       (entry.has_long_name ? FAT_SERVER_DIR_LONG_NAME : 0);
+        record.long_name_length = entry.has_long_name ? (uint16_t) strlen(entry.long_name) : 0;
+        memcpy(connection->shm + used, &record, sizeof(record));
+        used += sizeof(record);
+        if (record.long_name_length > 0) {
+            memcpy(connection->shm + used, entry.long_name, record.long_name_length);
+            used += record.long_name_length;
+        }
+        count++;
+    }
+    return count;
+}
+
+// Entry of the directory at first_cluster in its parent, which its own ".." entry points at
+static int serve_stat_directory(struct volume_t *volume, uint16_t first_cluster, struct SFN *entry) {
+    uint32_t entry_count;
+    struct SFN *entries = fat_load_directory(volume, first_cluster, &entry_count);
+    if (entries == NULL) {
+        return -1;
+    }
+    uint16_t parent_cluster = 0;
+    for (uint32_t i = 0; i < entry_count && entries[i].filename[0] != 0x00; i++) {
+        if (memcmp(entries[i].filename, "..         ", sizeof(entries[i].filename)) == 0) {
+            parent_cluster = entries[i].low_order_address_of_first_cluster;
+            break;
+        }
+    }
+    free(entries);
+    entries = fat_load_directory(volume, parent_cluster, &entry_count);
+    if (entries == NULL) {
+        return -1;
+    }
+    for (uint32_t i = 0; i < entry_count && entries[i].filename[0] != 0x00; i++) {
+        const struct SFN *curr = entries + i;
+        if (curr->filename[0] == (char) 0xE5 || curr->filename[0] == '.' ||
+            curr->file_attributes == FAT_ATTR_LONG_NAME || !(curr->file_attributes & FAT_ATTR_DIRECTORY)) {
+            continue;
+        }
+        if (curr->low_order_address_of_first_cluster == first_cluster) {
+            memcpy(entry, curr, sizeof(struct SFN));
+            free(entries);
+            return 0;
+        }
+    }
+    free(entries);
+    errno = ENOENT;
+    return -1;
+}
+
+static void serve_request(struct fat_server_t *server, struct fat_server_connection_t *connection,
+                          const struct fat_server_request *request, const char *path,
+                          struct fat_server_reply *reply) {
+    struct volume_t *volume = NULL;
+    if (request->op == FAT_SERVER_OP_FILE_OPEN || request->op == FAT_SERVER_OP_DIR_OPEN ||
+        request->op == FAT_SERVER_OP_STAT) {
+        if (request->volume >= server->volume_count) {
+            reply->status = -ENODEV;
+            return;
+        }
+        volume = server->volumes[request->volume].volume;
+    }
+    struct fat_server_handle_t *handle;
+    int index;
+    switch (request->op) {
+        case FAT_SERVER_OP_MOUNT:
+            for (uint32_t i = 0; i < server->volume_count; i++) {
+                if (strcmp(server->volumes[i].name, path) == 0) {
+                    reply->status = (int32_t) i;
+                    return;
+                }
+            }
+            reply->status = -ENODEV;
+            return;
+        case FAT_SERVER_OP_FILE_OPEN:
+            index = handle_new(connection);
+            if (index < 0) {
+                break;
+            }
+            connection->handles[index].file = file_open(volume, path);
+            if (connection->handles[index].file == NULL) {
+                break;
+            }
+            connection->handles[index].volume = request->volume;
+            memcpy(&reply->entry, connection->handles[index].file->entry, sizeof(struct SFN));
+            reply->status = index;
+            return;
+        case FAT_SERVER_OP_FILE_READ:
+            handle = handle_get(connection, request->handle);
+            if (handle == NULL || handle->file == NULL) {
+                reply->status = -EBADF;
+                return;
+            }
+            if (file_seek(handle->file, (int32_t) request->offset, SEEK_SET) < 0) {
+                break;
+            }
+            {
+                size_t length = request->length < FAT_SERVER_SHM_SIZE ? request->length : FAT_SERVER_SHM_SIZE;
+                errno = 0;
+                size_t read = file_read(connection->shm, 1, length, handle->file);
+                if (read == (size_t) -1 || (read == 0 && errno != 0)) {
+                    break;
+                }
+                reply->status = (int32_t) read;
+            }
+            return;
+        case FAT_SERVER_OP_FILE_CLOSE:
+        case FAT_SERVER_OP_DIR_CLOSE:
+            handle = handle_get(connection, request->handle);
+            if (handle == NULL || (handle->file == NULL && handle->dir == NULL)) {
+                reply->status = -EBADF;
+                return;
+            }
+            if (handle->file != NULL) {
+                file_close(handle->file);
+            } else {
+                dir_close(handle->dir);
+            }
+            memset(handle, 0, sizeof(struct fat_server_handle_t));
+            reply->status = 0;
+            return;
+        case FAT_SERVER_OP_DIR_OPEN:
+            index = handle_new(connection);
+            if (index < 0) {
+                break;
+            }
+            connection->handles[index].dir = dir_open(volume, path);
+            if (connection->handles[index].dir == NULL) {
+                break;
+            }
+            connection->handles[index].volume = request->volume;
+            reply->status = index;
+            return;
+        case FAT_SERVER_OP_DIR_READ:
+            handle = handle_get(connection, request->handle);
+            if (handle == NULL || handle->dir == NULL) {
+                reply->status = -EBADF;
+                return;
+            }
+            index = serve_dir_read(connection, handle->dir);
+            if (index < 0) {
+                break;
+            }
+            reply->status = index;
+            return;
+        case FAT_SERVER_OP_STAT: {
+            struct file_t *file = file_open(volume, path);
+            if (file != NULL) {
+                memcpy(&reply->entry, file->entry, sizeof(struct SFN));
+                file_close(file);
+                reply->status = 0;
+                return;
+            }
+            if (errno != EISDIR && errno != ENOTDIR) {
+                break;
+            }
+            struct dir_t *dir = dir_open(volume, path);
+            if (dir == NULL) {
+                break;
+            }
+            int result = 0;
+            if (dir->first_cluster == 0) {
+                reply->entry.file_attributes = FAT_ATTR_DIRECTORY;
+            } else {
+                result = serve_stat_directory(volume, dir->first_cluster, &reply->entry);
+            }
+            dir_close(dir);
+            if (result < 0) {
+                break;
+            }
+            reply->is_directory = 1;
+            reply->status = 0;
+            return;
+        }
+        default:
+            reply->status = -EINVAL;
+            return;
+    }
+    reply->status = errno ? -errno : -EIO;
+}
+
+// Serves every request queued on the connection; returns -1 once the connection is gone
+static int connection_serve(struct fat_server_t *server, struct fat_server_connection_t *connection) {
+    uint8_t message[sizeof(struct fat_server_request) + FAT_SERVER_MAX_PATH + 1];
+    while (!connection->has_pending) {
+        ssize_t length = recv(connection->fd, message, sizeof(message), MSG_TRUNC);
+        if (length < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            return 0;
+        }
+        if (length <= 0) {
+            connection_close(server, connection);
+            return -1;
+        }
+        struct fat_server_reply reply;
+        memset(&reply, 0, sizeof(reply));
+        struct fat_server_request request;
+        if ((size_t) length < sizeof(request)) {
+            reply.status = -EINVAL;
+        } else {
+            memcpy(&request, message, sizeof(request));
+            if ((size_t) length > sizeof(message) - 1 ||
+                request.path_length != (size_t) length - sizeof(request)) {
+                reply.status = request.path_length > FAT_SERVER_MAX_PATH ? -ENAMETOOLONG : -EINVAL;
+            } else {
+                char *path = (char *) message + sizeof(request);
+                path[request.path_length] = '\0';
+                serve_request(server, connection, &request, path, &reply);
+            }
+        }
+        if (connection_reply(server, connection, &reply) != 0) {
+            connection_close(server, connection);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static void connection_writable(struct fat_server_t *server, struct fat_server_connection_t *connection) {
+    connection->has_pending = false;
+    if (connection_reply(server, connection, &connection->pending) != 0) {
+        connection_close(server, connection);
+        return;
+    }
+    if (connection->has_pending) {
+        return;
+    }
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = connection;
+    if (epoll_ctl(server->epoll_fd, EPOLL_CTL_MOD, connection->fd, &event) != 0) {
+        connection_close(server, connection);
+        return;
+    }
+    connection_serve(server, connection);
+}
+
+int fat_server_run(struct fat_server_t *server) {
+    if (server == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    struct epoll_event events[FAT_SERVER_MAX_EVENTS];
+    while (1) {
+        int count = epoll_wait(server->epoll_fd, events, FAT_SERVER_MAX_EVENTS, -1);
+        if (count < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        for (int i = 0; i < count; i++) {
+            if (events[i].data.ptr == &server->stop_fd) {
+                uint64_t value;
+                if (read(server->stop_fd, &value, sizeof(value)) < 0) {
+                    value = 0;
+                }
+                return 0;
+            }
+            if (events[i].data.ptr == &server->listen_fd) {
+                server_accept(server);
+                continue;
+            }
+            struct fat_server_connection_t *connection = events[i].data.ptr;
+            if (events[i].events & (EPOLLERR | EPOLLHUP) && !(events[i].events & EPOLLIN)) {
+                connection_close(server, connection);
+            } else if (events[i].events & EPOLLOUT) {
+                connection_writable(server, connection);
+            } else {
+                connection_serve(server, connection);
+            }
+        }
+    }
+}
+
+void fat_server_stop(struct fat_server_t *server) {
+    if (server == NULL) {
+        return;
+    }
+    uint64_t one = 1;
+    if (write(server->stop_fd, &one, sizeof(one)) < 0) {
+        return;
+    }
+}
+
+void fat_server_free(struct fat_server_t *server) {
+    if (server == NULL) {
+        return;
+    }
+    while (server->connections != NULL) {
+        connection_close(server, server->connections);
+    }
+    if (server->listen_fd >= 0) {
+        close(server->listen_fd);
+        unlink(server->socket_path);
+    }
+    if (server->epoll_fd >= 0) {
+        close(server->epoll_fd);
+    }
+    if (server->stop_fd >= 0) {
+        close(server->stop_fd);
+    }
+    free(server->socket_path);
+    free(server->volumes);
+    free(server);
+}
@@ -0,0 +1,90 @@
+#ifndef MY_FAT_16_READER_FAT_SERVER_H
+#define MY_FAT_16_READER_FAT_SERVER_H
+
+#include "file_reader.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#define FAT_SERVER_SHM_SIZE (256 * 1024) //Per connection window file data and listings are returned through
+#define FAT_SERVER_MAX_NAME 64
+#define FAT_SERVER_MAX_PATH 1024
+#define FAT_SERVER_MAX_HANDLES 4096 //Open files and directories per connection
+#define FAT_SERVER_MAX_EVENTS 64
+
+#define FAT_SERVER_OP_MOUNT 1 //path = volume name, status = volume index
+#define FAT_SERVER_OP_FILE_OPEN 2 //path, status = handle, entry filled
+#define FAT_SERVER_OP_FILE_READ 3 //handle, offset, length; status = bytes placed at the start of the window
+#define FAT_SERVER_OP_FILE_CLOSE 4
+#define FAT_SERVER_OP_DIR_OPEN 5 //path, status = handle
+#define FAT_SERVER_OP_DIR_READ 6 //handle; status = fat_server_dir_record count placed in the window
+#define FAT_SERVER_OP_DIR_CLOSE 7
+#define FAT_SERVER_OP_STAT 8 //path, entry filled and is_directory set
+
+/*
+ * Protocol over a SOCK_SEQPACKET Unix socket, one message per request and per reply:
+ *   accept  -> server sends a fat_server_reply with status = window size and a memfd in SCM_RIGHTS
+ *   request -> fat_server_request followed by path_length path bytes (no terminator)
+ *   reply   <- fat_server_reply; status < 0 is -errno
+ * A connection has at most one request in flight, so the window is only written while the client waits.
+ */
+struct __attribute__((__packed__)) fat_server_request {
+    uint8_t op;
+    uint32_t volume; //Index returned by FAT_SERVER_OP_MOUNT
+    uint32_t handle;
+    uint32_t offset;
+    uint32_t length;
+    uint16_t path_length;
+};
+
+struct __attribute__((__packed__)) fat_server_reply {
+    int32_t status;
+    uint8_t is_directory;
+    struct SFN entry;
+};
+
+// Layout of one directory entry in the window; followed by long_name_length bytes of long name
+struct __attribute__((__packed__)) fat_server_dir_record {
+    char name[13];
+    uint32_t size;
+    uint8_t flags; //FAT_SERVER_DIR_* bits
+    uint16_t long_name_length;
+};
+
+#define FAT_SERVER_DIR_ARCHIVED 0x01
+#define FAT_SERVER_DIR_READONLY 0x02
+#define FAT_SERVER_DIR_SYSTEM 0x04
+#define FAT_SERVER_DIR_HIDDEN 0x08
+#define FAT_SERVER_DIR_DIRECTORY 0x10
+#define FAT_SERVER_DIR_LONG_NAME 0x20
+
+struct fat_server_volume_t {
+    char name[FAT_SERVER_MAX_NAME];
+    struct volume_t *volume; //Owned by the caller of fat_server_add_volume
+};
+
+struct fat_server_connection_t;
+
+struct fat_server_t {
+    int listen_fd;
+    int epoll_fd;
+    int stop_fd; //eventfd written by fat_server_stop
+    char *socket_path;
+    struct fat_server_volume_t *volumes;
+    uint32_t volume_count;
+    struct fat_server_connection_t *connections;
+};
+
+struct fat_server_t *fat_server_create(const char *socket_path);
+
+int fat_server_add_volume(struct fat_server_t *server, const char *name, struct volume_t *pvolume);
+
+// Serves clients on the calling thread until fat_server_stop
+int fat_server_run(struct fat_server_t *server);
+
+// Async-signal-safe
+void fat_server_stop(struct fat_server_t *server);
+
+void fat_server_free(struct fat_server_t *server);
+
+#endif //MY_FAT_16_READER_FAT_SERVER_H
@@ -0,0 +1,77 @@
+#include "fat_server.h"
+
+#include <signal.h>
+
+static struct fat_server_t *running_server;
+
+static void on_signal(int signal_number) {
+    (void) signal_number;
+    fat_server_stop(running_server);
+}
+
+int main(int argc, char **argv) {
+    if (argc < 3) {
+        fprintf(stderr, "usage: %s <socket> <name>=<image>[@<first sector>] ...\n", argv[0]);
+        return 2;
+    }
+    int volume_count = argc - 2;
+    struct disk_t **disks = calloc((size_t) volume_count, sizeof(struct disk_t *));
+    struct volume_t **volumes = calloc((size_t) volume_count, sizeof(struct volume_t *));
+    struct fat_server_t *server = fat_server_create(argv[1]);
+    if (disks == NULL || volumes == NULL || server == NULL) {
+        perror("fat_server_create");
+        free(disks);
+        free(volumes);
+        fat_server_free(server);
+        return 1;
+    }
+    int status = 0;
+    for (int i = 0; i < volume_count && status == 0; i++) {
+        char *name = argv[i + 2];
+        char *image = strchr(name, '=');
+        if (image == NULL) {
+            fprintf(stderr, "%s: expected <name>=<image>\n", name);
+            status = 2;
+            break;
+        }
+        *image++ = '\0';
+        uint32_t first_sector = 0;
+        char *at = strrchr(image, '@');
+        if (at != NULL) {
+            *at = '\0';
+            first_sector = (uint32_t) strtoul(at + 1, NULL, 10);
+        }
+        // Mounted once here; every client shares this FAT instead of loading its own
+        disks[i] = disk_open_from_file(image);
+        volumes[i] = disks[i] != NULL ? fat_open(disks[i], first_sector) : NULL;
+        if (volumes[i] == NULL || fat_server_add_volume(server, name, volumes[i]) < 0) {
+            perror(image);
+            status = 1;
+        }
+    }
+    if (status == 0) {
+        running_server = server;
+        struct sigaction action;
+        memset(&action, 0, sizeof(action));
+        action.sa_handler = on_signal;
+        sigaction(SIGINT, &action, NULL);
+        sigaction(SIGTERM, &action, NULL);
+        signal(SIGPIPE, SIG_IGN);
+        if (fat_server_run(server) != 0) {
+            perror("fat_server_run");
+            status = 1;
+        }
+    }
+    fat_server_free(server);
+    for (int i = 0; i < volume_count; i++) {
+        if (volumes[i] != NULL) {
+            fat_close(volumes[i]);
+        }
+        if (disks[i] != NULL) {
+            disk_close(disks[i]);
+        }
+    }
+    free(disks);
+    free(volumes);
+    return status;
+}
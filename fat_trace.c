@@ -0,0 +1,772 @@
+#define _GNU_SOURCE
+
+#include "fat_trace.h"
+
+#include <time.h>
+
+#define TRACE_HEADER_SIZE 24 //Magic, version, reserved, CLOCK_REALTIME nanoseconds at the start
+#define TRACE_RECORD_MAX 96 //Encoded record without its path
+#define TRACE_HANDLES_INITIAL 256
+
+/*
+ * Record layout, integers as LEB128 varints and signed ones zigzag encoded first:
+ * op byte, thread, start minus the start of the record before it (signed), duration, handle, result (signed),
+ * then path length and bytes for opens, offset (signed) and whence for file_seek, offset, size and count for file_read.
+ * Records are written in the order calls complete, so starts are not monotonic.
+ */
+
+struct trace_handle_t {
+    const void *key; //NULL for a free slot
+    uint32_t id;
+};
+
+struct trace_state_t {
+    pthread_mutex_t lock;
+    int fd; //-1 while no trace is running
+    int error; //errno of the first failed write
+    uint64_t origin; //CLOCK_MONOTONIC nanoseconds at fat_trace_start
+    uint64_t previous_start;
+    uint32_t generation; //Invalidates thread ids handed out by an earlier trace
+    uint32_t thread_count;
+    uint32_t handle_count;
+    struct trace_handle_t *handles; //Open addressing on the handle address
+    size_t handle_capacity;
+    size_t handle_used;
+    size_t used;
+    uint8_t buffer[FAT_TRACE_BUFFER_SIZE];
+};
+
+static struct trace_state_t trace = {.lock = PTHREAD_MUTEX_INITIALIZER, .fd = -1};
+
+static __thread uint32_t thread_generation;
+static __thread uint32_t thread_id;
+
+static const char *const op_names[FAT_TRACE_OP_COUNT] = {
+        "file_open", "file_seek", "file_read", "file_close", "dir_open", "dir_read", "dir_close"
+};
+
+static uint64_t trace_clock(int clock) {
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+static size_t put_varint(uint8_t *out, uint64_t value) {
+    size_t length = 0;
+    while (value >= 0x80) {
+        out[length++] = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    out[length++] = (uint8_t) value;
+    return length;
+}
+
+static size_t put_signed(uint8_t *out, int64_t value) {
+    return put_varint(out, ((uint64_t) value << 1) ^ (uint64_t) (value >> 63));
+}
+
+static void trace_write(const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    while (length > 0) {
+        ssize_t written = write(trace.fd, bytes, length);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (trace.error == 0) {
+                trace.error = errno;
+            }
+            return;
+        }
+        bytes += written;
+        length -= (size_t) written;
+    }
+}
+
+static void trace_flush(void) {
+    trace_write(trace.buffer, trace.used);
+    trace.used = 0;
+}
+
+static void trace_append(const void *data, size_t length) {
+    if (length > FAT_TRACE_BUFFER_SIZE - trace.used) {
+        trace_flush();
+        if (length > FAT_TRACE_BUFFER_SIZE) {
+            trace_write(data, length);
+            return;
+        }
+    }
+    memcpy(trace.buffer + trace.used, data, length);
+    trace.used += length;
+}
+
+static size_t handle_slot(const void *key, size_t capacity) {
+    return (size_t) (((uintptr_t) key >> 4) * 0x9E3779B97F4A7C15u) & (capacity - 1);
+}
+
+static bool handles_grow(void) {
+    size_t capacity = trace.handle_capacity == 0 ? TRACE_HANDLES_INITIAL : trace.handle_capacity * 2;
+    struct trace_handle_t *handles = calloc(capacity, sizeof(struct trace_handle_t));
+    if (handles == NULL) {
+        return false;
+    }
+    for (size_t i = 0; i < trace.handle_capacity; i++) {
+        if (trace.handles[i].key != NULL) {
+            size_t slot = handle_slot(trace.handles[i].key, capacity);
+            while (handles[slot].key != NULL) {
+                slot = (slot + 1) & (capacity - 1);
+            }
+            handles[slot] = trace.handles[i];
+        }
+    }
+    free(trace.handles);
+    trace.handles = handles;
+    trace.handle_capacity = capacity;
+    return true;
+}
+
+// Id of key, given a new one when it is opened or first seen; released removes it, as the address may be reused
+static uint32_t handle_id(const void *key, bool opened, bool released) {
+    if (key == NULL) {
+        return 0;
+    }
+    if (trace.handle_capacity != 0) {
+        size_t slot = handle_slot(key, trace.handle_capacity);
+        while (trace.handles[slot].key != NULL && trace.handles[slot].key != key) {
+            slot = (slot + 1) & (trace.handle_capacity - 1);
+        }
+        if (trace.handles[slot].key == key) {
+            uint32_t id = trace.handles[slot].id;
+            if (opened) {
+                trace.handles[slot].id = ++trace.handle_count;
+                return trace.handles[slot].id;
+            }
+            if (released) {
+                // Backward shift, so no probe sequence runs through the freed slot
+                size_t hole = slot;
+                for (size_t next = (hole + 1) & (trace.handle_capacity - 1); trace.handles[next].key != NULL;
+                     next = (next + 1) & (trace.handle_capacity - 1)) {
+                    size_t home = handle_slot(trace.handles[next].key, trace.handle_capacity);
+                    if (((next - home) & (trace.handle_capacity - 1)) >= ((next - hole) & (trace.handle_capacity - 1))) {
+                        trace.handles[hole] = trace.handles[next];
+                        hole = next;
+                    }
+                }
+                trace.handles[hole].key = NULL;
+                trace.handle_used--;
+            }
+            return id;
+        }
+    }
+    uint32_t id = ++trace.handle_count;
+    if (released || ((trace.handle_used + 1) * 2 > trace.handle_capacity && !handles_grow())) {
+        return id;
+    }
+    size_t slot = handle_slot(key, trace.handle_capacity);
+    while (trace.handles[slot].key != NULL) {
+        slot = (slot + 1) & (trace.handle_capacity - 1);
+    }
+    trace.handles[slot].key = key;
+    trace.handles[slot].id = id;
+    trace.handle_used++;
+    return id;
+}
+
+static void trace_record(const struct fat_trace_event_t *event) {
+    pthread_mutex_lock(&trace.lock);
+    if (trace.fd < 0) {
+        // Stopped while the call was running
+        pthread_mutex_unlock(&trace.lock);
+        return;
+    }
+    if (thread_generation != trace.generation) {
+        thread_generation = trace.generation;
+        thread_id = trace.thread_count++;
+    }
+    bool opened = event->op == FAT_TRACE_FILE_OPEN || event->op == FAT_TRACE_DIR_OPEN;
+    bool released = event->op == FAT_TRACE_FILE_CLOSE || event->op == FAT_TRACE_DIR_CLOSE;
+    // A call that began before the trace did counts as starting with it
+    uint64_t start = event->start > trace.origin ? event->start - trace.origin : 0;
+    uint8_t record[TRACE_RECORD_MAX];
+    size_t length = 0;
+    record[length++] = (uint8_t) event->op;
+    length += put_varint(record + length, thread_id);
+    length += put_signed(record + length, (int64_t) (start - trace.previous_start));
+    length += put_varint(record + length, event->end - event->start);
+    length += put_varint(record + length, handle_id(event->handle, opened, released));
+    length += put_signed(record + length, event->result);
+    trace.previous_start = start;
+    size_t path_length = 0;
+    if (opened) {
+        path_length = event->path != NULL ? strlen(event->path) : 0;
+        length += put_varint(record + length, path_length);
+    } else if (event->op == FAT_TRACE_FILE_SEEK) {
+        length += put_signed(record + length, event->offset);
+        length += put_varint(record + length, (uint64_t) event->whence);
+    } else if (event->op == FAT_TRACE_FILE_READ) {
+        length += put_varint(record + length, (uint64_t) event->offset);
+        length += put_varint(record + length, event->size);
+        length += put_varint(record + length, event->count);
+    }
+    trace_append(record, length);
+    if (path_length > 0) {
+        trace_append(event->path, path_length);
+    }
+    pthread_mutex_unlock(&trace.lock);
+}
+
+int fat_trace_start(const char *path) {
+    if (path == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    pthread_mutex_lock(&trace.lock);
+    if (trace.fd >= 0) {
+        pthread_mutex_unlock(&trace.lock);
+        errno = EBUSY;
+        return -1;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        pthread_mutex_unlock(&trace.lock);
+        return -1;
+    }
+    uint8_t header[TRACE_HEADER_SIZE] = {0};
+    memcpy(header, FAT_TRACE_MAGIC, 8);
+    uint32_t version = FAT_TRACE_VERSION;
+    memcpy(header + 8, &version, sizeof(version));
+    uint64_t realtime = trace_clock(CLOCK_REALTIME);
+    memcpy(header + 16, &realtime, sizeof(realtime));
+    trace.fd = fd;
+    trace.error = 0;
+    trace.used = 0;
+    trace.origin = trace_clock(CLOCK_MONOTONIC);
+    trace.previous_start = 0;
+    trace.generation++;
+    trace.thread_count = 0;
+    trace.handle_count = 0;
+    trace_append(header, sizeof(header));
+    __atomic_store_n(&fat_trace_hook, trace_record, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&trace.lock);
+    return 0;
+}
+
+int fat_trace_stop(void) {
+    pthread_mutex_lock(&trace.lock);
+    if (trace.fd < 0) {
+        pthread_mutex_unlock(&trace.lock);
+        errno = EINVAL;
+        return -1;
+    }
+    fat_trace_hook_t expected = trace_record;
+    __atomic_compare_exchange_n(&fat_trace_hook, &expected, NULL, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+    trace_flush();
+    if (close(trace.fd) != 0 && trace.error == 0) {
+        trace.error = errno;
+    }
+    trace.fd = -1;
+    free(trace.handles);
+    trace.handles = NULL;
+    trace.handle_capacity = 0;
+    trace.handle_used = 0;
+    int error = trace.error;
+    pthread_mutex_unlock(&trace.lock);
+    if (error != 0) {
+        errno = error;
+        return -1;
+    }
+    return 0;
+}
+
+static void stop_at_exit(void) {
+    fat_trace_stop();
+}
+
+// FAT_TRACE=<path> in the environment traces the whole run of a program linked with this file
+__attribute__((constructor)) static void trace_from_environment(void) {
+    const char *path = getenv("FAT_TRACE");
+    if (path != NULL && *path != '\0' && fat_trace_start(path) == 0) {
+        atexit(stop_at_exit);
+    }
+}
+
+static bool get_varint(const uint8_t **cursor, const uint8_t *end, uint64_t *value) {
+    *value = 0;
+    for (int shift = 0; shift < 64; shift += 7) {
+        if (*cursor == end) {
+            return false;
+        }
+        uint8_t byte = *(*cursor)++;
+        *value |= (uint64_t) (byte & 0x7F) << shift;
+        if ((byte & 0x80) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool get_signed(const uint8_t **cursor, const uint8_t *end, int64_t *value) {
+    uint64_t encoded;
+    if (!get_varint(cursor, end, &encoded)) {
+        return false;
+    }
+    *value = (int64_t) (encoded >> 1) ^ -(int64_t) (encoded & 1);
+    return true;
+}
+
+// Decodes the record at cursor; false at a truncated tail, left by a process that died before fat_trace_stop
+static bool trace_decode(const uint8_t **cursor, const uint8_t *end, int64_t *start,
+                         struct fat_trace_record_t *record) {
+    uint64_t thread, duration, handle;
+    int64_t delta;
+    memset(record, 0, sizeof(struct fat_trace_record_t));
+    record->op = **cursor;
+    (*cursor)++;
+    if (record->op >= FAT_TRACE_OP_COUNT) {
+        return false;
+    }
+    if (!get_varint(cursor, end, &thread) || !get_signed(cursor, end, &delta) ||
+        !get_varint(cursor, end, &duration) || !get_varint(cursor, end, &handle) ||
+        !get_signed(cursor, end, &record->result)) {
+        return false;
+    }
+    *start += delta;
+    record->thread = (uint32_t) thread;
+    record->start = (uint64_t) *start;
+    record->duration = duration;
+    record->handle = (uint32_t) handle;
+    if (record->op == FAT_TRACE_FILE_OPEN || record->op == FAT_TRACE_DIR_OPEN) {
+        uint64_t length;
+        if (!get_varint(cursor, end, &length) || length > (uint64_t) (end - *cursor)) {
+            return false;
+        }
+        record->path = malloc(length + 1);
+        if (record->path == NULL) {
+            return false;
+        }
+        memcpy(record->path, *cursor, length);
+        record->path[length] = '\0';
+        *cursor += length;
+    } else if (record->op == FAT_TRACE_FILE_SEEK) {
+        uint64_t whence;
+        if (!get_signed(cursor, end, &record->offset) || !get_varint(cursor, end, &whence)) {
+            return false;
+        }
+        record->whence = (int) whence;
+    } else if (record->op == FAT_TRACE_FILE_READ) {
+        uint64_t offset;
+        if (!get_varint(cursor, end, &offset) || !get_varint(cursor, end, &record->size) ||
+            !get_varint(cursor, end, &record->count)) {
+            return false;
+        }
+        record->offset = (int64_t) offset;
+    }
+    return true;
+}
+
+struct trace_order_t {
+    uint64_t start;
+    size_t index;
+};
+
+static int trace_order_compare(const void *a, const void *b) {
+    const struct trace_order_t *first = a;
+    const struct trace_order_t *second = b;
+    if (first->start != second->start) {
+        return first->start < second->start ? -1 : 1;
+    }
+    return first->index < second->index ? -1 : first->index > second->index;
+}
+
+struct fat_trace_t *fat_trace_load(const char *path) {
+    if (path == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat status;
+    if (fstat(fd, &status) != 0) {
+        close(fd);
+        return NULL;
+    }
+    size_t size = (size_t) status.st_size;
+    uint8_t *data = malloc(size + 1);
+    if (data == NULL) {
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t done = 0;
+    while (done < size) {
+        ssize_t got = read(fd, data + done, size - done);
+        if (got < 0 && errno == EINTR) {
+            continue;
+        }
+        if (got <= 0) {
+            break;
+        }
+        done += (size_t) got;
+    }
+    close(fd);
+    uint32_t version = 0;
+    if (done >= TRACE_HEADER_SIZE) {
+        memcpy(&version, data + 8, sizeof(version));
+    }
+    if (done < TRACE_HEADER_SIZE || memcmp(data, FAT_TRACE_MAGIC, 8) != 0 || version != FAT_TRACE_VERSION) {
+        free(data);
+        errno = EINVAL;
+        return NULL;
+    }
+    struct fat_trace_t *trace_data = calloc(1, sizeof(struct fat_trace_t));
+    if (trace_data == NULL) {
+        free(data);
+        errno = ENOMEM;
+        return NULL;
+    }
+    // Every record takes at least 6 bytes
+    size_t capacity = (done - TRACE_HEADER_SIZE) / 6 + 1;
+    struct fat_trace_record_t *records = malloc(sizeof(struct fat_trace_record_t) * capacity);
+    struct trace_order_t *order = malloc(sizeof(struct trace_order_t) * capacity);
+    if (records == NULL || order == NULL) {
+        free(records);
+        free(order);
+        free(data);
+        free(trace_data);
+        errno = ENOMEM;
+        return NULL;
+    }
+    const uint8_t *cursor = data + TRACE_HEADER_SIZE;
+    const uint8_t *end = data + done;
+    int64_t start = 0;
+    size_t count = 0;
+    while (cursor < end && trace_decode(&cursor, end, &start, records + count)) {
+        order[count].start = records[count].start;
+        order[count].index = count;
+        if (records[count].handle > trace_data->handle_count) {
+            trace_data->handle_count = records[count].handle;
+        }
+        if (records[count].thread >= trace_data->thread_count) {
+            trace_data->thread_count = records[count].thread + 1;
+        }
+        count++;
+    }
+    free(data);
+    qsort(order, count, sizeof(struct trace_order_t), trace_order_compare);
+    trace_data->records = malloc(sizeof(struct fat_trace_record_t) * (count > 0 ? count : 1));
+    if (trace_data->records == NULL) {
+        for (size_t i = 0; i < count; i++) {
+            free(records[i].path);
+        }
+        free(records);
+        free(order);
+        free(trace_data);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        trace_data->records[i] = records[order[i].index];
+    }
+    trace_data->count = count;
+    free(records);
+    free(order);
+    return trace_data;
+}
+
+void fat_trace_free(struct fat_trace_t *trace_data) {
+    if (trace_data == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < trace_data->count; i++) {
+        free(trace_data->records[i].path);
+    }
+    free(trace_data->records);
+    free(trace_data);
+}
+
+struct replay_handle_t {
+    struct file_t *file;
+    struct dir_t *dir;
+};
+
+struct replay_thread_t {
+    pthread_t thread;
+    bool running;
+    const struct fat_trace_t *trace;
+    struct volume_t *volume;
+    int flags;
+    uint64_t origin;
+    size_t *indices; //Records replayed by this thread, in trace order
+    size_t count;
+    struct replay_handle_t *handles; //Shared, but a handle is only ever touched by its own thread
+    uint64_t *latencies; //Shared, per record; UINT64_MAX for skipped records
+    uint64_t errors[FAT_TRACE_OP_COUNT];
+    uint64_t skipped;
+    uint64_t mismatches;
+};
+
+static int64_t replay_result(int64_t result) {
+    return result < 0 ? -errno : result;
+}
+
+// Runs one record; false when its handle is not open in the replay
+static bool replay_call(struct replay_thread_t *state, const struct fat_trace_record_t *record, uint8_t **buffer,
+                        size_t *buffer_size, int64_t *result) {
+    struct replay_handle_t *handle = state->handles + record->handle;
+    switch (record->op) {
+        case FAT_TRACE_FILE_OPEN: {
+            struct file_t *file = file_open(state->volume, record->path);
+            *result = replay_result(file != NULL ? 0 : -1);
+            if (record->handle != 0) {
+                handle->file = file;
+            } else if (file != NULL) {
+                file_close(file);
+            }
+            return true;
+        }
+        case FAT_TRACE_DIR_OPEN: {
+            struct dir_t *dir = dir_open(state->volume, record->path);
+            *result = replay_result(dir != NULL ? 0 : -1);
+            if (record->handle != 0) {
+                handle->dir = dir;
+            } else if (dir != NULL) {
+                dir_close(dir);
+            }
+            return true;
+        }
+        case FAT_TRACE_FILE_SEEK:
+            if (handle->file == NULL) {
+                return false;
+            }
+            *result = replay_result(file_seek(handle->file, (int32_t) record->offset, record->whence));
+            return true;
+        case FAT_TRACE_FILE_READ: {
+            if (handle->file == NULL) {
+                return false;
+            }
+            uint64_t length = record->size * record->count;
+            if (record->count != 0 && length / record->count != record->size) {
+                return false;
+            }
+            if (length > *buffer_size) {
+                uint8_t *grown = realloc(*buffer, length);
+                if (grown == NULL) {
+                    return false;
+                }
+                *buffer = grown;
+                *buffer_size = length;
+            }
+            *result = replay_result((int64_t) file_read(*buffer, record->size, record->count, handle->file));
+            return true;
+        }
+        case FAT_TRACE_FILE_CLOSE:
+            if (handle->file == NULL) {
+                return false;
+            }
+            *result = replay_result(file_close(handle->file));
+            handle->file = NULL;
+            return true;
+        case FAT_TRACE_DIR_READ: {
+            if (handle->dir == NULL) {
+                return false;
+            }
+            struct dir_entry_t entry;
+            *result = replay_result(dir_read(handle->dir, &entry));
+            return true;
+        }
+        case FAT_TRACE_DIR_CLOSE:
+            if (handle->dir == NULL) {
+                return false;
+            }
+            *result = replay_result(dir_close(handle->dir));
+            handle->dir = NULL;
+            return true;
+        default:
+            return false;
+    }
+}
+
+static void *replay_worker(void *arg) {
+    struct replay_thread_t *state = arg;
+    uint8_t *buffer = NULL;
+    size_t buffer_size = 0;
+    for (size_t i = 0; i < state->count; i++) {
+        size_t index = state->indices[i];
+        const struct fat_trace_record_t *record = state->trace->records + index;
+        if (!(state->flags & FAT_REPLAY_MAX_SPEED)) {
+            uint64_t due = state->origin + record->start;
+            struct timespec wake = {.tv_sec = (time_t) (due / 1000000000u), .tv_nsec = (long) (due % 1000000000u)};
+            while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+            }
+        }
+        int64_t result = 0;
+        uint64_t start = trace_clock(CLOCK_MONOTONIC);
+        if (!replay_call(state, record, &buffer, &buffer_size, &result)) {
+            state->latencies[index] = UINT64_MAX;
+            state->skipped++;
+            continue;
+        }
+        state->latencies[index] = trace_clock(CLOCK_MONOTONIC) - start;
+        if (result < 0) {
+            state->errors[record->op]++;
+        }
+        if (result != record->result) {
+            state->mismatches++;
+        }
+    }
+    free(buffer);
+    return NULL;
+}
+
+static int latency_compare(const void *a, const void *b) {
+    uint64_t first = *(const uint64_t *) a;
+    uint64_t second = *(const uint64_t *) b;
+    return first < second ? -1 : first > second;
+}
+
+static void latency_percentiles(uint64_t *values, size_t count, uint64_t percentiles[5]) {
+    static const uint32_t per_mille[5] = {500, 900, 990, 999, 1000};
+    if (count == 0) {
+        memset(percentiles, 0, sizeof(uint64_t) * 5);
+        return;
+    }
+    qsort(values, count, sizeof(uint64_t), latency_compare);
+    for (int i = 0; i < 5; i++) {
+        size_t rank = (count * per_mille[i] + 999) / 1000;
+        percentiles[i] = values[rank > 0 ? rank - 1 : 0];
+    }
+}
+
+int fat_trace_replay(struct volume_t *pvolume, const struct fat_trace_t *trace_data, int threads, int flags,
+                     struct fat_replay_t *replay) {
+    if (pvolume == NULL || trace_data == NULL || replay == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (threads <= 0) {
+        threads = 1;
+    }
+    memset(replay, 0, sizeof(struct fat_replay_t));
+    replay->threads = threads;
+    struct replay_thread_t *states = calloc((size_t) threads, sizeof(struct replay_thread_t));
+    struct replay_handle_t *handles = calloc((size_t) trace_data->handle_count + 1, sizeof(struct replay_handle_t));
+    uint64_t *latencies = malloc(sizeof(uint64_t) * (trace_data->count + 1));
+    size_t *indices = malloc(sizeof(size_t) * (trace_data->count + 1));
+    uint64_t *values = malloc(sizeof(uint64_t) * (trace_data->count + 1));
+    if (states == NULL || handles == NULL || latencies == NULL || indices == NULL || values == NULL) {
+        free(states);
+        free(handles);
+        free(latencies);
+        free(indices);
+        free(values);
+        errno = ENOMEM;
+        return -1;
+    }
+    // Calls on a handle go to one thread so they keep their order; failed opens follow their recorded thread
+    for (size_t i = 0; i < trace_data->count; i++) {
+        const struct fat_trace_record_t *record = trace_data->records + i;
+        uint32_t key = record->handle != 0 ? record->handle : record->thread;
+        states[key % (uint32_t) threads].count++;
+    }
+    size_t offset = 0;
+    for (int i = 0; i < threads; i++) {
+        states[i].indices = indices + offset;
+        offset += states[i].count;
+        states[i].count = 0;
+    }
+    for (size_t i = 0; i < trace_data->count; i++) {
+        const struct fat_trace_record_t *record = trace_data->records + i;
+        uint32_t key = record->handle != 0 ? record->handle : record->thread;
+        struct replay_thread_t *state = states + key % (uint32_t) threads;
+        state->indices[state->count++] = i;
+    }
+    uint64_t origin = trace_clock(CLOCK_MONOTONIC);
+    for (int i = 0; i < threads; i++) {
+        states[i].trace = trace_data;
+        states[i].volume = pvolume;
+        states[i].flags = flags;
+        states[i].origin = origin;
+        states[i].handles = handles;
+        states[i].latencies = latencies;
+        states[i].running = i > 0 && pthread_create(&states[i].thread, NULL, replay_worker, states + i) == 0;
+    }
+    // The calling thread takes the first share and those of threads that could not be created
+    for (int i = 0; i < threads; i++) {
+        if (!states[i].running) {
+            replay_worker(states + i);
+        }
+    }
+    for (int i = 1; i < threads; i++) {
+        if (states[i].running) {
+            pthread_join(states[i].thread, NULL);
+        }
+    }
+    replay->elapsed = trace_clock(CLOCK_MONOTONIC) - origin;
+    // Handles the trace never closed
+    for (size_t i = 0; i <= trace_data->handle_count; i++) {
+        if (handles[i].file != NULL) {
+            file_close(handles[i].file);
+        }
+        if (handles[i].dir != NULL) {
+            dir_close(handles[i].dir);
+        }
+    }
+    for (int i = 0; i < threads; i++) {
+        replay->skipped += states[i].skipped;
+        replay->mismatches += states[i].mismatches;
+        for (int op = 0; op < FAT_TRACE_OP_COUNT; op++) {
+            replay->ops[op].errors += states[i].errors[op];
+        }
+    }
+    for (int op = 0; op < FAT_TRACE_OP_COUNT; op++) {
+        size_t count = 0;
+        for (size_t i = 0; i < trace_data->count; i++) {
+            if (trace_data->records[i].op == op && latencies[i] != UINT64_MAX) {
+                values[count++] = latencies[i];
+            }
+        }
+        replay->ops[op].calls = count;
+        latency_percentiles(values, count, replay->ops[op].percentiles);
+        count = 0;
+        for (size_t i = 0; i < trace_data->count; i++) {
+            if (trace_data->records[i].op == op) {
+                values[count++] = trace_data->records[i].duration;
+            }
+        }
+        latency_percentiles(values, count, replay->ops[op].recorded);
+    }
+    free(states);
+    free(handles);
+    free(latencies);
+    free(indices);
+    free(values);
+    return 0;
+}
+
+int fat_replay_write(const struct fat_replay_t *replay, FILE *out) {
+    if (replay == NULL || out == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    fprintf(out, "%d threads, %.3f ms, %" PRIu64 " skipped, %" PRIu64 " mismatched\n", replay->threads,
+            (double) replay->elapsed / 1e6, replay->skipped, replay->mismatches);
+    fprintf(out, "%-10s %10s %8s %20s %20s %20s %20s %20s\n", "api", "calls", "errors", "p50 ns", "p90 ns", "p99 ns",
+            "p99.9 ns", "max ns");
+    for (int op = 0; op < FAT_TRACE_OP_COUNT; op++) {
+        const struct fat_replay_stats_t *stats = replay->ops + op;
+        if (stats->calls == 0) {
+            continue;
+        }
+        fprintf(out, "%-10s %10" PRIu64 " %8" PRIu64, op_names[op], stats->calls, stats->errors);
+        for (int i = 0; i < 5; i++) {
+            char cell[48];
+            snprintf(cell, sizeof(cell), "%" PRIu64 "/%" PRIu64, stats->percentiles[i], stats->recorded[i]);
+            fprintf(out, " %20s", cell);
+        }
+        fputc('\n', out);
+    }
+    fputs("(replayed/recorded)\n", out);
+    return ferror(out) ? -1 : 0;
+}
@@ -0,0 +1,102 @@
+#ifndef MY_FAT_16_READER_FAT_TRACE_H
+#define MY_FAT_16_READER_FAT_TRACE_H
+
+#include "file_reader.h"
+
+/*
+ * Access traces: between fat_trace_start and fat_trace_stop every file_open, file_seek, file_read, file_close,
+ * dir_open, dir_read and dir_close of the process is appended to a binary log. While no trace is running the entry
+ * points only test fat_trace_hook. fat_trace_replay re-executes a loaded trace against a volume; fat_replay is the
+ * command line front end.
+ */
+
+#define FAT_TRACE_FILE_OPEN 0
+#define FAT_TRACE_FILE_SEEK 1
+#define FAT_TRACE_FILE_READ 2
+#define FAT_TRACE_FILE_CLOSE 3
+#define FAT_TRACE_DIR_OPEN 4
+#define FAT_TRACE_DIR_READ 5
+#define FAT_TRACE_DIR_CLOSE 6
+#define FAT_TRACE_OP_COUNT 7
+
+#define FAT_TRACE_MAGIC "FATTRACE"
+#define FAT_TRACE_VERSION 1
+#define FAT_TRACE_BUFFER_SIZE (64 * 1024) //Records are written in blocks of this size
+
+#define FAT_REPLAY_MAX_SPEED 0x01 //Issue every call as soon as the one before it on its handle returned
+
+// Filled by the traced entry points and passed to fat_trace_hook
+struct fat_trace_event_t {
+    int op;
+    const void *handle; //file_t or dir_t opened or used, NULL when an open failed
+    const char *path; //Opens only
+    int64_t offset; //file_seek offset, or the file offset before a file_read
+    uint64_t size; //file_read element size
+    uint64_t count; //file_read element count
+    int whence; //file_seek only
+    int64_t result; //Return value, -errno on failure
+    uint64_t start; //CLOCK_MONOTONIC nanoseconds
+    uint64_t end;
+};
+
+typedef void (*fat_trace_hook_t)(const struct fat_trace_event_t *event);
+
+// Set by fat_trace_start; may be replaced to observe the calls some other way
+extern fat_trace_hook_t fat_trace_hook;
+
+// One record of a loaded trace; handles are numbered from 1 in the order they were first seen
+struct fat_trace_record_t {
+    int op;
+    uint32_t thread; //Numbered from 0 in the order threads made their first traced call
+    uint64_t start; //Nanoseconds since the trace was started
+    uint64_t duration;
+    uint32_t handle; //0 when an open failed
+    int64_t result;
+    int64_t offset;
+    uint64_t size;
+    uint64_t count;
+    int whence;
+    char *path; //Opens only, NULL otherwise
+};
+
+struct fat_trace_t {
+    size_t count;
+    struct fat_trace_record_t *records; //Sorted by start
+    uint32_t thread_count;
+    uint32_t handle_count;
+};
+
+struct fat_replay_stats_t {
+    uint64_t calls;
+    uint64_t errors; //Calls that failed during the replay
+    uint64_t percentiles[5]; //p50, p90, p99, p99.9 and max of the replayed latency in nanoseconds
+    uint64_t recorded[5]; //Same percentiles of the traced latency
+};
+
+struct fat_replay_t {
+    struct fat_replay_stats_t ops[FAT_TRACE_OP_COUNT];
+    uint64_t skipped; //Calls on handles that were opened before the trace started or failed to open in the replay
+    uint64_t mismatches; //Calls whose result differs from the recorded one
+    uint64_t elapsed; //Wall time of the replay in nanoseconds
+    int threads;
+};
+
+// Truncates or creates path and traces into it until fat_trace_stop; fails with EBUSY while a trace is running
+int fat_trace_start(const char *path);
+
+// Flushes and closes the trace; -1 if any write failed, with the errno of the first failure
+int fat_trace_stop(void);
+
+struct fat_trace_t *fat_trace_load(const char *path);
+
+void fat_trace_free(struct fat_trace_t *trace);
+
+// Replays trace against pvolume with up to threads threads. Calls on one handle stay on one thread in their recorded
+// order; without FAT_REPLAY_MAX_SPEED each call also waits for its recorded start time.
+int fat_trace_replay(struct volume_t *pvolume, const struct fat_trace_t *trace, int threads, int flags,
+                     struct fat_replay_t *replay);
+
+// One line per traced API with its call count and percentiles, replayed against recorded
+int fat_replay_write(const struct fat_replay_t *replay, FILE *out);
+
+#endif //MY_FAT_16_READER_FAT_TRACE_H
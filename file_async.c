@@ -0,0 +1,240 @@
+#include "file_async.h"
+
+// The same read as file_read on a private view of stream, so concurrent requests never touch stream->offset
+static size_t async_read(struct fat_async_completion_t *completion) {
+    struct file_t view = *completion->stream;
+    uint32_t size = view.entry->size;
+    if (completion->offset >= size || completion->length == 0) {
+        return 0;
+    }
+    size_t length = completion->length;
+    if (length > size - completion->offset) {
+        length = size - completion->offset;
+    }
+    view.offset = completion->offset;
+    errno = 0;
+    size_t read = view.volume->read_kernel(&view, completion->buffer, length);
+    if (read < length) {
+        completion->error = errno ? errno : EIO;
+    }
+    return read;
+}
+
+static void *async_worker(void *arg) {
+    struct fat_async_t *async = arg;
+    pthread_mutex_lock(&async->lock);
+    while (1) {
+        while (async->pending_head == NULL && !async->stopping) {
+            pthread_cond_wait(&async->submitted, &async->lock);
+        }
+        struct fat_async_request_t *request = async->pending_head;
+        if (request == NULL) {
+            break;
+        }
+        async->pending_head = request->next;
+        if (async->pending_head == NULL) {
+            async->pending_tail = NULL;
+        }
+        pthread_mutex_unlock(&async->lock);
+
+        request->completion.read = async_read(&request->completion);
+        if (async->flags & FAT_ASYNC_CALLBACK_IN_POOL) {
+            request->callback(&request->completion);
+        }
+
+        pthread_mutex_lock(&async->lock);
+        request->next = NULL;
+        if (async->flags & FAT_ASYNC_CALLBACK_IN_POOL) {
+            request->next = async->free_list;
+            async->free_list = request;
+            async->outstanding--;
+        } else {
+            if (async->done_tail == NULL) {
+                async->done_head = request;
+            } else {
+                async->done_tail->next = request;
+            }
+            async->done_tail = request;
+            uint64_t one = 1;
+            if (write(async->event_fd, &one, sizeof(one)) < 0) {
+                // The counter only saturates after 2^64 - 2 unread completions
+            }
+        }
+        pthread_cond_broadcast(&async->completed);
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+
+struct fat_async_t *fat_async_create(int threads, int flags) {
+    if (threads <= 0) {
+        threads = FAT_ASYNC_DEFAULT_THREADS;
+    }
+    struct fat_async_t *async = calloc(1, sizeof(struct fat_async_t));
+    if (async == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    async->flags = flags;
+    async->threads = malloc(sizeof(pthread_t) * threads);
+    async->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (async->threads == NULL || async->event_fd < 0) {
+        int error = async->threads == NULL ? ENOMEM : errno;
+        if (async->event_fd >= 0) {
+            close(async->event_fd);
+        }
+        free(async->threads);
+        free(async);
+        errno = error;
+        return NULL;
+    }
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->submitted, NULL);
+    pthread_cond_init(&async->completed, NULL);
+    for (; async->thread_count < threads; async->thread_count++) {
+        if (pthread_create(async->threads + async->thread_count, NULL, async_worker, async) != 0) {
+            break;
+        }
+    }
+    if (async->thread_count == 0) {
+        fat_async_destroy(async);
+        errno = EAGAIN;
+        return NULL;
+    }
+    return async;
+}
+
+int fat_async_fd(const struct fat_async_t *async) {
+    if (async == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    return async->event_fd;
+}
+
+int file_read_async(struct fat_async_t *async, struct file_t *stream, void *buffer, size_t length, uint32_t offset,
+                    fat_async_callback_t callback, void *user) {
+    if (async == NULL || stream == NULL || buffer == NULL || callback == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    pthread_mutex_lock(&async->lock);
+    struct fat_async_request_t *request = async->free_list;
+    if (request != NULL) {
+        async->free_list = request->next;
+    }
+    pthread_mutex_unlock(&async->lock);
+    if (request == NULL) {
+        request = malloc(sizeof(struct fat_async_request_t));
+        if (request == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+    }
+    request->completion.stream = stream;
+    request->completion.buffer = buffer;
+    request->completion.offset = offset;
+    request->completion.length = length;
+    request->completion.read = 0;
+    request->completion.error = 0;
+    request->completion.user = user;
+    request->callback = callback;
+    request->next = NULL;
+
+    pthread_mutex_lock(&async->lock);
+    if (async->pending_tail == NULL) {
+        async->pending_head = request;
+    } else {
+        async->pending_tail->next = request;
+    }
+    async->pending_tail = request;
+    async->outstanding++;
+    pthread_cond_signal(&async->submitted);
+    pthread_mutex_unlock(&async->lock);
+    return 0;
+}
+
+int fat_async_poll(struct fat_async_t *async, int max, bool wait) {
+    if (async == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    pthread_mutex_lock(&async->lock);
+    while (wait && async->done_head == NULL && async->outstanding > 0) {
+        pthread_cond_wait(&async->completed, &async->lock);
+    }
+    // Take the whole batch at once so callbacks run without the lock and may submit new reads
+    struct fat_async_request_t *batch = async->done_head;
+    struct fat_async_request_t *last = batch;
+    int count = batch != NULL ? 1 : 0;
+    while (last != NULL && last->next != NULL && (max <= 0 || count < max)) {
+        last = last->next;
+        count++;
+    }
+    if (last != NULL) {
+        async->done_head = last->next;
+        if (async->done_head == NULL) {
+            async->done_tail = NULL;
+        }
+        last->next = NULL;
+    }
+    // Workers post completions under the lock too, so the counter always matches the queue here
+    uint64_t value;
+    if (count > 0 && read(async->event_fd, &value, sizeof(value)) == sizeof(value) && value > (uint64_t) count) {
+        // Completions left in the queue keep the descriptor readable
+        value -= (uint64_t) count;
+        if (write(async->event_fd, &value, sizeof(value)) < 0) {
+            value = 0;
+        }
+    }
+    pthread_mutex_unlock(&async->lock);
+
+    struct fat_async_request_t *request = batch;
+    while (request != NULL) {
+        struct fat_async_request_t *next = request->next;
+        request->callback(&request->completion);
+        request = next;
+    }
+    if (batch != NULL) {
+        pthread_mutex_lock(&async->lock);
+        last->next = async->free_list;
+        async->free_list = batch;
+        async->outstanding -= (size_t) count;
+        pthread_cond_broadcast(&async->completed);
+        pthread_mutex_unlock(&async->lock);
+    }
+    return count;
+}
+
+void fat_async_destroy(struct fat_async_t *async) {
+    if (async == NULL) {
+        return;
+    }
+    pthread_mutex_lock(&async->lock);
+    while (async->outstanding > 0) {
+        if (async->done_head != NULL) {
+            pthread_mutex_unlock(&async->lock);
+            fat_async_poll(async, 0, false);
+            pthread_mutex_lock(&async->lock);
+            continue;
+        }
+        pthread_cond_wait(&async->completed, &async->lock);
+    }
+    async->stopping = true;
+    pthread_cond_broadcast(&async->submitted);
+    pthread_mutex_unlock(&async->lock);
+    for (int i = 0; i < async->thread_count; i++) {
+        pthread_join(async->threads[i], NULL);
+    }
+    while (async->free_list != NULL) {
+        struct fat_async_request_t *request = async->free_list;
+        async->free_list = request->next;
+        free(request);
+    }
+    pthread_cond_destroy(&async->completed);
+    pthread_cond_destroy(&async->submitted);
+    pthread_mutex_destroy(&async->lock);
+    close(async->event_fd);
+    free(async->threads);
+    free(async);
+}
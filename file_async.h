@@ -0,0 +1,64 @@
+#ifndef MY_FAT_16_READER_FILE_ASYNC_H
+#define MY_FAT_16_READER_FILE_ASYNC_H
+
+#include "file_reader.h"
+
+#include <sys/eventfd.h>
+
+#define FAT_ASYNC_DEFAULT_THREADS 4
+
+#define FAT_ASYNC_CALLBACK_IN_POOL 0x01 //Run callbacks on the I/O thread instead of queueing them for fat_async_poll
+
+struct fat_async_completion_t {
+    struct file_t *stream;
+    void *buffer;
+    uint32_t offset;
+    size_t length; //Requested
+    size_t read; //Bytes placed in buffer, short only at the end of the file or on error
+    int error; //errno of a failed read, 0 on success
+    void *user;
+};
+
+typedef void (*fat_async_callback_t)(const struct fat_async_completion_t *completion);
+
+struct fat_async_request_t {
+    struct fat_async_completion_t completion;
+    fat_async_callback_t callback;
+    struct fat_async_request_t *next;
+};
+
+struct fat_async_t {
+    int flags;
+    int event_fd; //Counts completions waiting in the completion queue
+    int thread_count;
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t submitted; //Signalled when work arrives or on shutdown
+    pthread_cond_t completed; //Signalled when a read finishes
+    struct fat_async_request_t *pending_head;
+    struct fat_async_request_t *pending_tail;
+    struct fat_async_request_t *done_head;
+    struct fat_async_request_t *done_tail;
+    struct fat_async_request_t *free_list; //Finished requests kept for reuse
+    size_t outstanding; //Submitted and not yet handed to a callback
+    bool stopping;
+};
+
+struct fat_async_t *fat_async_create(int threads, int flags);
+
+// Readable whenever completions are queued; add it to epoll/poll and call fat_async_poll when it fires
+int fat_async_fd(const struct fat_async_t *async);
+
+// Reads length bytes at offset of stream into buffer; stream->offset is neither used nor moved.
+// stream and buffer must stay valid until the callback has run.
+int file_read_async(struct fat_async_t *async, struct file_t *stream, void *buffer, size_t length, uint32_t offset,
+                    fat_async_callback_t callback, void *user);
+
+// Runs the callbacks of up to max queued completions (max <= 0: all of them) on the calling thread.
+// With wait set it blocks until at least one completion arrives, unless nothing is outstanding.
+int fat_async_poll(struct fat_async_t *async, int max, bool wait);
+
+// Waits for every submitted read, running the remaining callbacks, then stops the pool
+void fat_async_destroy(struct fat_async_t *async);
+
+#endif //MY_FAT_16_READER_FILE_ASYNC_H
@@ -0,0 +1,685 @@
+#include "file_diff.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+// Visible entry of one side of a directory pair
+struct diff_name_t {
+    char *name;
+    const struct SFN *entry;
+    bool matched;
+};
+
+// Entry present on one side only, kept until moves are paired up
+struct diff_orphan_t {
+    size_t index; //Into fat_diff_t::entries
+    int side; //0 = old volume, 1 = new volume
+    struct SFN entry;
+    const char *name; //Last component of the entry path
+};
+
+struct diff_state_t {
+    struct volume_t *volumes[2];
+    const uint8_t *fats[2]; //Held for the whole diff
+    int flags;
+    uint64_t *fat_changed; //Bit c set = FAT entry c differs between the volumes
+    uint32_t fat_entries;
+    bool same_geometry;
+    struct fat_diff_t *diff;
+    struct diff_orphan_t *orphans;
+    size_t orphan_count;
+    size_t orphan_capacity;
+    uint8_t *buffers[2];
+    uint8_t *visited[2]; //Per side, one bit per directory cluster entered
+    uint32_t depth; //Of the directory being compared, the root is 0
+};
+
+// Marks a directory cluster of one side as entered; fails with ELOOP when it was already, i.e. the tree loops
+static int diff_visit(struct diff_state_t *state, int side, uint16_t cluster) {
+    if (cluster == 0xFFFF || cluster >= state->volumes[side]->geometry.cluster_count + 2) {
+        // Missing side, or not a data cluster and rejected by fat_load_directory
+        return 0;
+    }
+    uint8_t bit = (uint8_t) (1u << (cluster & 7));
+    if (state->visited[side][cluster >> 3] & bit) {
+        errno = ELOOP;
+        return -1;
+    }
+    state->visited[side][cluster >> 3] |= bit;
+    return 0;
+}
+
+// Sets a bit per differing 16-bit FAT entry, eight entries per compare
+static void diff_fat_entries(const uint8_t *a, const uint8_t *b, uint32_t entries, uint64_t *changed) {
+    uint32_t i = 0;
+#if defined(__SSE2__)
+    for (; i + 64 <= entries; i += 64) {
+        uint64_t bits = 0;
+        for (int k = 0; k < 4; k++) {
+            const uint8_t *pa = a + (size_t) (i + k * 16) * 2;
+            const uint8_t *pb = b + (size_t) (i + k * 16) * 2;
+            __m128i low = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *) pa),
+                                          _mm_loadu_si128((const __m128i *) pb));
+            __m128i high = _mm_cmpeq_epi16(_mm_loadu_si128((const __m128i *) (pa + 16)),
+                                           _mm_loadu_si128((const __m128i *) (pb + 16)));
+            // Saturating pack keeps 0 / -1 per entry, one mask bit per entry
+            uint32_t equal = (uint32_t) _mm_movemask_epi8(_mm_packs_epi16(low, high));
+            bits |= (uint64_t) (~equal & 0xFFFF) << (k * 16);
+        }
+        changed[i / 64] = bits;
+    }
+#endif
+    for (; i < entries; i++) {
+        if (a[i * 2] != b[i * 2] || a[i * 2 + 1] != b[i * 2 + 1]) {
+            changed[i / 64] |= (uint64_t) 1 << (i % 64);
+        }
+    }
+}
+
+static bool diff_chain_changed(const struct diff_state_t *state, uint16_t first_cluster) {
+    if (!state->same_geometry) {
+        return true;
+    }
+    const uint8_t *fat = state->fats[0];
+    uint32_t limit = state->volumes[0]->geometry.cluster_count + 2;
+    uint32_t cluster = first_cluster;
+    for (uint32_t steps = 0; cluster >= 2 && cluster < limit && steps < limit; steps++) {
+        if (cluster >= state->fat_entries || state->fat_changed[cluster / 64] & (uint64_t) 1 << (cluster % 64)) {
+            return true;
+        }
+        cluster = (uint32_t) (fat[cluster * 2] | fat[cluster * 2 + 1] << 8);
+    }
+    return false;
+}
+
+static uint16_t diff_mtime(const struct SFN *entry) {
+    uint16_t time;
+    memcpy(&time, &entry->modified_time, sizeof(time));
+    return time;
+}
+
+static uint16_t diff_mdate(const struct SFN *entry) {
+    uint16_t date;
+    memcpy(&date, &entry->modified_date, sizeof(date));
+    return date;
+}
+
+// Byte by byte through file_read, for volumes whose clusters do not line up
+static int diff_same_stream(struct diff_state_t *state, const struct SFN *old_entry, const struct SFN *new_entry) {
+    struct file_t *files[2];
+    files[0] = file_open_entry(state->volumes[0], old_entry);
+    files[1] = files[0] != NULL ? file_open_entry(state->volumes[1], new_entry) : NULL;
+    if (files[1] == NULL) {
+        int error = errno;
+        file_close(files[0]);
+        errno = error;
+        return -1;
+    }
+    int result = 1;
+    uint32_t remaining = old_entry->size;
+    while (remaining > 0 && result == 1) {
+        size_t length = remaining < DIFF_BUFFER_SIZE ? remaining : DIFF_BUFFER_SIZE;
+        size_t got_old = file_read(state->buffers[0], 1, length, files[0]);
+        size_t got_new = file_read(state->buffers[1], 1, length, files[1]);
+        state->diff->data_bytes_read += got_old;
+        if (got_old != length || got_new != length) {
+            result = -1;
+            if (errno == 0) {
+                errno = EIO;
+            }
+        } else if (memcmp(state->buffers[0], state->buffers[1], length) != 0) {
+            result = 0;
+        }
+        remaining -= (uint32_t) length;
+    }
+    int error = errno;
+    file_close(files[0]);
+    file_close(files[1]);
+    errno = error;
+    return result;
+}
+
+// 1 when both files hold the same bytes, 0 when they differ, -1 on a read error. The chains are compared first. When
+// the two entries agree on size, time and date, a cluster both versions hold at the same position of the file is
+// taken to be unchanged and only the clusters that differ are read. A differing time means the file was written,
+// possibly in place, so then every cluster is compared, as it is with FAT_DIFF_VERIFY_DATA.
+static int diff_same_data(struct diff_state_t *state, const struct SFN *old_entry, const struct SFN *new_entry) {
+    if (old_entry->size != new_entry->size) {
+        return 0;
+    }
+    if (old_entry->size == 0) {
+        return 1;
+    }
+    if (!state->same_geometry) {
+        return diff_same_stream(state, old_entry, new_entry);
+    }
+    bool read_shared = state->flags & FAT_DIFF_VERIFY_DATA || diff_mtime(old_entry) != diff_mtime(new_entry) ||
+                       diff_mdate(old_entry) != diff_mdate(new_entry);
+    uint16_t first_cluster = old_entry->low_order_address_of_first_cluster;
+    if (!read_shared && first_cluster == new_entry->low_order_address_of_first_cluster &&
+        !diff_chain_changed(state, first_cluster)) {
+        return 1;
+    }
+    const struct fat_geometry_t *geometry = &state->volumes[0]->geometry;
+    uint32_t limit = geometry->cluster_count + 2;
+    uint32_t clusters = (uint32_t) (((uint64_t) old_entry->size + geometry->cluster_size - 1) >>
+                                    geometry->cluster_shift);
+    uint32_t max_run = DIFF_BUFFER_SIZE >> geometry->cluster_shift;
+    uint32_t cursors[2] = {first_cluster, new_entry->low_order_address_of_first_cluster};
+    for (uint32_t k = 0; k < clusters;) {
+        if (cursors[0] < 2 || cursors[0] >= limit || cursors[1] < 2 || cursors[1] >= limit) {
+            errno = ERANGE;
+            return -1;
+        }
+        // A run of differing clusters that is contiguous in both chains is read at once
+        uint32_t starts[2] = {cursors[0], cursors[1]};
+        uint32_t run = 0;
+        do {
+            for (int side = 0; side < 2; side++) {
+                const uint8_t *fat = state->fats[side];
+                cursors[side] = (uint32_t) (fat[cursors[side] * 2] | fat[cursors[side] * 2 + 1] << 8);
+            }
+            run++;
+        } while (k + run < clusters && run < max_run && cursors[0] == starts[0] + run &&
+                 cursors[1] == starts[1] + run && (read_shared || starts[0] != starts[1]));
+        if (read_shared || starts[0] != starts[1]) {
+            uint64_t offset = (uint64_t) k << geometry->cluster_shift;
+            size_t length = (size_t) run << geometry->cluster_shift;
+            if (length > old_entry->size - offset) {
+                length = (size_t) (old_entry->size - offset);
+            }
+            if (fat_read_clusters(state->volumes[0], (uint16_t) starts[0], run, state->buffers[0]) < 0 ||
+                fat_read_clusters(state->volumes[1], (uint16_t) starts[1], run, state->buffers[1]) < 0) {
+                return -1;
+            }
+            state->diff->data_bytes_read += length;
+            if (memcmp(state->buffers[0], state->buffers[1], length) != 0) {
+                return 0;
+            }
+        }
+        k += run;
+    }
+    return 1;
+}
+
+static struct fat_diff_entry_t *diff_add(struct diff_state_t *state, int kind, const char *path, bool is_directory) {
+    struct fat_diff_t *diff = state->diff;
+    if (diff->count == diff->capacity) {
+        size_t capacity = diff->capacity ? diff->capacity * 2 : 64;
+        struct fat_diff_entry_t *entries = realloc(diff->entries, sizeof(struct fat_diff_entry_t) * capacity);
+        if (entries == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        diff->entries = entries;
+        diff->capacity = capacity;
+    }
+    struct fat_diff_entry_t *entry = diff->entries + diff->count;
+    memset(entry, 0, sizeof(*entry));
+    entry->path = strdup(path);
+    if (entry->path == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    entry->kind = kind;
+    entry->is_directory = is_directory;
+    diff->count++;
+    return entry;
+}
+
+static int diff_orphan(struct diff_state_t *state, int side, const char *path, const struct SFN *entry) {
+    struct fat_diff_entry_t *added = diff_add(state, side ? FAT_DIFF_ADDED : FAT_DIFF_REMOVED, path,
+                                              (entry->file_attributes & FAT_ATTR_DIRECTORY) != 0);
+    if (added == NULL) {
+        return -1;
+    }
+    if (side) {
+        added->new_size = entry->size;
+    } else {
+        added->old_size = entry->size;
+    }
+    if (state->orphan_count == state->orphan_capacity) {
+        size_t capacity = state->orphan_capacity ? state->orphan_capacity * 2 : 64;
+        struct diff_orphan_t *orphans = realloc(state->orphans, sizeof(struct diff_orphan_t) * capacity);
+        if (orphans == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        state->orphans = orphans;
+        state->orphan_capacity = capacity;
+    }
+    struct diff_orphan_t *orphan = state->orphans + state->orphan_count++;
+    orphan->index = state->diff->count - 1;
+    orphan->side = side;
+    orphan->entry = *entry;
+    orphan->name = NULL;
+    return 0;
+}
+
+// Visible entries of a loaded directory with their long (or short) names, dot entries left out
+static struct diff_name_t *diff_names(struct SFN *entries, uint32_t entry_count, size_t *count) {
+    struct diff_name_t *names = malloc(sizeof(struct diff_name_t) * (entry_count ? entry_count : 1));
+    if (names == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    char name[LFN_MAX_NAME_LENGTH + 1];
+    size_t found = 0;
+    int is_lfn = 0;
+    for (uint32_t i = 0; i < entry_count; i++) {
+        struct SFN *entry = entries + i;
+        if (entry->filename[0] == 0x00) {
+            break;
+        }
+        if (entry->filename[0] == (char) 0xE5 || entry->filename[0] == (char) 0x05) {
+            is_lfn = 0;
+            continue;
+        }
+        if (entry->file_attributes == FAT_ATTR_LONG_NAME) {
+            is_lfn = 1;
+            continue;
+        }
+        if (entry->file_attributes & FAT_ATTR_VOLUME_ID || entry->filename[0] == '.') {
+            is_lfn = 0;
+            continue;
+        }
+        if (is_lfn) {
+            fat_long_name(entries, i, name);
+        } else {
+            fat_short_name(entry, name);
+        }
+        is_lfn = 0;
+        names[found].name = strdup(name);
+        if (names[found].name == NULL) {
+            for (size_t k = 0; k < found; k++) {
+                free(names[k].name);
+            }
+            free(names);
+            errno = ENOMEM;
+            return NULL;
+        }
+        names[found].entry = entry;
+        names[found].matched = false;
+        found++;
+    }
+    *count = found;
+    return names;
+}
+
+static int diff_name_compare(const void *a, const void *b) {
+    return fat_name_compare(((const struct diff_name_t *) a)->name, ((const struct diff_name_t *) b)->name);
+}
+
+static int diff_directory(struct diff_state_t *state, uint16_t old_cluster, uint16_t new_cluster, const char *path);
+
+static int diff_directory_entries(struct diff_state_t *state, uint16_t old_cluster, uint16_t new_cluster,
+                                  const char *path);
+
+// Everything below a directory that only exists on one side
+static int diff_subtree(struct diff_state_t *state, int side, uint16_t cluster, const char *path) {
+    return side ? diff_directory(state, 0xFFFF, cluster, path) : diff_directory(state, cluster, 0xFFFF, path);
+}
+
+// Both sides hold an entry under the same name
+static int diff_pair(struct diff_state_t *state, const struct SFN *old_entry, const struct SFN *new_entry,
+                     const char *path) {
+    bool old_directory = (old_entry->file_attributes & FAT_ATTR_DIRECTORY) != 0;
+    bool new_directory = (new_entry->file_attributes & FAT_ATTR_DIRECTORY) != 0;
+    if (old_directory != new_directory) {
+        // A file replaced by a directory or the other way round
+        if (diff_orphan(state, 0, path, old_entry) != 0 || diff_orphan(state, 1, path, new_entry) != 0) {
+            return -1;
+        }
+        if (old_directory && old_entry->low_order_address_of_first_cluster != 0) {
+            return diff_subtree(state, 0, old_entry->low_order_address_of_first_cluster, path);
+        }
+        if (new_directory && new_entry->low_order_address_of_first_cluster != 0) {
+            return diff_subtree(state, 1, new_entry->low_order_address_of_first_cluster, path);
+        }
+        return 0;
+    }
+    if (old_directory) {
+        if (old_entry->low_order_address_of_first_cluster == 0 || new_entry->low_order_address_of_first_cluster == 0) {
+            // Cluster 0 would load the root directory
+            return 0;
+        }
+        return diff_directory(state, old_entry->low_order_address_of_first_cluster,
+                              new_entry->low_order_address_of_first_cluster, path);
+    }
+    int changes = 0;
+    if (old_entry->size != new_entry->size) {
+        changes |= FAT_DIFF_CHANGED_SIZE | FAT_DIFF_CHANGED_DATA;
+    }
+    if (diff_mtime(old_entry) != diff_mtime(new_entry) || diff_mdate(old_entry) != diff_mdate(new_entry)) {
+        changes |= FAT_DIFF_CHANGED_TIME;
+    }
+    if ((old_entry->file_attributes ^ new_entry->file_attributes) & ~FAT_ATTR_ARCHIVE) {
+        changes |= FAT_DIFF_CHANGED_ATTRIBUTES;
+    }
+    if (!(changes & FAT_DIFF_CHANGED_SIZE)) {
+        // Time and attribute changes say nothing about the data; only the clusters that differ are read
+        int same = diff_same_data(state, old_entry, new_entry);
+        if (same < 0) {
+            return -1;
+        }
+        if (!same) {
+            changes |= FAT_DIFF_CHANGED_DATA;
+        }
+    }
+    if (changes == 0) {
+        return 0;
+    }
+    struct fat_diff_entry_t *modified = diff_add(state, FAT_DIFF_MODIFIED, path, false);
+    if (modified == NULL) {
+        return -1;
+    }
+    modified->changes = changes;
+    modified->old_size = old_entry->size;
+    modified->new_size = new_entry->size;
+    return 0;
+}
+
+// 0xFFFF marks a side that does not exist; everything on the other side is then added or removed
+static int diff_directory(struct diff_state_t *state, uint16_t old_cluster, uint16_t new_cluster, const char *path) {
+    if (state->depth >= FAT_WALK_MAX_DEPTH || diff_visit(state, 0, old_cluster) != 0 ||
+        diff_visit(state, 1, new_cluster) != 0) {
+        errno = ELOOP;
+        return -1;
+    }
+    state->depth++;
+    int result = diff_directory_entries(state, old_cluster, new_cluster, path);
+    state->depth--;
+    return result;
+}
+
+// diff_directory once the directories are known not to loop
+static int diff_directory_entries(struct diff_state_t *state, uint16_t old_cluster, uint16_t new_cluster,
+                                  const char *path) {
+    struct SFN *entries[2] = {NULL, NULL};
+    uint32_t entry_counts[2] = {0, 0};
+    uint16_t clusters[2] = {old_cluster, new_cluster};
+    for (int side = 0; side < 2; side++) {
+        if (clusters[side] == 0xFFFF) {
+            continue;
+        }
+        entries[side] = fat_load_directory(state->volumes[side], clusters[side], entry_counts + side);
+        if (entries[side] == NULL) {
+            free(entries[0]);
+            return -1;
+        }
+    }
+    struct diff_name_t *names[2] = {NULL, NULL};
+    size_t counts[2] = {0, 0};
+    int result = 0;
+    bool identical = entries[0] != NULL && entries[1] != NULL && entry_counts[0] == entry_counts[1] &&
+                     memcmp(entries[0], entries[1], sizeof(struct SFN) * entry_counts[0]) == 0;
+    if (identical) {
+        // Byte-identical directory: every entry pairs with itself, only files with a changed chain need a look
+        names[0] = diff_names(entries[0], entry_counts[0], counts);
+        if (names[0] == NULL) {
+            result = -1;
+        }
+    } else {
+        for (int side = 0; side < 2 && result == 0; side++) {
+            if (entries[side] != NULL) {
+                names[side] = diff_names(entries[side], entry_counts[side], counts + side);
+                if (names[side] == NULL) {
+                    result = -1;
+                }
+            }
+        }
+        if (names[1] != NULL) {
+            qsort(names[1], counts[1], sizeof(struct diff_name_t), diff_name_compare);
+        }
+    }
+
+    size_t path_length = strlen(path);
+    char *child_path = malloc(path_length + LFN_MAX_NAME_LENGTH + 2);
+    if (child_path == NULL && result == 0) {
+        errno = ENOMEM;
+        result = -1;
+    }
+    if (result == 0) {
+        memcpy(child_path, path, path_length);
+        child_path[path_length] = '\\';
+    }
+    for (int side = 0; side < 2 && result == 0; side++) {
+        for (size_t i = 0; i < counts[side] && result == 0; i++) {
+            struct diff_name_t *name = names[side] + i;
+            if (name->matched) {
+                continue;
+            }
+            strcpy(child_path + path_length + 1, name->name);
+            const struct SFN *entry = name->entry;
+            if (identical) {
+                result = diff_pair(state, entry, entries[1] + (entry - entries[0]), child_path);
+                continue;
+            }
+            struct diff_name_t *other = NULL;
+            if (side == 0 && names[1] != NULL) {
+                other = bsearch(name, names[1], counts[1], sizeof(struct diff_name_t), diff_name_compare);
+            }
+            if (other != NULL) {
+                other->matched = true;
+                result = diff_pair(state, entry, other->entry, child_path);
+                continue;
+            }
+            result = diff_orphan(state, side, child_path, entry);
+            if (result == 0 && entry->file_attributes & FAT_ATTR_DIRECTORY &&
+                entry->low_order_address_of_first_cluster != 0) {
+                result = diff_subtree(state, side, entry->low_order_address_of_first_cluster, child_path);
+            }
+        }
+    }
+    for (int side = 0; side < 2; side++) {
+        for (size_t i = 0; i < counts[side]; i++) {
+            free(names[side][i].name);
+        }
+        free(names[side]);
+        free(entries[side]);
+    }
+    free(child_path);
+    return result;
+}
+
+static int diff_orphan_by_cluster(const void *a, const void *b) {
+    const struct diff_orphan_t *x = a;
+    const struct diff_orphan_t *y = b;
+    if (x->entry.low_order_address_of_first_cluster != y->entry.low_order_address_of_first_cluster) {
+        return x->entry.low_order_address_of_first_cluster < y->entry.low_order_address_of_first_cluster ? -1 : 1;
+    }
+    return x->side - y->side;
+}
+
+static int diff_orphan_by_size(const void *a, const void *b) {
+    const struct diff_orphan_t *x = a;
+    const struct diff_orphan_t *y = b;
+    if (x->entry.size != y->entry.size) {
+        return x->entry.size < y->entry.size ? -1 : 1;
+    }
+    return x->side - y->side;
+}
+
+// Turns the added entry of a removed/added pair into MOVED; the removed one is dropped when compacting
+static void diff_mark_moved(struct diff_state_t *state, struct diff_orphan_t *removed, struct diff_orphan_t *added,
+                            int changes) {
+    struct fat_diff_entry_t *old_entry = state->diff->entries + removed->index;
+    struct fat_diff_entry_t *new_entry = state->diff->entries + added->index;
+    new_entry->kind = FAT_DIFF_MOVED;
+    new_entry->changes = changes;
+    new_entry->old_path = old_entry->path;
+    new_entry->old_size = removed->entry.size;
+    old_entry->path = NULL;
+    removed->index = added->index = SIZE_MAX;
+}
+
+// Renames keep the first cluster; copies to a new path and deletion of the original keep the name and the bytes
+static int diff_moves(struct diff_state_t *state) {
+    struct diff_orphan_t *orphans = state->orphans;
+    size_t count = state->orphan_count;
+    if (count == 0) {
+        return 0;
+    }
+    qsort(orphans, count, sizeof(struct diff_orphan_t), diff_orphan_by_cluster);
+    for (size_t i = 0; i < count;) {
+        size_t end = i;
+        while (end < count && orphans[end].entry.low_order_address_of_first_cluster ==
+                              orphans[i].entry.low_order_address_of_first_cluster) {
+            end++;
+        }
+        uint16_t cluster = orphans[i].entry.low_order_address_of_first_cluster;
+        for (size_t r = i; r < end && cluster != 0 && orphans[r].side == 0; r++) {
+            for (size_t a = r + 1; a < end; a++) {
+                if (orphans[a].side != 1 || orphans[a].index == SIZE_MAX ||
+                    (orphans[a].entry.file_attributes ^ orphans[r].entry.file_attributes) & FAT_ATTR_DIRECTORY) {
+                    continue;
+                }
+                int changes = 0;
+                bool directory = (orphans[r].entry.file_attributes & FAT_ATTR_DIRECTORY) != 0;
+                if (!directory) {
+                    if (orphans[r].entry.size != orphans[a].entry.size) {
+                        changes |= FAT_DIFF_CHANGED_SIZE | FAT_DIFF_CHANGED_DATA;
+                    } else {
+                        int same = diff_same_data(state, &orphans[r].entry, &orphans[a].entry);
+                        if (same < 0) {
+                            return -1;
+                        }
+                        changes |= same ? 0 : FAT_DIFF_CHANGED_DATA;
+                    }
+                    if (diff_mtime(&orphans[r].entry) != diff_mtime(&orphans[a].entry) ||
+                        diff_mdate(&orphans[r].entry) != diff_mdate(&orphans[a].entry)) {
+                        changes |= FAT_DIFF_CHANGED_TIME;
+                    }
+                }
+                diff_mark_moved(state, orphans + r, orphans + a, changes);
+                break;
+            }
+        }
+        i = end;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        if (orphans[i].index != SIZE_MAX) {
+            const char *path = state->diff->entries[orphans[i].index].path;
+            const char *slash = strrchr(path, '\\');
+            orphans[i].name = slash != NULL ? slash + 1 : path;
+        }
+    }
+    qsort(orphans, count, sizeof(struct diff_orphan_t), diff_orphan_by_size);
+    for (size_t r = 0; r < count; r++) {
+        if (orphans[r].side != 0 || orphans[r].index == SIZE_MAX ||
+            orphans[r].entry.file_attributes & FAT_ATTR_DIRECTORY || orphans[r].entry.size == 0) {
+            continue;
+        }
+        for (size_t a = r + 1; a < count && orphans[a].entry.size == orphans[r].entry.size; a++) {
+            if (orphans[a].side != 1 || orphans[a].index == SIZE_MAX ||
+                orphans[a].entry.file_attributes & FAT_ATTR_DIRECTORY ||
+                fat_name_compare(orphans[a].name, orphans[r].name) != 0) {
+                continue;
+            }
+            int same = diff_same_data(state, &orphans[r].entry, &orphans[a].entry);
+            if (same < 0) {
+                return -1;
+            }
+            if (same) {
+                diff_mark_moved(state, orphans + r, orphans + a, 0);
+                break;
+            }
+        }
+    }
+
+    // Drop the removed halves of the moves
+    struct fat_diff_t *diff = state->diff;
+    size_t kept = 0;
+    for (size_t i = 0; i < diff->count; i++) {
+        if (diff->entries[i].kind == FAT_DIFF_REMOVED && diff->entries[i].path == NULL) {
+            continue;
+        }
+        diff->entries[kept++] = diff->entries[i];
+    }
+    diff->count = kept;
+    return 0;
+}
+
+struct fat_diff_t *fat_diff(struct volume_t *old_volume, struct volume_t *new_volume, int flags) {
+    if (old_volume == NULL || new_volume == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct diff_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.volumes[0] = old_volume;
+    state.volumes[1] = new_volume;
+    state.flags = flags;
+    const struct fat_geometry_t *a = &old_volume->geometry;
+    const struct fat_geometry_t *b = &new_volume->geometry;
+    state.same_geometry = a->cluster_size == b->cluster_size && a->cluster_count == b->cluster_count &&
+                          a->fat_size == b->fat_size;
+    state.fat_entries = (a->fat_size < b->fat_size ? a->fat_size : b->fat_size) / 2;
+    state.diff = calloc(1, sizeof(struct fat_diff_t));
+    state.fat_changed = calloc(state.fat_entries / 64 + 1, sizeof(uint64_t));
+    state.buffers[0] = malloc(DIFF_BUFFER_SIZE);
+    state.buffers[1] = malloc(DIFF_BUFFER_SIZE);
+    state.visited[0] = calloc((a->cluster_count + 2 + 7) / 8, 1);
+    state.visited[1] = calloc((b->cluster_count + 2 + 7) / 8, 1);
+    int result = -1;
+    if (state.diff == NULL || state.fat_changed == NULL || state.buffers[0] == NULL || state.buffers[1] == NULL ||
+        state.visited[0] == NULL || state.visited[1] == NULL) {
+        errno = ENOMEM;
+    } else if ((state.fats[0] = fat_acquire(old_volume)) != NULL && (state.fats[1] = fat_acquire(new_volume)) != NULL) {
+        diff_fat_entries(state.fats[0], state.fats[1], state.fat_entries, state.fat_changed);
+        result = diff_directory(&state, 0, 0, "");
+        if (result == 0) {
+            result = diff_moves(&state);
+        }
+    }
+    int error = errno;
+    for (int i = 0; i < 2; i++) {
+        if (state.fats[i] != NULL) {
+            fat_release(state.volumes[i]);
+        }
+    }
+    free(state.buffers[0]);
+    free(state.buffers[1]);
+    free(state.visited[0]);
+    free(state.visited[1]);
+    free(state.fat_changed);
+    free(state.orphans);
+    if (result != 0) {
+        fat_diff_free(state.diff);
+        errno = error;
+        return NULL;
+    }
+    return state.diff;
+}
+
+int fat_diff_write(const struct fat_diff_t *diff, FILE *out) {
+    if (diff == NULL || out == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    static const char kinds[] = {'A', 'D', 'M', 'R'};
+    for (size_t i = 0; i < diff->count; i++) {
+        const struct fat_diff_entry_t *entry = diff->entries + i;
+        const char *suffix = entry->is_directory ? "\\" : "";
+        if (entry->kind == FAT_DIFF_MOVED) {
+            fprintf(out, "%c %s%s -> %s%s\n", kinds[entry->kind], entry->old_path, suffix, entry->path, suffix);
+        } else {
+            fprintf(out, "%c %s%s\n", kinds[entry->kind], entry->path, suffix);
+        }
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+void fat_diff_free(struct fat_diff_t *diff) {
+    if (diff == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < diff->count; i++) {
+        free(diff->entries[i].path);
+        free(diff->entries[i].old_path);
+    }
+    free(diff->entries);
+    free(diff);
+}
@@ -0,0 +1,48 @@
+#ifndef MY_FAT_16_READER_FILE_DIFF_H
+#define MY_FAT_16_READER_FILE_DIFF_H
+
+#include "file_reader.h"
+
+#define FAT_DIFF_ADDED 0
+#define FAT_DIFF_REMOVED 1
+#define FAT_DIFF_MODIFIED 2
+#define FAT_DIFF_MOVED 3 //Same file under another path, possibly modified as well
+
+#define FAT_DIFF_CHANGED_SIZE 0x01
+#define FAT_DIFF_CHANGED_DATA 0x02
+#define FAT_DIFF_CHANGED_TIME 0x04
+#define FAT_DIFF_CHANGED_ATTRIBUTES 0x08
+
+#define FAT_DIFF_VERIFY_DATA 0x01 //Also read clusters both versions of a file share when their entries agree
+
+#define DIFF_BUFFER_SIZE (128 * 1024)
+
+struct fat_diff_entry_t {
+    int kind;
+    int changes; //FAT_DIFF_CHANGED_* bits of MODIFIED and MOVED entries
+    char *path; //In the new volume, in the old one for REMOVED
+    char *old_path; //MOVED only
+    bool is_directory;
+    uint32_t old_size;
+    uint32_t new_size;
+};
+
+struct fat_diff_t {
+    size_t count;
+    size_t capacity;
+    struct fat_diff_entry_t *entries;
+    uint64_t data_bytes_read; //File data read from each volume to settle candidates
+};
+
+// Compares the FATs and directory trees of two volumes. Files whose entries and cluster chains both match are not
+// read. When only the chains differ, only the clusters that differ are read; a cluster both chains hold at the same
+// position is taken to be unchanged unless FAT_DIFF_VERIFY_DATA is given. When the time or date differs, every
+// cluster of the file is compared.
+struct fat_diff_t *fat_diff(struct volume_t *old_volume, struct volume_t *new_volume, int flags);
+
+// One line per entry: "A", "D", "M" or "R" (moved, "old -> new") followed by the path
+int fat_diff_write(const struct fat_diff_t *diff, FILE *out);
+
+void fat_diff_free(struct fat_diff_t *diff);
+
+#endif //MY_FAT_16_READER_FILE_DIFF_H
@@ -0,0 +1,623 @@
+#include "file_grep.h"
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+struct grep_file_t {
+    char *path;
+    uint32_t size;
+    uint16_t first_cluster;
+    bool failed; //A broken chain or a failed read costs that file, not the whole scan
+};
+
+// GREP_SEGMENT_SIZE bytes of a file starting at start, whose cluster is found without walking the chain again
+struct grep_segment_t {
+    uint32_t file;
+    uint32_t start;
+    uint16_t cluster;
+};
+
+struct grep_found_t {
+    uint32_t file;
+    uint32_t offset;
+    uint32_t pattern;
+};
+
+struct grep_job_t {
+    struct volume_t *volume;
+    const struct grep_patterns_t *patterns;
+    struct grep_file_t *files;
+    size_t file_count;
+    size_t file_capacity;
+    struct grep_segment_t *segments;
+    size_t segment_count;
+    size_t segment_capacity;
+    size_t next_segment;
+    uint32_t buffer_clusters;
+    uint32_t segment_clusters; //GREP_SEGMENT_SIZE in whole clusters, at least one
+    const uint8_t *fat; //Held from planning to the end of the scan
+    int error;
+};
+
+struct grep_worker_t {
+    struct grep_job_t *job;
+    pthread_t thread;
+    uint8_t *buffer; //buffer_clusters clusters
+    struct grep_found_t *found;
+    size_t count;
+    size_t capacity;
+    int error;
+};
+
+// Trie of the patterns over byte classes, then a breadth first pass that resolves failure links into the table so
+// scanning never backtracks
+static int grep_build(struct grep_patterns_t *compiled) {
+    uint8_t class_of_folded[256] = {0};
+    compiled->class_count = 1; //Class 0 holds every byte no pattern uses
+    size_t total_length = 0;
+    for (size_t i = 0; i < compiled->count; i++) {
+        for (size_t k = 0; k < compiled->lengths[i]; k++) {
+            uint8_t c = compiled->patterns[i][k];
+            if (class_of_folded[c] == 0) {
+                class_of_folded[c] = (uint8_t) compiled->class_count++;
+            }
+        }
+        total_length += compiled->lengths[i];
+    }
+    // 256 distinct bytes in the patterns need 257 classes, one more than uint8_t holds: give up on class 0 then
+    if (compiled->class_count > 256) {
+        compiled->class_count = 256;
+        for (int c = 0; c < 256; c++) {
+            class_of_folded[c] = (uint8_t) c;
+        }
+    }
+    for (int c = 0; c < 256; c++) {
+        compiled->classes[c] = class_of_folded[compiled->fold[c]];
+    }
+
+    size_t capacity = total_length + 1;
+    if (capacity > UINT32_MAX / compiled->class_count) {
+        errno = EINVAL;
+        return -1;
+    }
+    uint32_t class_count = compiled->class_count;
+    compiled->transitions = malloc(sizeof(uint32_t) * capacity * class_count);
+    compiled->outputs = malloc(sizeof(uint32_t) * capacity);
+    compiled->report_links = calloc(capacity, sizeof(uint32_t));
+    compiled->pattern_next = malloc(sizeof(uint32_t) * compiled->count);
+    uint32_t *failures = calloc(capacity, sizeof(uint32_t));
+    uint32_t *queue = malloc(sizeof(uint32_t) * capacity);
+    if (compiled->transitions == NULL || compiled->outputs == NULL || compiled->report_links == NULL ||
+        compiled->pattern_next == NULL || failures == NULL || queue == NULL) {
+        free(failures);
+        free(queue);
+        errno = ENOMEM;
+        return -1;
+    }
+    memset(compiled->transitions, 0xFF, sizeof(uint32_t) * capacity * class_count);
+    memset(compiled->outputs, 0xFF, sizeof(uint32_t) * capacity);
+
+    uint32_t state_count = 1;
+    for (size_t i = 0; i < compiled->count; i++) {
+        uint32_t state = 0;
+        for (size_t k = 0; k < compiled->lengths[i]; k++) {
+            uint32_t *next = compiled->transitions + (size_t) state * class_count +
+                             compiled->classes[compiled->patterns[i][k]];
+            if (*next == GREP_NO_PATTERN) {
+                *next = state_count++;
+            }
+            state = *next;
+        }
+        // Prepended, so equal patterns are found in reverse order; the hits are sorted afterwards anyway
+        compiled->pattern_next[i] = compiled->outputs[state];
+        compiled->outputs[state] = (uint32_t) i;
+    }
+    compiled->state_count = state_count;
+
+    size_t head = 0;
+    size_t tail = 0;
+    for (uint32_t c = 0; c < class_count; c++) {
+        uint32_t *next = compiled->transitions + c;
+        if (*next == GREP_NO_PATTERN) {
+            *next = 0;
+        } else {
+            queue[tail++] = *next;
+        }
+    }
+    while (head < tail) {
+        uint32_t state = queue[head++];
+        uint32_t failure = failures[state];
+        compiled->report_links[state] = compiled->outputs[failure] != GREP_NO_PATTERN ? failure
+                                                                                      : compiled->report_links[failure];
+        uint32_t *row = compiled->transitions + (size_t) state * class_count;
+        const uint32_t *failure_row = compiled->transitions + (size_t) failure * class_count;
+        for (uint32_t c = 0; c < class_count; c++) {
+            if (row[c] == GREP_NO_PATTERN) {
+                row[c] = failure_row[c];
+            } else {
+                failures[row[c]] = failure_row[c];
+                queue[tail++] = row[c];
+            }
+        }
+    }
+    free(failures);
+    free(queue);
+    uint32_t *transitions = realloc(compiled->transitions, sizeof(uint32_t) * state_count * class_count);
+    if (transitions != NULL) {
+        compiled->transitions = transitions;
+    }
+
+    int start_count = 0;
+    for (int c = 0; c < 256; c++) {
+        compiled->start[c] = compiled->transitions[compiled->classes[c]] != 0;
+        if (compiled->start[c]) {
+            if (start_count < 4) {
+                compiled->start_bytes[start_count] = (uint8_t) c;
+            }
+            start_count++;
+        }
+    }
+    compiled->start_count = start_count <= 4 ? start_count : 0;
+    for (int i = compiled->start_count; i > 0 && i < 4; i++) {
+        compiled->start_bytes[i] = compiled->start_bytes[0];
+    }
+    return 0;
+}
+
+struct grep_patterns_t *grep_compile(const char *const *patterns, const size_t *lengths, size_t count, int flags) {
+    if (patterns == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (count == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct grep_patterns_t *compiled = calloc(1, sizeof(struct grep_patterns_t));
+    if (compiled == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    compiled->flags = flags;
+    for (int c = 0; c < 256; c++) {
+        compiled->fold[c] = (uint8_t) (flags & GREP_IGNORE_CASE && c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c);
+    }
+    compiled->patterns = calloc(count, sizeof(uint8_t *));
+    compiled->lengths = calloc(count, sizeof(size_t));
+    if (compiled->patterns == NULL || compiled->lengths == NULL) {
+        grep_patterns_free(compiled);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < count; i++) {
+        size_t length = lengths != NULL ? lengths[i] : (patterns[i] != NULL ? strlen(patterns[i]) : 0);
+        if (patterns[i] == NULL || length == 0) {
+            grep_patterns_free(compiled);
+            errno = EINVAL;
+            return NULL;
+        }
+        compiled->patterns[i] = malloc(length);
+        if (compiled->patterns[i] == NULL) {
+            grep_patterns_free(compiled);
+            errno = ENOMEM;
+            return NULL;
+        }
+        compiled->count++;
+        for (size_t k = 0; k < length; k++) {
+            compiled->patterns[i][k] = compiled->fold[(uint8_t) patterns[i][k]];
+        }
+        compiled->lengths[i] = length;
+        if (length > compiled->max_length) {
+            compiled->max_length = length;
+        }
+    }
+    if (grep_build(compiled) != 0) {
+        int error = errno;
+        grep_patterns_free(compiled);
+        errno = error;
+        return NULL;
+    }
+    return compiled;
+}
+
+void grep_patterns_free(struct grep_patterns_t *patterns) {
+    if (patterns == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < patterns->count; i++) {
+        free(patterns->patterns[i]);
+    }
+    free(patterns->patterns);
+    free(patterns->lengths);
+    free(patterns->transitions);
+    free(patterns->outputs);
+    free(patterns->pattern_next);
+    free(patterns->report_links);
+    free(patterns);
+}
+
+static void grep_record(struct grep_worker_t *worker, uint32_t file, uint64_t offset, uint32_t pattern) {
+    if (worker->count == worker->capacity) {
+        size_t capacity = worker->capacity ? worker->capacity * 2 : 256;
+        struct grep_found_t *found = realloc(worker->found, sizeof(struct grep_found_t) * capacity);
+        if (found == NULL) {
+            worker->error = ENOMEM;
+            return;
+        }
+        worker->found = found;
+        worker->capacity = capacity;
+    }
+    struct grep_found_t *hit = worker->found + worker->count++;
+    hit->file = file;
+    hit->offset = (uint32_t) offset;
+    hit->pattern = pattern;
+}
+
+// Index of the first byte at or after i that leaves the root state, length if none does
+static size_t grep_skip(const struct grep_patterns_t *patterns, const uint8_t *data, size_t i, size_t length) {
+#if defined(__SSE2__)
+    // Up to four start bytes are looked for 16 bytes at a time, as memchr would
+    if (patterns->start_count != 0) {
+        const __m128i b0 = _mm_set1_epi8((char) patterns->start_bytes[0]);
+        const __m128i b1 = _mm_set1_epi8((char) patterns->start_bytes[1]);
+        const __m128i b2 = _mm_set1_epi8((char) patterns->start_bytes[2]);
+        const __m128i b3 = _mm_set1_epi8((char) patterns->start_bytes[3]);
+        for (; i + 16 <= length; i += 16) {
+            __m128i block = _mm_loadu_si128((const __m128i *) (data + i));
+            __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, b0), _mm_cmpeq_epi8(block, b1)),
+                                       _mm_or_si128(_mm_cmpeq_epi8(block, b2), _mm_cmpeq_epi8(block, b3)));
+            uint32_t mask = (uint32_t) _mm_movemask_epi8(hit);
+            if (mask != 0) {
+                return i + (size_t) __builtin_ctz(mask);
+            }
+        }
+    }
+#endif
+    while (i < length && !patterns->start[data[i]]) {
+        i++;
+    }
+    return i;
+}
+
+// Runs the automaton over data[0, length), which is at file offset base, from *state and leaves the state reached
+// there; every pattern is matched in the same pass. Matches are recorded if they start before end.
+static void grep_scan(struct grep_worker_t *worker, const uint8_t *data, size_t length, uint32_t file, uint64_t base,
+                      uint64_t end, uint32_t *state) {
+    const struct grep_patterns_t *patterns = worker->job->patterns;
+    const uint32_t *transitions = patterns->transitions;
+    const uint8_t *classes = patterns->classes;
+    uint32_t class_count = patterns->class_count;
+    uint32_t current = *state;
+    for (size_t i = 0; i < length; i++) {
+        if (current == 0) {
+            i = grep_skip(patterns, data, i, length);
+            if (i == length) {
+                break;
+            }
+        }
+        current = transitions[(size_t) current * class_count + classes[data[i]]];
+        uint32_t report = patterns->outputs[current] != GREP_NO_PATTERN ? current : patterns->report_links[current];
+        for (; report != 0; report = patterns->report_links[report]) {
+            for (uint32_t p = patterns->outputs[report]; p != GREP_NO_PATTERN; p = patterns->pattern_next[p]) {
+                uint64_t start = base + i + 1 - patterns->lengths[p];
+                if (start < end) {
+                    grep_record(worker, file, start, p);
+                }
+            }
+        }
+    }
+    *state = current;
+}
+
+static int grep_segment(struct grep_worker_t *worker, const struct grep_segment_t *segment) {
+    struct grep_job_t *job = worker->job;
+    struct volume_t *volume = job->volume;
+    const struct fat_geometry_t *geometry = &volume->geometry;
+    const struct grep_patterns_t *patterns = job->patterns;
+    const struct grep_file_t *file = job->files + segment->file;
+    const uint8_t *fat = job->fat;
+    uint32_t limit = geometry->cluster_count + 2;
+
+    // Matches must start inside the segment; reading goes on far enough to finish the last of them
+    uint64_t end = (uint64_t) segment->start + ((uint64_t) job->segment_clusters << geometry->cluster_shift);
+    if (end > file->size) {
+        end = file->size;
+    }
+    uint64_t read_end = end + patterns->max_length - 1;
+    if (read_end > file->size) {
+        read_end = file->size;
+    }
+    // The automaton state carries partial matches from one extent into the next
+    uint64_t offset = segment->start;
+    uint32_t state = 0;
+    uint32_t cluster = segment->cluster;
+    while (offset < read_end && (offset < end || state != 0)) {
+        if (cluster < 2 || cluster >= limit || cluster * 2 + 1 >= geometry->fat_size) {
+            errno = ERANGE;
+            return -1;
+        }
+        uint32_t run = 1;
+        uint32_t next = (uint32_t) (fat[cluster * 2] | fat[cluster * 2 + 1] << 8);
+        while (run < job->buffer_clusters && ((uint64_t) run << geometry->cluster_shift) < read_end - offset &&
+               next == cluster + run && next < limit) {
+            run++;
+            next = (uint32_t) (fat[next * 2] | fat[next * 2 + 1] << 8);
+        }
+        if (fat_read_clusters(volume, (uint16_t) cluster, run, worker->buffer) < 0) {
+            return -1;
+        }
+        uint64_t length = (uint64_t) run << geometry->cluster_shift;
+        if (length > read_end - offset) {
+            length = read_end - offset;
+        }
+        grep_scan(worker, worker->buffer, (size_t) length, segment->file, offset, end, &state);
+        offset += length;
+        cluster = next;
+    }
+    return worker->error != 0 ? -1 : 0;
+}
+
+static void *grep_worker(void *arg) {
+    struct grep_worker_t *worker = arg;
+    struct grep_job_t *job = worker->job;
+    size_t index;
+    while (worker->error == 0 &&
+           (index = __atomic_fetch_add(&job->next_segment, 1, __ATOMIC_RELAXED)) < job->segment_count) {
+        if (grep_segment(worker, job->segments + index) != 0 && worker->error == 0) {
+            __atomic_store_n(&job->files[job->segments[index].file].failed, true, __ATOMIC_RELAXED);
+        }
+    }
+    return NULL;
+}
+
+static int grep_add_file(struct grep_job_t *job, const char *path, uint16_t first_cluster, uint32_t size) {
+    if (job->file_count == job->file_capacity) {
+        size_t capacity = job->file_capacity ? job->file_capacity * 2 : 64;
+        struct grep_file_t *files = realloc(job->files, sizeof(struct grep_file_t) * capacity);
+        if (files == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        job->files = files;
+        job->file_capacity = capacity;
+    }
+    struct grep_file_t *file = job->files + job->file_count;
+    file->path = strdup(path);
+    if (file->path == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    file->first_cluster = first_cluster;
+    file->size = size;
+    file->failed = false;
+    job->file_count++;
+    return 0;
+}
+
+static int grep_walk_callback(const struct fat_walk_entry_t *entry, void *user) {
+    struct grep_job_t *job = user;
+    if (entry->is_directory) {
+        return FAT_WALK_CONTINUE;
+    }
+    if (grep_add_file(job, entry->path, entry->first_cluster, entry->size) != 0) {
+        job->error = errno;
+        return FAT_WALK_STOP;
+    }
+    return FAT_WALK_CONTINUE;
+}
+
+// One walk of each chain, noting the cluster every segment starts in
+static int grep_plan(struct grep_job_t *job) {
+    const struct fat_geometry_t *geometry = &job->volume->geometry;
+    const uint8_t *fat = job->fat;
+    uint32_t limit = geometry->cluster_count + 2;
+    for (size_t f = 0; f < job->file_count; f++) {
+        struct grep_file_t *file = job->files + f;
+        uint32_t clusters = (uint32_t) (((uint64_t) file->size + geometry->cluster_size - 1) >> geometry->cluster_shift);
+        uint32_t cluster = file->first_cluster;
+        for (uint32_t k = 0; k < clusters; k++) {
+            if (cluster < 2 || cluster >= limit) {
+                file->failed = true;
+                break;
+            }
+            if (k % job->segment_clusters == 0) {
+                if (job->segment_count == job->segment_capacity) {
+                    size_t capacity = job->segment_capacity ? job->segment_capacity * 2 : 64;
+                    struct grep_segment_t *segments = realloc(job->segments, sizeof(struct grep_segment_t) * capacity);
+                    if (segments == NULL) {
+                        errno = ENOMEM;
+                        return -1;
+                    }
+                    job->segments = segments;
+                    job->segment_capacity = capacity;
+                }
+                struct grep_segment_t *segment = job->segments + job->segment_count++;
+                segment->file = (uint32_t) f;
+                segment->start = k << geometry->cluster_shift;
+                segment->cluster = (uint16_t) cluster;
+            }
+            cluster = (uint32_t) (fat[cluster * 2] | fat[cluster * 2 + 1] << 8);
+        }
+    }
+    return 0;
+}
+
+static int grep_found_compare(const void *a, const void *b) {
+    const struct grep_found_t *x = a;
+    const struct grep_found_t *y = b;
+    if (x->file != y->file) {
+        return x->file < y->file ? -1 : 1;
+    }
+    if (x->offset != y->offset) {
+        return x->offset < y->offset ? -1 : 1;
+    }
+    return x->pattern < y->pattern ? -1 : (x->pattern > y->pattern);
+}
+
+static void grep_job_free(struct grep_job_t *job) {
+    for (size_t i = 0; i < job->file_count; i++) {
+        free(job->files[i].path);
+    }
+    free(job->files);
+    free(job->segments);
+    if (job->fat != NULL) {
+        fat_release(job->volume);
+    }
+}
+
+struct grep_result_t *fat_grep(struct volume_t *pvolume, uint16_t first_cluster, const struct search_pattern_t *filter,
+                               const struct grep_patterns_t *patterns, int threads) {
+    if (pvolume == NULL || patterns == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (threads <= 0) {
+        threads = GREP_DEFAULT_THREADS;
+    }
+    struct grep_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.volume = pvolume;
+    job.patterns = patterns;
+    uint32_t cluster_size = pvolume->geometry.cluster_size;
+    job.buffer_clusters = GREP_CHUNK_SIZE > cluster_size ? GREP_CHUNK_SIZE / cluster_size : 1;
+    job.segment_clusters = GREP_SEGMENT_SIZE > cluster_size ? GREP_SEGMENT_SIZE / cluster_size : 1;
+
+    int result = 0;
+    if (filter != NULL) {
+        struct search_result_t *matches = fat_search(pvolume, first_cluster, filter);
+        if (matches == NULL) {
+            return NULL;
+        }
+        for (size_t i = 0; i < matches->count && result == 0; i++) {
+            const struct search_match_t *match = matches->matches + i;
+            if (!match->is_directory) {
+                result = grep_add_file(&job, match->path, match->first_cluster, match->size);
+            }
+        }
+        search_result_free(matches);
+    } else {
+        result = fat_walk(pvolume, first_cluster, FAT_WALK_DEPTH_FIRST, 1, grep_walk_callback, &job);
+        if (result == 0 && job.error != 0) {
+            errno = job.error;
+            result = -1;
+        }
+    }
+    if (result == 0) {
+        job.fat = fat_acquire(pvolume);
+        result = job.fat != NULL ? grep_plan(&job) : -1;
+    }
+    if (result != 0) {
+        int error = errno;
+        grep_job_free(&job);
+        errno = error;
+        return NULL;
+    }
+
+    if ((size_t) threads > job.segment_count) {
+        threads = job.segment_count > 0 ? (int) job.segment_count : 1;
+    }
+    struct grep_worker_t *workers = calloc((size_t) threads, sizeof(struct grep_worker_t));
+    int error = workers == NULL ? ENOMEM : 0;
+    int started = 0;
+    for (int i = 0; i < threads && error == 0; i++) {
+        workers[i].job = &job;
+        workers[i].buffer = malloc((size_t) job.buffer_clusters * cluster_size);
+        if (workers[i].buffer == NULL) {
+            error = ENOMEM;
+        }
+    }
+    if (error == 0) {
+        for (; started < threads - 1; started++) {
+            if (pthread_create(&workers[started + 1].thread, NULL, grep_worker, workers + started + 1) != 0) {
+                break;
+            }
+        }
+        // The calling thread is worker 0; threads that could not start just leave more segments to the others
+        grep_worker(workers);
+        for (int i = 1; i <= started; i++) {
+            pthread_join(workers[i].thread, NULL);
+        }
+    }
+
+    struct grep_result_t *grep = NULL;
+    size_t total = 0;
+    for (int i = 0; i < threads && workers != NULL; i++) {
+        if (workers[i].error != 0) {
+            error = workers[i].error;
+        }
+        total += workers[i].count;
+    }
+    struct grep_found_t *found = NULL;
+    if (error == 0) {
+        grep = calloc(1, sizeof(struct grep_result_t));
+        found = malloc(sizeof(struct grep_found_t) * (total ? total : 1));
+        if (grep != NULL) {
+            grep->hits = malloc(sizeof(struct grep_hit_t) * (total ? total : 1));
+        }
+        if (grep == NULL || found == NULL || grep->hits == NULL) {
+            error = ENOMEM;
+        }
+    }
+    if (error == 0) {
+        size_t count = 0;
+        for (int i = 0; i < threads; i++) {
+            if (workers[i].count != 0) {
+                memcpy(found + count, workers[i].found, sizeof(struct grep_found_t) * workers[i].count);
+                count += workers[i].count;
+            }
+        }
+        qsort(found, total, sizeof(struct grep_found_t), grep_found_compare);
+        for (size_t i = 0; i < total; i++) {
+            // A file that failed part way is not counted as scanned, so the hits of its other segments go too
+            if (job.files[found[i].file].failed) {
+                continue;
+            }
+            grep->hits[grep->count].path = job.files[found[i].file].path;
+            grep->hits[grep->count].offset = found[i].offset;
+            grep->hits[grep->count].pattern = found[i].pattern;
+            grep->count++;
+        }
+        grep->paths = malloc(sizeof(char *) * (job.file_count ? job.file_count : 1));
+        if (grep->paths == NULL) {
+            error = ENOMEM;
+        }
+    }
+    if (error == 0) {
+        for (size_t i = 0; i < job.file_count; i++) {
+            grep->paths[i] = job.files[i].path;
+            if (!job.files[i].failed) {
+                grep->files_scanned++;
+                grep->bytes_scanned += job.files[i].size;
+            }
+            job.files[i].path = NULL;
+        }
+        grep->path_count = job.file_count;
+    }
+
+    for (int i = 0; i < threads && workers != NULL; i++) {
+        free(workers[i].buffer);
+        free(workers[i].found);
+    }
+    free(workers);
+    free(found);
+    grep_job_free(&job);
+    if (error != 0) {
+        grep_result_free(grep);
+        errno = error;
+        return NULL;
+    }
+    return grep;
+}
+
+void grep_result_free(struct grep_result_t *result) {
+    if (result == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < result->path_count; i++) {
+        free(result->paths[i]);
+    }
+    free(result->paths);
+    free(result->hits);
+    free(result);
+}
@@ -0,0 +1,63 @@
+#ifndef MY_FAT_16_READER_FILE_GREP_H
+#define MY_FAT_16_READER_FILE_GREP_H
+
+#include "file_reader.h"
+#include "file_search.h"
+
+#define GREP_IGNORE_CASE 0x01 //ASCII letters only
+
+#define GREP_DEFAULT_THREADS 4
+#define GREP_SEGMENT_SIZE (4 * 1024 * 1024) //Large files are split into segments scanned by different threads
+#define GREP_CHUNK_SIZE (256 * 1024) //Read and scanned at once, rounded down to whole clusters (at least one)
+
+#define GREP_NO_PATTERN UINT32_MAX
+
+// Byte patterns compiled once into an Aho-Corasick automaton, reusable for any number of scans. Every byte of a file
+// is one table lookup whatever the number of patterns; bytes that occur in no pattern share a single column.
+struct grep_patterns_t {
+    size_t count;
+    uint8_t **patterns; //Case folded with GREP_IGNORE_CASE
+    size_t *lengths;
+    size_t max_length;
+    int flags;
+    uint8_t fold[256];
+    uint8_t classes[256]; //Column of each byte in transitions; both cases of a letter share one with GREP_IGNORE_CASE
+    uint32_t class_count;
+    uint32_t state_count; //State 0 is the root
+    uint32_t *transitions; //state_count rows of class_count next states, failure links already folded in
+    uint32_t *outputs; //Per state, first pattern ending there or GREP_NO_PATTERN; the rest via pattern_next
+    uint32_t *pattern_next; //Per pattern, next one ending in the same state (duplicates)
+    uint32_t *report_links; //Per state, nearest state with outputs along its failure links, 0 if none
+    bool start[256]; //Bytes that leave the root
+    uint8_t start_bytes[4]; //The bytes in start when there are at most four of them, repeated to fill the array
+    int start_count; //0 when there are more than four
+};
+
+struct grep_hit_t {
+    const char *path; //Owned by the result, shared by every hit in the same file
+    uint32_t offset; //Of the first byte of the match
+    uint32_t pattern; //Index into the compiled patterns
+};
+
+struct grep_result_t {
+    size_t count;
+    struct grep_hit_t *hits; //Sorted by file, offset and pattern; none from files that could not be read whole
+    size_t path_count;
+    char **paths;
+    size_t files_scanned;
+    uint64_t bytes_scanned;
+};
+
+// lengths may be NULL for null terminated patterns; empty patterns are rejected
+struct grep_patterns_t *grep_compile(const char *const *patterns, const size_t *lengths, size_t count, int flags);
+
+void grep_patterns_free(struct grep_patterns_t *patterns);
+
+// Scans every file below first_cluster (0 for the root directory), or only those matching filter when it is not
+// NULL. Matches spanning clusters, extents and segments are found once, at the offset they start at.
+struct grep_result_t *fat_grep(struct volume_t *pvolume, uint16_t first_cluster, const struct search_pattern_t *filter,
+                               const struct grep_patterns_t *patterns, int threads);
+
+void grep_result_free(struct grep_result_t *result);
+
+#endif //MY_FAT_16_READER_FILE_GREP_H
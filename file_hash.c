@@ -0,0 +1,635 @@
+#include "file_hash.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <nmmintrin.h>
+#define HASH_HAVE_SSE42_PATH 1
+#endif
+
+static uint32_t crc32c_table[256];
+static pthread_once_t crc32c_once = PTHREAD_ONCE_INIT;
+static int crc32c_hardware;
+
+static void crc32c_init(void) {
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t crc = i;
+        for (int k = 0; k < 8; k++) {
+            crc = crc & 1 ? (crc >> 1) ^ 0x82F63B78 : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+#ifdef HASH_HAVE_SSE42_PATH
+    crc32c_hardware = __builtin_cpu_supports("sse4.2");
+#endif
+}
+
+static uint32_t crc32c_software(uint32_t crc, const uint8_t *data, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        crc = crc32c_table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    }
+    return crc;
+}
+
+#ifdef HASH_HAVE_SSE42_PATH
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_sse42(uint32_t crc, const uint8_t *data, size_t length) {
+    while (length > 0 && ((uintptr_t) data & 7) != 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+#ifdef __x86_64__
+    uint64_t crc64 = crc;
+    for (; length >= 8; data += 8, length -= 8) {
+        crc64 = _mm_crc32_u64(crc64, *(const uint64_t *) data);
+    }
+    crc = (uint32_t) crc64;
+#endif
+    for (; length >= 4; data += 4, length -= 4) {
+        crc = _mm_crc32_u32(crc, *(const uint32_t *) data);
+    }
+    while (length > 0) {
+        crc = _mm_crc32_u8(crc, *data++);
+        length--;
+    }
+    return crc;
+}
+#endif
+
+uint32_t hash_crc32c_update(uint32_t crc, const void *data, size_t length) {
+    pthread_once(&crc32c_once, crc32c_init);
+    crc = ~crc;
+#ifdef HASH_HAVE_SSE42_PATH
+    if (crc32c_hardware) {
+        return ~crc32c_sse42(crc, data, length);
+    }
+#endif
+    return ~crc32c_software(crc, data, length);
+}
+
+#define XXH_PRIME64_1 11400714785074694791ULL
+#define XXH_PRIME64_2 14029467366897019727ULL
+#define XXH_PRIME64_3 1609587929392839161ULL
+#define XXH_PRIME64_4 9650029242287828579ULL
+#define XXH_PRIME64_5 2870177450012600261ULL
+
+static uint64_t rotl64(uint64_t x, int r) {
+    return (x << r) | (x >> (64 - r));
+}
+
+static uint64_t read64(const uint8_t *p) {
+    uint64_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint32_t read32(const uint8_t *p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static uint64_t xxh64_round(uint64_t acc, uint64_t input) {
+    acc += input * XXH_PRIME64_2;
+    acc = rotl64(acc, 31);
+    return acc * XXH_PRIME64_1;
+}
+
+static uint64_t xxh64_merge(uint64_t acc, uint64_t value) {
+    acc ^= xxh64_round(0, value);
+    return acc * XXH_PRIME64_1 + XXH_PRIME64_4;
+}
+
+void hash_xxh64_init(struct xxh64_state_t *state, uint64_t seed) {
+    memset(state, 0, sizeof(struct xxh64_state_t));
+    state->v[0] = seed + XXH_PRIME64_1 + XXH_PRIME64_2;
+    state->v[1] = seed + XXH_PRIME64_2;
+    state->v[2] = seed;
+    state->v[3] = seed - XXH_PRIME64_1;
+}
+
+void hash_xxh64_update(struct xxh64_state_t *state, const void *data, size_t length) {
+    const uint8_t *p = data;
+    state->total_length += length;
+    if (state->buffered + length < 32) {
+        memcpy(state->buffer + state->buffered, p, length);
+        state->buffered += (uint32_t) length;
+        return;
+    }
+    if (state->buffered > 0) {
+        size_t fill = 32 - state->buffered;
+        memcpy(state->buffer + state->buffered, p, fill);
+        for (int i = 0; i < 4; i++) {
+            state->v[i] = xxh64_round(state->v[i], read64(state->buffer + i * 8));
+        }
+        p += fill;
+        length -= fill;
+        state->buffered = 0;
+    }
+    for (; length >= 32; p += 32, length -= 32) {
+        state->v[0] = xxh64_round(state->v[0], read64(p));
+        state->v[1] = xxh64_round(state->v[1], read64(p + 8));
+        state->v[2] = xxh64_round(state->v[2], read64(p + 16));
+        state->v[3] = xxh64_round(state->v[3], read64(p + 24));
+    }
+    memcpy(state->buffer, p, length);
+    state->buffered = (uint32_t) length;
+}
+
+uint64_t hash_xxh64_final(const struct xxh64_state_t *state) {
+    uint64_t h;
+    if (state->total_length >= 32) {
+        h = rotl64(state->v[0], 1) + rotl64(state->v[1], 7) + rotl64(state->v[2], 12) + rotl64(state->v[3], 18);
+        for (int i = 0; i < 4; i++) {
+            h = xxh64_merge(h, state->v[i]);
+        }
+    } else {
+        h = state->v[2] + XXH_PRIME64_5;
+    }
+    h += state->total_length;
+    const uint8_t *p = state->buffer;
+    uint32_t length = state->buffered;
+    for (; length >= 8; p += 8, length -= 8) {
+        h ^= xxh64_round(0, read64(p));
+        h = rotl64(h, 27) * XXH_PRIME64_1 + XXH_PRIME64_4;
+    }
+    if (length >= 4) {
+        h ^= (uint64_t) read32(p) * XXH_PRIME64_1;
+        h = rotl64(h, 23) * XXH_PRIME64_2 + XXH_PRIME64_3;
+        p += 4;
+        length -= 4;
+    }
+    for (; length > 0; p++, length--) {
+        h ^= *p * XXH_PRIME64_5;
+        h = rotl64(h, 11) * XXH_PRIME64_1;
+    }
+    h ^= h >> 33;
+    h *= XXH_PRIME64_2;
+    h ^= h >> 29;
+    h *= XXH_PRIME64_3;
+    h ^= h >> 32;
+    return h;
+}
+
+static const uint32_t sha256_k[64] = {
+        0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+        0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+        0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+        0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+        0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+        0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+        0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+        0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t rotr32(uint32_t x, int r) {
+    return (x >> r) | (x << (32 - r));
+}
+
+static void sha256_block(struct sha256_state_t *state, const uint8_t *block) {
+    uint32_t w[64];
+    for (int i = 0; i < 16; i++) {
+        w[i] = (uint32_t) block[i * 4] << 24 | (uint32_t) block[i * 4 + 1] << 16 |
+               (uint32_t) block[i * 4 + 2] << 8 | block[i * 4 + 3];
+    }
+    for (int i = 16; i < 64; i++) {
+        uint32_t s0 = rotr32(w[i - 15], 7) ^ rotr32(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr32(w[i - 2], 17) ^ rotr32(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+    uint32_t a = state->h[0], b = state->h[1], c = state->h[2], d = state->h[3];
+    uint32_t e = state->h[4], f = state->h[5], g = state->h[6], h = state->h[7];
+    for (int i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr32(e, 6) ^ rotr32(e, 11) ^ rotr32(e, 25)) + ((e & f) ^ (~e & g)) + sha256_k[i] + w[i];
+        uint32_t t2 = (rotr32(a, 2) ^ rotr32(a, 13) ^ rotr32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state->h[0] += a;
+    state->h[1] += b;
+    state->h[2] += c;
+    state->h[3] += d;
+    state->h[4] += e;
+    state->h[5] += f;
+    state->h[6] += g;
+    state->h[7] += h;
+}
+
+void hash_sha256_init(struct sha256_state_t *state) {
+    static const uint32_t initial[8] = {
+            0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memset(state, 0, sizeof(struct sha256_state_t));
+    memcpy(state->h, initial, sizeof(initial));
+}
+
+void hash_sha256_update(struct sha256_state_t *state, const void *data, size_t length) {
+    const uint8_t *p = data;
+    state->total_length += length;
+    if (state->buffered > 0) {
+        size_t fill = 64 - state->buffered;
+        if (fill > length) {
+            fill = length;
+        }
+        memcpy(state->buffer + state->buffered, p, fill);
+        state->buffered += (uint32_t) fill;
+        p += fill;
+        length -= fill;
+        if (state->buffered < 64) {
+            return;
+        }
+        sha256_block(state, state->buffer);
+        state->buffered = 0;
+    }
+    for (; length >= 64; p += 64, length -= 64) {
+        sha256_block(state, p);
+    }
+    memcpy(state->buffer, p, length);
+    state->buffered = (uint32_t) length;
+}
+
+void hash_sha256_final(struct sha256_state_t *state, uint8_t digest[32]) {
+    uint64_t bits = state->total_length * 8;
+    uint8_t padding[128] = {0x80};
+    size_t pad = state->buffered < 56 ? 56 - state->buffered : 120 - state->buffered;
+    for (int i = 0; i < 8; i++) {
+        padding[pad + i] = (uint8_t) (bits >> (56 - i * 8));
+    }
+    hash_sha256_update(state, padding, pad + 8);
+    for (int i = 0; i < 8; i++) {
+        digest[i * 4] = (uint8_t) (state->h[i] >> 24);
+        digest[i * 4 + 1] = (uint8_t) (state->h[i] >> 16);
+        digest[i * 4 + 2] = (uint8_t) (state->h[i] >> 8);
+        digest[i * 4 + 3] = (uint8_t) state->h[i];
+    }
+}
+
+union hash_state_t {
+    uint32_t crc;
+    struct xxh64_state_t xxh64;
+    struct sha256_state_t sha256;
+};
+
+struct hash_chunk_t {
+    size_t file;
+    uint8_t *data;
+    uint32_t length;
+    int last;
+    int error;
+};
+
+// Bounded queue between the I/O threads and one hashing worker
+struct hash_queue_t {
+    struct hash_chunk_t chunks[HASH_QUEUE_DEPTH];
+    size_t head;
+    size_t count;
+    int closed;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty;
+    pthread_cond_t not_full;
+};
+
+struct hash_job_t {
+    struct volume_t *volume;
+    struct hash_manifest_t *manifest;
+    uint16_t *first_clusters;
+    union hash_state_t *states;
+    size_t next_file;
+    struct hash_queue_t *queues;
+    int hash_threads;
+};
+
+struct hash_worker_t {
+    struct hash_job_t *job;
+    struct hash_queue_t *queue;
+};
+
+static void hash_queue_push(struct hash_queue_t *queue, struct hash_chunk_t chunk) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == HASH_QUEUE_DEPTH) {
+        pthread_cond_wait(&queue->not_full, &queue->lock);
+    }
+    queue->chunks[(queue->head + queue->count) % HASH_QUEUE_DEPTH] = chunk;
+    queue->count++;
+    pthread_cond_signal(&queue->not_empty);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static int hash_queue_pop(struct hash_queue_t *queue, struct hash_chunk_t *chunk) {
+    pthread_mutex_lock(&queue->lock);
+    while (queue->count == 0 && !queue->closed) {
+        pthread_cond_wait(&queue->not_empty, &queue->lock);
+    }
+    if (queue->count == 0) {
+        pthread_mutex_unlock(&queue->lock);
+        return 0;
+    }
+    *chunk = queue->chunks[queue->head];
+    queue->head = (queue->head + 1) % HASH_QUEUE_DEPTH;
+    queue->count--;
+    pthread_cond_signal(&queue->not_full);
+    pthread_mutex_unlock(&queue->lock);
+    return 1;
+}
+
+// Reads one file extent by extent (runs of consecutive clusters) and queues it in order
+static void hash_read_file(struct hash_job_t *job, size_t file) {
+    struct volume_t *volume = job->volume;
+    struct hash_queue_t *queue = job->queues + file % job->hash_threads;
+    struct hash_chunk_t chunk = {file, NULL, 0, 1, 0};
+    uint32_t remaining = job->manifest->entries[file].size;
+    if (remaining == 0) {
+        hash_queue_push(queue, chunk);
+        return;
+    }
+    const uint8_t *fat = fat_acquire(volume);
+    struct clusters_chain_t *chain = fat != NULL ? get_chain_fat16(fat, volume->geometry.fat_size,
+                                                                   job->first_clusters[file]) : NULL;
+    if (fat != NULL) {
+        fat_release(volume);
+    }
+    if (chain == NULL) {
+        chunk.error = fat != NULL ? EINVAL : errno;
+        hash_queue_push(queue, chunk);
+        return;
+    }
+    uint32_t cluster_size = volume->geometry.cluster_size;
+    uint32_t clusters_per_chunk = HASH_CHUNK_SIZE > cluster_size ? HASH_CHUNK_SIZE / cluster_size : 1;
+    size_t k = 0;
+    while (remaining > 0) {
+        if (k >= chain->size) {
+            chunk.error = ERANGE;
+            break;
+        }
+        size_t run = 1;
+        while (k + run < chain->size && run < clusters_per_chunk &&
+               chain->clusters[k + run] == chain->clusters[k] + run) {
+            run++;
+        }
+        uint32_t length = run * cluster_size < remaining ? (uint32_t) (run * cluster_size) : remaining;
+        uint8_t *data = malloc(run * cluster_size);
+        if (data == NULL) {
+            chunk.error = ENOMEM;
+            break;
+        }
+        if (fat_read_clusters(volume, chain->clusters[k], (uint32_t) run, data) < 0) {
+            free(data);
+            chunk.error = ERANGE;
+            break;
+        }
+        remaining -= length;
+        k += run;
+        struct hash_chunk_t piece = {file, data, length, remaining == 0, 0};
+        hash_queue_push(queue, piece);
+    }
+    free(chain->clusters);
+    free(chain);
+    if (chunk.error != 0) {
+        hash_queue_push(queue, chunk);
+    }
+}
+
+static void *hash_io_worker(void *arg) {
+    struct hash_job_t *job = arg;
+    size_t file;
+    while ((file = __atomic_fetch_add(&job->next_file, 1, __ATOMIC_RELAXED)) < job->manifest->count) {
+        hash_read_file(job, file);
+    }
+    return NULL;
+}
+
+static void hash_finish(struct hash_manifest_t *manifest, union hash_state_t *state, size_t file) {
+    uint8_t *digest = manifest->entries[file].digest;
+    if (manifest->algorithm == HASH_CRC32C) {
+        for (int i = 0; i < 4; i++) {
+            digest[i] = (uint8_t) (state->crc >> (24 - i * 8));
+        }
+    } else if (manifest->algorithm == HASH_XXH64) {
+        uint64_t h = hash_xxh64_final(&state->xxh64);
+        for (int i = 0; i < 8; i++) {
+            digest[i] = (uint8_t) (h >> (56 - i * 8));
+        }
+    } else {
+        hash_sha256_final(&state->sha256, digest);
+    }
+}
+
+static void *hash_worker(void *arg) {
+    struct hash_worker_t *worker = arg;
+    struct hash_job_t *job = worker->job;
+    struct hash_chunk_t chunk;
+    while (hash_queue_pop(worker->queue, &chunk)) {
+        union hash_state_t *state = job->states + chunk.file;
+        struct hash_manifest_entry_t *entry = job->manifest->entries + chunk.file;
+        if (chunk.error != 0) {
+            entry->error = chunk.error;
+        } else if (chunk.length > 0) {
+            if (job->manifest->algorithm == HASH_CRC32C) {
+                state->crc = hash_crc32c_update(state->crc, chunk.data, chunk.length);
+            } else if (job->manifest->algorithm == HASH_XXH64) {
+                hash_xxh64_update(&state->xxh64, chunk.data, chunk.length);
+            } else {
+                hash_sha256_update(&state->sha256, chunk.data, chunk.length);
+            }
+        }
+        free(chunk.data);
+        if (chunk.last && entry->error == 0) {
+            hash_finish(job->manifest, state, chunk.file);
+        }
+    }
+    return NULL;
+}
+
+struct hash_collect_t {
+    struct hash_manifest_t *manifest;
+    uint16_t *first_clusters;
+    size_t capacity;
+    int error;
+};
+
+static int hash_collect(const struct fat_walk_entry_t *entry, void *user) {
+    struct hash_collect_t *collect = user;
+    if (entry->is_directory) {
+        return FAT_WALK_CONTINUE;
+    }
+    struct hash_manifest_t *manifest = collect->manifest;
+    if (manifest->count == collect->capacity) {
+        size_t capacity = collect->capacity ? collect->capacity * 2 : 64;
+        struct hash_manifest_entry_t *entries = realloc(manifest->entries,
+                                                        sizeof(struct hash_manifest_entry_t) * capacity);
+        if (entries == NULL) {
+            collect->error = ENOMEM;
+            return FAT_WALK_STOP;
+        }
+        manifest->entries = entries;
+        uint16_t *first_clusters = realloc(collect->first_clusters, sizeof(uint16_t) * capacity);
+        if (first_clusters == NULL) {
+            collect->error = ENOMEM;
+            return FAT_WALK_STOP;
+        }
+        collect->first_clusters = first_clusters;
+        collect->capacity = capacity;
+    }
+    struct hash_manifest_entry_t *manifest_entry = manifest->entries + manifest->count;
+    memset(manifest_entry, 0, sizeof(struct hash_manifest_entry_t));
+    manifest_entry->path = strdup(entry->path);
+    if (manifest_entry->path == NULL) {
+        collect->error = ENOMEM;
+        return FAT_WALK_STOP;
+    }
+    manifest_entry->size = entry->size;
+    collect->first_clusters[manifest->count] = entry->first_cluster;
+    manifest->count++;
+    return FAT_WALK_CONTINUE;
+}
+
+struct hash_manifest_t *fat_hash_files(struct volume_t *pvolume, int algorithm, int io_threads, int hash_threads) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (algorithm != HASH_CRC32C && algorithm != HASH_XXH64 && algorithm != HASH_SHA256) {
+        errno = EINVAL;
+        return NULL;
+    }
+    io_threads = io_threads < 1 ? 1 : io_threads;
+    hash_threads = hash_threads < 1 ? 1 : hash_threads;
+
+    struct hash_manifest_t *manifest = calloc(1, sizeof(struct hash_manifest_t));
+    if (manifest == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    manifest->algorithm = algorithm;
+    manifest->digest_size = algorithm == HASH_CRC32C ? 4 : algorithm == HASH_XXH64 ? 8 : 32;
+    struct hash_collect_t collect = {manifest, NULL, 0, 0};
+    if (fat_walk(pvolume, 0, FAT_WALK_DEPTH_FIRST, 1, hash_collect, &collect) != 0 || collect.error != 0) {
+        int error = collect.error ? collect.error : errno;
+        free(collect.first_clusters);
+        hash_manifest_free(manifest);
+        errno = error;
+        return NULL;
+    }
+    if (manifest->count == 0) {
+        free(collect.first_clusters);
+        return manifest;
+    }
+
+    struct hash_job_t job;
+    memset(&job, 0, sizeof(job));
+    job.volume = pvolume;
+    job.manifest = manifest;
+    job.first_clusters = collect.first_clusters;
+    job.hash_threads = hash_threads;
+    job.states = malloc(sizeof(union hash_state_t) * manifest->count);
+    job.queues = calloc(hash_threads, sizeof(struct hash_queue_t));
+    struct hash_worker_t *workers = malloc(sizeof(struct hash_worker_t) * hash_threads);
+    pthread_t *threads = malloc(sizeof(pthread_t) * (io_threads + hash_threads));
+    if (job.states == NULL || job.queues == NULL || workers == NULL || threads == NULL) {
+        free(job.states);
+        free(job.queues);
+        free(workers);
+        free(threads);
+        free(collect.first_clusters);
+        hash_manifest_free(manifest);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (size_t i = 0; i < manifest->count; i++) {
+        if (algorithm == HASH_CRC32C) {
+            job.states[i].crc = 0;
+        } else if (algorithm == HASH_XXH64) {
+            hash_xxh64_init(&job.states[i].xxh64, 0);
+        } else {
+            hash_sha256_init(&job.states[i].sha256);
+        }
+    }
+
+    int started_hash = 0, started_io = 0;
+    for (; started_hash < hash_threads; started_hash++) {
+        struct hash_queue_t *queue = job.queues + started_hash;
+        pthread_mutex_init(&queue->lock, NULL);
+        pthread_cond_init(&queue->not_empty, NULL);
+        pthread_cond_init(&queue->not_full, NULL);
+        workers[started_hash].job = &job;
+        workers[started_hash].queue = queue;
+        if (pthread_create(threads + started_hash, NULL, hash_worker, workers + started_hash) != 0) {
+            pthread_cond_destroy(&queue->not_full);
+            pthread_cond_destroy(&queue->not_empty);
+            pthread_mutex_destroy(&queue->lock);
+            break;
+        }
+    }
+    // Files are routed to queues by index, so every queue needs a consumer
+    job.hash_threads = started_hash;
+    if (started_hash > 0) {
+        for (; started_io < io_threads; started_io++) {
+            if (pthread_create(threads + hash_threads + started_io, NULL, hash_io_worker, &job) != 0) {
+                break;
+            }
+        }
+        if (started_io == 0) {
+            hash_io_worker(&job);
+        }
+    }
+    for (int i = 0; i < started_io; i++) {
+        pthread_join(threads[hash_threads + i], NULL);
+    }
+    for (int i = 0; i < started_hash; i++) {
+        pthread_mutex_lock(&job.queues[i].lock);
+        job.queues[i].closed = 1;
+        pthread_cond_signal(&job.queues[i].not_empty);
+        pthread_mutex_unlock(&job.queues[i].lock);
+    }
+    for (int i = 0; i < started_hash; i++) {
+        pthread_join(threads[i], NULL);
+        pthread_cond_destroy(&job.queues[i].not_full);
+        pthread_cond_destroy(&job.queues[i].not_empty);
+        pthread_mutex_destroy(&job.queues[i].lock);
+    }
+    free(job.states);
+    free(job.queues);
+    free(workers);
+    free(threads);
+    free(collect.first_clusters);
+    if (started_hash == 0) {
+        hash_manifest_free(manifest);
+        errno = EAGAIN;
+        return NULL;
+    }
+    return manifest;
+}
+
+int hash_manifest_write(const struct hash_manifest_t *manifest, FILE *out) {
+    if (manifest == NULL || out == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    for (size_t i = 0; i < manifest->count; i++) {
+        const struct hash_manifest_entry_t *entry = manifest->entries + i;
+        if (entry->error != 0) {
+            fprintf(out, "!%s  %s\n", strerror(entry->error), entry->path);
+            continue;
+        }
+        for (size_t k = 0; k < manifest->digest_size; k++) {
+            fprintf(out, "%02x", entry->digest[k]);
+        }
+        fprintf(out, "  %s\n", entry->path);
+    }
+    return ferror(out) ? -1 : 0;
+}
+
+void hash_manifest_free(struct hash_manifest_t *manifest) {
+    if (manifest == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < manifest->count; i++) {
+        free(manifest->entries[i].path);
+    }
+    free(manifest->entries);
+    free(manifest);
+}
@@ -0,0 +1,62 @@
+#ifndef MY_FAT_16_READER_FILE_HASH_H
+#define MY_FAT_16_READER_FILE_HASH_H
+
+#include "file_reader.h"
+
+#define HASH_CRC32C 0
+#define HASH_XXH64 1
+#define HASH_SHA256 2
+
+#define HASH_MAX_DIGEST_SIZE 32
+#define HASH_CHUNK_SIZE (256 * 1024) //Largest piece of a file the I/O threads hand to a hashing worker
+#define HASH_QUEUE_DEPTH 8 //Chunks in flight per hashing worker
+
+struct xxh64_state_t {
+    uint64_t v[4];
+    uint64_t total_length;
+    uint8_t buffer[32];
+    uint32_t buffered;
+};
+
+struct sha256_state_t {
+    uint32_t h[8];
+    uint64_t total_length;
+    uint8_t buffer[64];
+    uint32_t buffered;
+};
+
+struct hash_manifest_entry_t {
+    char *path;
+    uint32_t size;
+    int error; //errno of a failed read, 0 when digest is valid
+    uint8_t digest[HASH_MAX_DIGEST_SIZE]; //Big-endian, digest_size bytes
+};
+
+struct hash_manifest_t {
+    int algorithm;
+    size_t digest_size;
+    size_t count;
+    struct hash_manifest_entry_t *entries;
+};
+
+uint32_t hash_crc32c_update(uint32_t crc, const void *data, size_t length);
+
+void hash_xxh64_init(struct xxh64_state_t *state, uint64_t seed);
+
+void hash_xxh64_update(struct xxh64_state_t *state, const void *data, size_t length);
+
+uint64_t hash_xxh64_final(const struct xxh64_state_t *state);
+
+void hash_sha256_init(struct sha256_state_t *state);
+
+void hash_sha256_update(struct sha256_state_t *state, const void *data, size_t length);
+
+void hash_sha256_final(struct sha256_state_t *state, uint8_t digest[32]);
+
+struct hash_manifest_t *fat_hash_files(struct volume_t *pvolume, int algorithm, int io_threads, int hash_threads);
+
+int hash_manifest_write(const struct hash_manifest_t *manifest, FILE *out);
+
+void hash_manifest_free(struct hash_manifest_t *manifest);
+
+#endif //MY_FAT_16_READER_FILE_HASH_H
@@ -1,4 +1,24 @@
+#define _GNU_SOURCE
+
+#ifdef FAT_PROFILE
+// The profiled entry points keep the public names and are defined in fat_profile.c
+#define fat_open fat_open_unprofiled
+#define fat_close fat_close_unprofiled
+#define file_open file_open_unprofiled
+#define file_read file_read_unprofiled
+#define dir_read dir_read_unprofiled
+#endif
+
 #include "file_reader.h"
+#include "compressed_image.h"
+#include "file_writer.h"
+#include "fat_trace.h"
+
+#include <sched.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 struct clusters_chain_t *get_chain_fat16(const void *const buffer, size_t size, uint16_t first_cluster) {
     if (!buffer || size == 0) {
@@ -35,6 +55,12 @@ struct clusters_chain_t *get_chain_fat16(const void *const buffer, size_t size,
         if (result >= 0xFFF0) {
             break;
         }
+        if (clustersChain->size >= (size_t) max_uint16) {
+            // Longer than the FAT, so the chain loops
+            free(clustersChain->clusters);
+            free(clustersChain);
+            return NULL;
+        }
         first_cluster = result;
         if (first_cluster >= max_uint16) {
             free(clustersChain->clusters);
@@ -62,21 +88,322 @@ struct disk_t *disk_open_from_file(const char *volume_file_name) {
         free(disk);
         return NULL;
     }
+    disk->compressed = NULL;
+    disk->direct = NULL;
+    disk->writable = false;
+    if (compressed_image_probe(disk->disk) == 1) {
+        disk->compressed = compressed_image_open(disk->disk);
+        if (disk->compressed == NULL) {
+            fclose(disk->disk);
+            free(disk);
+            return NULL;
+        }
+        disk->size = (int64_t) disk->compressed->header.image_size;
+    } else {
+        fseeko(disk->disk, 0, SEEK_END);
+        disk->size = ftello(disk->disk);
+    }
+    return disk;
+}
+
+static bool direct_alignment_valid(size_t alignment) {
+    return alignment >= SECTOR_SIZE && alignment <= DISK_BUFFER_SIZE && (alignment & (alignment - 1)) == 0;
+}
+
+static size_t direct_block_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return DISK_DIRECT_DEFAULT_ALIGNMENT;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        int logical = 0;
+        if (ioctl(fd, BLKSSZGET, &logical) == 0 && direct_alignment_valid((size_t) logical)) {
+            return (size_t) logical;
+        }
+        return DISK_DIRECT_DEFAULT_ALIGNMENT;
+    }
+#ifdef STATX_DIOALIGN
+    // Linux 6.1 and later report the real O_DIRECT alignment of regular files
+    struct statx stx;
+    if (statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &stx) == 0 && (stx.stx_mask & STATX_DIOALIGN) &&
+        direct_alignment_valid(stx.stx_dio_offset_align) && direct_alignment_valid(stx.stx_dio_mem_align)) {
+        return stx.stx_dio_offset_align > stx.stx_dio_mem_align ? stx.stx_dio_offset_align : stx.stx_dio_mem_align;
+    }
+#endif
+    // st_blksize is a multiple of the logical block size for regular files on every common filesystem
+    if (direct_alignment_valid((size_t) st.st_blksize)) {
+        return (size_t) st.st_blksize;
+    }
+    return DISK_DIRECT_DEFAULT_ALIGNMENT;
+}
+
+// st_size is 0 for block devices, whose size only the device itself knows
+static int64_t direct_disk_size(int fd) {
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        return 0;
+    }
+    if (S_ISBLK(st.st_mode)) {
+        uint64_t bytes;
+        if (ioctl(fd, BLKGETSIZE64, &bytes) == 0) {
+            return (int64_t) bytes;
+        }
+        off_t end = lseek(fd, 0, SEEK_END);
+        lseek(fd, 0, SEEK_SET);
+        return end > 0 ? (int64_t) end : 0;
+    }
+    return (int64_t) st.st_size;
+}
+
+struct disk_t *disk_open_from_file_direct(const char *volume_file_name) {
+    if (volume_file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    // Compressed images are decoded through stdio and keep the buffered path
+    FILE *probe = fopen(volume_file_name, "rb");
+    if (probe == NULL) {
+        errno = ENOENT;
+        return NULL;
+    }
+    int compressed = compressed_image_probe(probe) == 1;
+    fclose(probe);
+    if (compressed) {
+        return disk_open_from_file(volume_file_name);
+    }
+
+    int fd = open(volume_file_name, O_RDONLY | O_DIRECT);
+    if (fd < 0) {
+        // Filesystems such as older tmpfs refuse O_DIRECT: behave like a plain disk
+        return disk_open_from_file(volume_file_name);
+    }
+    struct disk_t *disk = malloc(sizeof(struct disk_t));
+    struct disk_direct_t *direct = calloc(1, sizeof(struct disk_direct_t));
+    if (disk == NULL || direct == NULL) {
+        free(disk);
+        free(direct);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    direct->block_size = direct_block_size(fd);
+    direct->buffer_size = DISK_BUFFER_SIZE + direct->block_size;
+    if (posix_memalign((void **) &direct->pool, direct->block_size, direct->buffer_size * DISK_BUFFER_COUNT) != 0) {
+        free(disk);
+        free(direct);
+        close(fd);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (int i = 0; i < DISK_BUFFER_COUNT; i++) {
+        direct->free_buffers[i] = direct->pool + (size_t) i * direct->buffer_size;
+    }
+    direct->free_count = DISK_BUFFER_COUNT;
+    pthread_mutex_init(&direct->lock, NULL);
+
+    disk->disk = fdopen(fd, "rb");
+    if (disk->disk == NULL) {
+        pthread_mutex_destroy(&direct->lock);
+        free(direct->pool);
+        free(direct);
+        free(disk);
+        close(fd);
+        return NULL;
+    }
+    disk->compressed = NULL;
+    disk->direct = direct;
+    disk->writable = false;
+    disk->size = direct_disk_size(fd);
+    return disk;
+}
+
+struct disk_t *disk_open_from_file_rw(const char *volume_file_name) {
+    if (volume_file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct disk_t *disk = malloc(sizeof(struct disk_t));
+    if (disk == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    disk->disk = fopen(volume_file_name, "r+b");
+    if (disk->disk == NULL) {
+        int error = errno;
+        free(disk);
+        errno = error;
+        return NULL;
+    }
+    // Blocks of a compressed image cannot be rewritten in place
+    if (compressed_image_probe(disk->disk) == 1) {
+        fclose(disk->disk);
+        free(disk);
+        errno = EROFS;
+        return NULL;
+    }
+    disk->compressed = NULL;
+    disk->direct = NULL;
+    disk->writable = true;
+    fseeko(disk->disk, 0, SEEK_END);
+    disk->size = ftello(disk->disk);
     return disk;
 }
 
+static int disk_buffer_is_pooled(struct disk_t *pdisk, void *buffer) {
+    struct disk_direct_t *direct = pdisk->direct;
+    return direct != NULL && (uint8_t *) buffer >= direct->pool &&
+           (uint8_t *) buffer < direct->pool + direct->buffer_size * DISK_BUFFER_COUNT;
+}
+
+void *disk_buffer_acquire(struct disk_t *pdisk, size_t size) {
+    if (pdisk == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct disk_direct_t *direct = pdisk->direct;
+    if (direct == NULL) {
+        return malloc(size);
+    }
+    if (size <= direct->buffer_size) {
+        pthread_mutex_lock(&direct->lock);
+        if (direct->free_count > 0) {
+            void *buffer = direct->free_buffers[--direct->free_count];
+            pthread_mutex_unlock(&direct->lock);
+            return buffer;
+        }
+        pthread_mutex_unlock(&direct->lock);
+    }
+    // Pool exhausted or request too large: hand out a one-off buffer with the same alignment
+    void *buffer;
+    size_t rounded = (size + direct->block_size - 1) / direct->block_size * direct->block_size;
+    if (posix_memalign(&buffer, direct->block_size, rounded) != 0) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return buffer;
+}
+
+void disk_buffer_release(struct disk_t *pdisk, void *buffer) {
+    if (pdisk == NULL || buffer == NULL) {
+        return;
+    }
+    if (!disk_buffer_is_pooled(pdisk, buffer)) {
+        free(buffer);
+        return;
+    }
+    pthread_mutex_lock(&pdisk->direct->lock);
+    pdisk->direct->free_buffers[pdisk->direct->free_count++] = buffer;
+    pthread_mutex_unlock(&pdisk->direct->lock);
+}
+
+// Reads length bytes at offset with every transfer aligned to the device block size
+static int direct_read(struct disk_t *pdisk, int64_t offset, uint8_t *buffer, size_t length) {
+    struct disk_direct_t *direct = pdisk->direct;
+    int fd = fileno(pdisk->disk);
+    size_t align = direct->block_size;
+    if (((uintptr_t) buffer | (uint64_t) offset | length) % align == 0) {
+        while (length > 0) {
+            ssize_t got = pread(fd, buffer, length, (off_t) offset);
+            if (got <= 0) {
+                if (got == 0) {
+                    errno = ERANGE;
+                }
+                return -1;
+            }
+            buffer += got;
+            offset += got;
+            length -= (size_t) got;
+        }
+        return 0;
+    }
+    uint8_t *bounce = disk_buffer_acquire(pdisk, direct->buffer_size);
+    if (bounce == NULL) {
+        return -1;
+    }
+    while (length > 0) {
+        int64_t aligned_start = offset / (int64_t) align * (int64_t) align;
+        size_t skip = (size_t) (offset - aligned_start);
+        size_t span = (skip + length + align - 1) / align * align;
+        if (span > direct->buffer_size) {
+            span = direct->buffer_size;
+        }
+        ssize_t got = pread(fd, bounce, span, (off_t) aligned_start);
+        size_t chunk = span - skip < length ? span - skip : length;
+        if (got < 0 || (size_t) got < skip + chunk) {
+            if (got >= 0) {
+                errno = ERANGE;
+            }
+            disk_buffer_release(pdisk, bounce);
+            return -1;
+        }
+        memcpy(buffer, bounce + skip, chunk);
+        buffer += chunk;
+        offset += (int64_t) chunk;
+        length -= chunk;
+    }
+    disk_buffer_release(pdisk, bounce);
+    return 0;
+}
+
 int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read) {
     if (pdisk == NULL || pdisk->disk == NULL || buffer == NULL) {
         errno = EFAULT;
         return -1;
     }
-    fseek(pdisk->disk, 0, SEEK_END);
-    if (sectors_to_read + first_sector > ftell(pdisk->disk) / SECTOR_SIZE || first_sector < 0 || sectors_to_read < 1) {
+    if ((int64_t) sectors_to_read + first_sector > pdisk->size / SECTOR_SIZE || first_sector < 0 ||
+        sectors_to_read < 1) {
+        errno = ERANGE;
+        return -1;
+    }
+    if (pdisk->compressed != NULL) {
+        if (compressed_image_read(pdisk->compressed, (uint64_t) first_sector * SECTOR_SIZE, buffer,
+                                  (size_t) sectors_to_read * SECTOR_SIZE) != 0) {
+            return -1;
+        }
+        return sectors_to_read;
+    }
+    if (pdisk->direct != NULL && !__atomic_load_n(&pdisk->direct->disabled, __ATOMIC_RELAXED)) {
+        if (direct_read(pdisk, (int64_t) first_sector * SECTOR_SIZE, buffer,
+                        (size_t) sectors_to_read * SECTOR_SIZE) == 0) {
+            return sectors_to_read;
+        }
+        if (errno != EINVAL) {
+            return -1;
+        }
+        // The filesystem accepted O_DIRECT at open but rejects our alignment: continue buffered
+        int fd = fileno(pdisk->disk);
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) & ~O_DIRECT);
+        __atomic_store_n(&pdisk->direct->disabled, 1, __ATOMIC_RELAXED);
+    }
+    // pread keeps no shared file position, so concurrent readers of one disk do not interfere
+    ssize_t got = pread(fileno(pdisk->disk), buffer, (size_t) sectors_to_read * SECTOR_SIZE,
+                        (off_t) first_sector * SECTOR_SIZE);
+    if (got < 0) {
+        return -1;
+    }
+    return (int) (got / SECTOR_SIZE);
+}
+
+int disk_write(struct disk_t *pdisk, int32_t first_sector, const void *buffer, int32_t sectors_to_write) {
+    if (pdisk == NULL || pdisk->disk == NULL || buffer == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!pdisk->writable) {
+        errno = EROFS;
+        return -1;
+    }
+    if ((int64_t) sectors_to_write + first_sector > pdisk->size / SECTOR_SIZE || first_sector < 0 ||
+        sectors_to_write < 1) {
         errno = ERANGE;
         return -1;
     }
-    fseek(pdisk->disk, first_sector * SECTOR_SIZE, SEEK_SET);
-    return (int) fread(buffer, SECTOR_SIZE, sectors_to_read, pdisk->disk);
+    ssize_t written = pwrite(fileno(pdisk->disk), buffer, (size_t) sectors_to_write * SECTOR_SIZE,
+                             (off_t) first_sector * SECTOR_SIZE);
+    if (written < 0) {
+        return -1;
+    }
+    return (int) (written / SECTOR_SIZE);
 }
 
 int disk_close(struct disk_t *pdisk) {
@@ -84,11 +411,176 @@ int disk_close(struct disk_t *pdisk) {
         errno = EFAULT;
         return -1;
     }
+    compressed_image_close(pdisk->compressed);
+    if (pdisk->direct != NULL) {
+        pthread_mutex_destroy(&pdisk->direct->lock);
+        free(pdisk->direct->pool);
+        free(pdisk->direct);
+    }
     fclose(pdisk->disk);
     free(pdisk);
     return 0;
 }
 
+static uint8_t log2_u32(uint32_t value) {
+    uint8_t shift = 0;
+    while (((uint32_t) 1 << shift) < value) {
+        shift++;
+    }
+    return shift;
+}
+
+// Byte offsets and shifts derived once from the boot sector so hot paths never divide
+static int volume_compute_geometry(struct volume_t *volume, uint32_t first_sector) {
+    const struct boot_sector_fat *super = &volume->super;
+    struct fat_geometry_t *geometry = &volume->geometry;
+    if (super->size_of_fat == 0 || super->maximum_number_of_files == 0) {
+        return -1;
+    }
+    geometry->sector_size = super->bytes_per_sector;
+    geometry->sector_shift = log2_u32(geometry->sector_size);
+    geometry->cluster_size = geometry->sector_size * super->sectors_per_clusters;
+    geometry->cluster_shift = log2_u32(geometry->cluster_size);
+    geometry->cluster_mask = geometry->cluster_size - 1;
+    geometry->fat_size = (uint32_t) super->size_of_fat << geometry->sector_shift;
+
+    uint64_t volume_offset = (uint64_t) first_sector * SECTOR_SIZE;
+    geometry->fat_offset = volume_offset + ((uint64_t) super->size_of_reserved_area << geometry->sector_shift);
+    geometry->root_offset = geometry->fat_offset + (uint64_t) super->number_of_fats * geometry->fat_size;
+    geometry->root_size = (uint32_t) super->maximum_number_of_files * sizeof(struct SFN);
+    uint32_t root_sectors = (geometry->root_size + geometry->sector_size - 1) >> geometry->sector_shift;
+    geometry->data_offset = geometry->root_offset + ((uint64_t) root_sectors << geometry->sector_shift);
+
+    uint64_t total_sectors = super->number_of_sectors ? super->number_of_sectors : super->number_of_sectors_in_filesystem;
+    uint64_t used = geometry->data_offset - volume_offset;
+    uint64_t total = total_sectors << geometry->sector_shift;
+    geometry->cluster_count = total > used ? (uint32_t) ((total - used) >> geometry->cluster_shift) : 0;
+    if (geometry->cluster_count + 2 > geometry->fat_size / 2) {
+        geometry->cluster_count = geometry->fat_size / 2 - 2;
+    }
+    return 0;
+}
+
+int fat_read_clusters(struct volume_t *pvolume, uint16_t first_cluster, uint32_t count, void *buffer) {
+    if (pvolume == NULL || buffer == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (first_cluster < 2 || count == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    const struct fat_geometry_t *geometry = &pvolume->geometry;
+    uint64_t offset = geometry->data_offset + ((uint64_t) (first_cluster - 2) << geometry->cluster_shift);
+    int32_t sectors = (int32_t) (((uint64_t) count << geometry->cluster_shift) / SECTOR_SIZE);
+    if (disk_read(pvolume->disk, (int32_t) (offset / SECTOR_SIZE), buffer, sectors) != sectors) {
+        errno = ERANGE;
+        return -1;
+    }
+    return (int) count;
+}
+
+// Copies length bytes from the current offset; shift is a compile time constant in every kernel below
+static inline __attribute__((always_inline)) size_t
+read_span(struct file_t *stream, uint8_t *out, size_t length, const unsigned shift) {
+    const uint32_t cluster_size = (uint32_t) 1 << shift;
+    const uint32_t mask = cluster_size - 1;
+    struct volume_t *volume = stream->volume;
+    const struct clusters_chain_t *chain = stream->clusters;
+    uint32_t offset = stream->offset;
+    uint8_t *temp = NULL;
+    size_t done = 0;
+    while (done < length) {
+        size_t index = offset >> shift;
+        uint32_t in_cluster = offset & mask;
+        if (index >= chain->size) {
+            errno = ERANGE;
+            break;
+        }
+        if (in_cluster == 0 && length - done >= cluster_size) {
+            // Whole clusters go straight to the caller, one disk read per run of consecutive clusters
+            size_t run = 1;
+            while (index + run < chain->size && chain->clusters[index + run] == chain->clusters[index] + run &&
+                   (run + 1) << shift <= length - done) {
+                run++;
+            }
+            if (fat_read_clusters(volume, chain->clusters[index], (uint32_t) run, out + done) < 0) {
+                break;
+            }
+            done += run << shift;
+            offset += (uint32_t) (run << shift);
+            continue;
+        }
+        if (temp == NULL && (temp = disk_buffer_acquire(volume->disk, cluster_size)) == NULL) {
+            break;
+        }
+        if (fat_read_clusters(volume, chain->clusters[index], 1, temp) < 0) {
+            break;
+        }
+        size_t chunk = cluster_size - in_cluster;
+        if (chunk > length - done) {
+            chunk = length - done;
+        }
+        memcpy(out + done, temp + in_cluster, chunk);
+        done += chunk;
+        offset += (uint32_t) chunk;
+    }
+    disk_buffer_release(volume->disk, temp);
+    return done;
+}
+
+#define DEFINE_READ_KERNEL(shift) \
+    static size_t read_kernel_##shift(struct file_t *stream, uint8_t *out, size_t length) { \
+        return read_span(stream, out, length, shift); \
+    }
+
+DEFINE_READ_KERNEL(9)
+DEFINE_READ_KERNEL(10)
+DEFINE_READ_KERNEL(11)
+DEFINE_READ_KERNEL(12)
+DEFINE_READ_KERNEL(13)
+DEFINE_READ_KERNEL(14)
+DEFINE_READ_KERNEL(15)
+DEFINE_READ_KERNEL(16)
+
+// Indexed by cluster shift: 512 B (9) up to 64 KiB (16) clusters
+static const fat_read_kernel_t read_kernels[17] = {
+        [9] = read_kernel_9, [10] = read_kernel_10, [11] = read_kernel_11, [12] = read_kernel_12,
+        [13] = read_kernel_13, [14] = read_kernel_14, [15] = read_kernel_15, [16] = read_kernel_16
+};
+
+// One copy of the FAT, freshly allocated
+static uint8_t *fat_read_table(struct disk_t *pdisk, const struct fat_geometry_t *geometry, uint32_t copy) {
+    int32_t fat_sectors = (int32_t) (geometry->fat_size / SECTOR_SIZE);
+    uint8_t *fat = malloc(geometry->fat_size);
+    if (fat == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint64_t offset = geometry->fat_offset + (uint64_t) copy * geometry->fat_size;
+    if (disk_read(pdisk, (int32_t) (offset / SECTOR_SIZE), fat, fat_sectors) != fat_sectors) {
+        free(fat);
+        errno = EINVAL;
+        return NULL;
+    }
+    return fat;
+}
+
+// Evicts the FAT of an idle volume; a volume with a writer always holds its FAT
+static size_t fat_reclaim(struct fat_memory_owner_t *owner) {
+    struct volume_t *volume = (struct volume_t *) ((uint8_t *) owner - offsetof(struct volume_t, memory));
+    uint32_t idle = 0;
+    if (!__atomic_compare_exchange_n(&volume->fat_users, &idle, FAT_MEMORY_RECLAIMING, false, __ATOMIC_ACQUIRE,
+                                     __ATOMIC_RELAXED)) {
+        return 0;
+    }
+    uint8_t *fat = volume->fat;
+    __atomic_store_n(&volume->fat, NULL, __ATOMIC_RELAXED);
+    __atomic_store_n(&volume->fat_users, 0, __ATOMIC_RELEASE);
+    free(fat);
+    return fat != NULL ? volume->geometry.fat_size : 0;
+}
+
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
     if (pdisk == NULL || pdisk->disk == NULL) {
         errno = EFAULT;
@@ -116,44 +608,38 @@ struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
         errno = EINVAL;
         return NULL;
     }
-
-    if (volume->super.number_of_fats != 1 && volume->super.number_of_fats != 2) {
+    if (volume->super.bytes_per_sector != 512 && volume->super.bytes_per_sector != 1024 &&
+        volume->super.bytes_per_sector != 2048 && volume->super.bytes_per_sector != 4096) {
         free(volume);
         errno = EINVAL;
         return NULL;
     }
-    uint8_t *fat_1 = malloc(volume->super.size_of_fat * volume->super.bytes_per_sector);
-    if (fat_1 == NULL) {
+    if (volume->super.number_of_fats != 1 && volume->super.number_of_fats != 2) {
         free(volume);
-        errno = ENOMEM;
+        errno = EINVAL;
         return NULL;
     }
-    volume->fat_1_position = volume->super.size_of_reserved_area;
-    if (disk_read(pdisk, volume->fat_1_position, fat_1, volume->super.size_of_fat) != volume->super.size_of_fat) {
+    if (volume_compute_geometry(volume, first_sector) != 0 ||
+        volume->geometry.cluster_size > DISK_BUFFER_SIZE) {
         free(volume);
-        free(fat_1);
         errno = EINVAL;
         return NULL;
     }
+    struct fat_geometry_t *geometry = &volume->geometry;
+    uint8_t *fat_1 = fat_read_table(pdisk, geometry, 0);
+    if (fat_1 == NULL) {
+        free(volume);
+        return NULL;
+    }
     volume->disk = pdisk;
-    volume->root_directory_position = volume->fat_1_position + volume->super.size_of_fat;
     if (volume->super.number_of_fats == 2) {
-        uint8_t *fat_2 = malloc(volume->super.size_of_fat * volume->super.bytes_per_sector);
+        uint8_t *fat_2 = fat_read_table(pdisk, geometry, 1);
         if (fat_2 == NULL) {
-            free(volume);
-            free(fat_1);
-            errno = ENOMEM;
-            return NULL;
-        }
-        if (disk_read(pdisk, volume->fat_1_position + volume->super.size_of_fat, fat_2, volume->super.size_of_fat) !=
-            volume->super.size_of_fat) {
             free(fat_1);
-            free(fat_2);
             free(volume);
-            errno = EINVAL;
             return NULL;
         }
-        if (memcmp(fat_1, fat_2, volume->super.size_of_fat * volume->super.bytes_per_sector) != 0) {
+        if (memcmp(fat_1, fat_2, geometry->fat_size) != 0) {
             free(fat_1);
             free(fat_2);
             free(volume);
@@ -161,12 +647,19 @@ struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector) {
             return NULL;
         }
         free(fat_2);
-        volume->root_directory_position += volume->super.size_of_fat;
     }
     volume->fat = fat_1;
-    volume->data_start = volume->super.size_of_reserved_area + volume->super.number_of_sectors_before_partition +
-                         (volume->super.number_of_fats * volume->super.size_of_fat) +
-                         (volume->super.maximum_number_of_files / 16);
+    volume->fat_1_position = volume->super.size_of_reserved_area;
+    volume->root_directory_position = volume->fat_1_position + volume->super.number_of_fats * volume->super.size_of_fat;
+    volume->data_start = (uint16_t) (geometry->data_offset >> geometry->sector_shift);
+    volume->read_kernel = read_kernels[geometry->cluster_shift];
+    volume->writer = NULL;
+    memset(volume->open_files.buckets, 0, sizeof(volume->open_files.buckets));
+    pthread_mutex_init(&volume->open_files.lock, NULL);
+    volume->fat_users = 0;
+    pthread_mutex_init(&volume->fat_lock, NULL);
+    fat_memory_register(&volume->memory, fat_reclaim);
+    fat_memory_charge(&volume->memory, 0, (ssize_t) geometry->fat_size);
     return volume;
 }
 
@@ -175,89 +668,512 @@ int fat_close(struct volume_t *pvolume) {
         errno = EFAULT;
         return -1;
     }
+    // Pending metadata reaches the disk before the in-memory FAT goes away
+    int result = pvolume->writer != NULL ? fat_writer_close(pvolume) : 0;
+    for (int i = 0; i < FAT_OPEN_TABLE_BUCKETS; i++) {
+        while (pvolume->open_files.buckets[i] != NULL) {
+            struct fat_shared_file_t *shared = pvolume->open_files.buckets[i];
+            pvolume->open_files.buckets[i] = shared->next;
+            free(shared->chain.clusters);
+            free(shared);
+        }
+    }
+    pthread_mutex_destroy(&pvolume->open_files.lock);
+    fat_memory_unregister(&pvolume->memory);
+    pthread_mutex_destroy(&pvolume->fat_lock);
     free(pvolume->fat);
     free(pvolume);
-    return 0;
+    return result;
 }
 
-struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
-    if (pvolume == NULL || file_name == NULL) {
+const uint8_t *fat_acquire(struct volume_t *pvolume) {
+    if (pvolume == NULL) {
         errno = EFAULT;
         return NULL;
     }
-    char *upper_path = malloc(strlen(file_name) + 1);
-    if (upper_path == NULL) {
-        errno = ENOMEM;
-        return NULL;
+    uint32_t users = __atomic_load_n(&pvolume->fat_users, __ATOMIC_RELAXED);
+    do {
+        // An eviction holds the FAT only for as long as it takes to free it
+        while (users & FAT_MEMORY_RECLAIMING) {
+            sched_yield();
+            users = __atomic_load_n(&pvolume->fat_users, __ATOMIC_RELAXED);
+        }
+    } while (!__atomic_compare_exchange_n(&pvolume->fat_users, &users, users + 1, true, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_RELAXED));
+    fat_memory_touch(&pvolume->memory);
+    uint8_t *fat = __atomic_load_n(&pvolume->fat, __ATOMIC_ACQUIRE);
+    if (fat != NULL) {
+        return fat;
     }
-    upper_path[strlen(file_name)] = '\0';
-    int max_dirs = 2;
-    for (int i = 0; file_name[i] != '\0'; i++) {
-        upper_path[i] = (char) toupper(file_name[i]);
-        if (i != 0 && upper_path[i] == '\\') {
-            max_dirs++;
+    pthread_mutex_lock(&pvolume->fat_lock);
+    fat = pvolume->fat;
+    if (fat == NULL) {
+        fat = fat_read_table(pvolume->disk, &pvolume->geometry, 0);
+        if (fat != NULL) {
+            __atomic_store_n(&pvolume->fat, fat, __ATOMIC_RELEASE);
+            fat_memory_reloaded(&pvolume->memory, pvolume->geometry.fat_size);
         }
     }
-    struct file_t *file = malloc(sizeof(struct file_t));
-    if (file == NULL) {
-        errno = ENOMEM;
-        free(upper_path);
-        return NULL;
+    pthread_mutex_unlock(&pvolume->fat_lock);
+    if (fat == NULL) {
+        int error = errno;
+        fat_release(pvolume);
+        errno = error;
     }
-    uint8_t *boot_record = malloc(sizeof(struct SFN) * pvolume->super.maximum_number_of_files);
-    if (boot_record == NULL) {
-        free(file);
-        free(upper_path);
-        errno = ENOMEM;
+    return fat;
+}
+
+void fat_release(struct volume_t *pvolume) {
+    if (pvolume != NULL) {
+        __atomic_sub_fetch(&pvolume->fat_users, 1, __ATOMIC_RELEASE);
+    }
+}
+
+// Loads every entry of a directory, including changes not yet flushed by fat_sync; cluster 0 is the root directory
+struct SFN *fat_load_directory(struct volume_t *pvolume, uint16_t first_cluster, uint32_t *entry_count) {
+    const struct fat_geometry_t *geometry = &pvolume->geometry;
+    if (first_cluster == 0) {
+        int32_t sectors = (int32_t) ((geometry->root_size + SECTOR_SIZE - 1) / SECTOR_SIZE);
+        struct SFN *entries = malloc((size_t) sectors * SECTOR_SIZE);
+        if (entries == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        if (disk_read(pvolume->disk, (int32_t) (geometry->root_offset / SECTOR_SIZE), entries, sectors) != sectors) {
+            free(entries);
+            errno = ERANGE;
+            return NULL;
+        }
+        if (pvolume->writer != NULL) {
+            fat_writer_overlay(pvolume, geometry->root_offset, entries, geometry->root_size);
+        }
+        *entry_count = pvolume->super.maximum_number_of_files;
+        return entries;
+    }
+    const uint8_t *fat = fat_acquire(pvolume);
+    if (fat == NULL) {
         return NULL;
     }
-    if (disk_read(pvolume->disk, pvolume->root_directory_position, boot_record,
-                  (int32_t) sizeof(struct SFN) * pvolume->super.maximum_number_of_files /
-                  pvolume->super.bytes_per_sector) !=
-        (int) (sizeof(struct SFN) * pvolume->super.maximum_number_of_files / pvolume->super.bytes_per_sector)) {
-        free(file);
-        free(boot_record);
-        free(upper_path);
-        // errno ?????
+    struct clusters_chain_t *clustersChain = get_chain_fat16(fat, geometry->fat_size, first_cluster);
+    fat_release(pvolume);
+    if (clustersChain == NULL) {
+        errno = EINVAL;
         return NULL;
     }
-    file->volume = pvolume;
-    file->offset = 0;
-    file->entry = NULL;
-    struct SFN **dirs = malloc(sizeof(struct SFN *) * max_dirs);
-    if (dirs == NULL) {
-        free(file);
-        free(boot_record);
-        free(upper_path);
+    uint8_t *entries = malloc(clustersChain->size << geometry->cluster_shift);
+    if (entries == NULL) {
+        free(clustersChain->clusters);
+        free(clustersChain);
         errno = ENOMEM;
         return NULL;
     }
-    int path_index = upper_path[0] == '\\' ? 1 : 0;
-    int current_dir_index = 0;
-    *dirs = (struct SFN *) boot_record;
-    char *expected_upper_name = NULL;
-    for (int i = 0; i < max_dirs - 1; i++) {
-        int temp = 0;
-        for (; upper_path[path_index] != '\0'; path_index++) {
-            expected_upper_name = realloc(expected_upper_name, temp + 2);
-            if (upper_path[path_index] == '\\') {
-                path_index++;
-                break;
-            }
-            expected_upper_name[temp] = upper_path[path_index];
-            expected_upper_name[temp + 1] = '\0';
-            temp++;
+    for (size_t k = 0; k < clustersChain->size;) {
+        size_t run = 1;
+        while (k + run < clustersChain->size && clustersChain->clusters[k + run] == clustersChain->clusters[k] + run) {
+            run++;
         }
-        if (strcmp(expected_upper_name, ".") == 0) {
-            continue;
-        } else if (strcmp(expected_upper_name, "..") == 0) {
-            if (current_dir_index == 0) {
-                errno = ENOENT;
-                free(file);
-                free(upper_path);
-                free(expected_upper_name);
-                for (int a = 0; a <= current_dir_index; a++) {
-                    free(dirs[a]);
+        if (fat_read_clusters(pvolume, clustersChain->clusters[k], (uint32_t) run,
+                              entries + (k << geometry->cluster_shift)) < 0) {
+            free(entries);
+            free(clustersChain->clusters);
+            free(clustersChain);
+            return NULL;
+        }
+        if (pvolume->writer != NULL) {
+            uint64_t offset = geometry->data_offset +
+                              ((uint64_t) (clustersChain->clusters[k] - 2) << geometry->cluster_shift);
+            fat_writer_overlay(pvolume, offset, entries + (k << geometry->cluster_shift), run << geometry->cluster_shift);
+        }
+        k += run;
+    }
+    *entry_count = (uint32_t) ((clustersChain->size << geometry->cluster_shift) / sizeof(struct SFN));
+    free(clustersChain->clusters);
+    free(clustersChain);
+    return (struct SFN *) entries;
+}
+
+static struct fat_shared_file_t *open_table_find(struct fat_open_table_t *table, const struct SFN *entry) {
+    uint32_t bucket = entry->low_order_address_of_first_cluster % FAT_OPEN_TABLE_BUCKETS;
+    for (struct fat_shared_file_t *shared = table->buckets[bucket]; shared != NULL; shared = shared->next) {
+        if (memcmp(&shared->entry, entry, sizeof(struct SFN)) == 0) {
+            shared->references++;
+            return shared;
+        }
+    }
+    return NULL;
+}
+
+// Accounted to the volume from the first open of a file to its last close
+static size_t shared_file_size(const struct fat_shared_file_t *shared) {
+    return sizeof(struct fat_shared_file_t) + shared->chain.size * sizeof(uint16_t);
+}
+
+// Points file at the shared chain and entry of its directory entry, building them if nobody has the file open
+static int file_share(struct file_t *file, const struct SFN *entry) {
+    struct fat_open_table_t *table = &file->volume->open_files;
+    pthread_mutex_lock(&table->lock);
+    struct fat_shared_file_t *shared = open_table_find(table, entry);
+    pthread_mutex_unlock(&table->lock);
+
+    if (shared == NULL) {
+        struct fat_shared_file_t *created = calloc(1, sizeof(struct fat_shared_file_t));
+        if (created == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(&created->entry, entry, sizeof(struct SFN));
+        created->references = 1;
+        // An empty file has no chain; built outside the lock, so a slow FAT walk does not stall other opens
+        if (entry->low_order_address_of_first_cluster != 0) {
+            const uint8_t *fat = fat_acquire(file->volume);
+            if (fat == NULL) {
+                free(created);
+                return -1;
+            }
+            struct clusters_chain_t *chain = get_chain_fat16(fat, file->volume->geometry.fat_size,
+                                                             entry->low_order_address_of_first_cluster);
+            fat_release(file->volume);
+            if (chain == NULL) {
+                free(created);
+                errno = EINVAL;
+                return -1;
+            }
+            created->chain = *chain;
+            free(chain);
+        }
+        pthread_mutex_lock(&table->lock);
+        shared = open_table_find(table, entry);
+        if (shared == NULL) {
+            uint32_t bucket = entry->low_order_address_of_first_cluster % FAT_OPEN_TABLE_BUCKETS;
+            created->next = table->buckets[bucket];
+            table->buckets[bucket] = created;
+            shared = created;
+            created = NULL;
+        }
+        pthread_mutex_unlock(&table->lock);
+        if (created != NULL) {
+            free(created->chain.clusters);
+            free(created);
+        } else {
+            fat_memory_charge(&file->volume->memory, (ssize_t) shared_file_size(shared), 0);
+        }
+    }
+    file->shared = shared;
+    file->entry = &shared->entry;
+    file->clusters = &shared->chain;
+    return 0;
+}
+
+static void file_unshare(struct file_t *file) {
+    struct fat_shared_file_t *shared = file->shared;
+    struct fat_open_table_t *table = &file->volume->open_files;
+    pthread_mutex_lock(&table->lock);
+    if (--shared->references > 0) {
+        pthread_mutex_unlock(&table->lock);
+        return;
+    }
+    uint32_t bucket = shared->entry.low_order_address_of_first_cluster % FAT_OPEN_TABLE_BUCKETS;
+    struct fat_shared_file_t **link = table->buckets + bucket;
+    while (*link != shared) {
+        link = &(*link)->next;
+    }
+    *link = shared->next;
+    pthread_mutex_unlock(&table->lock);
+    fat_memory_charge(&file->volume->memory, -(ssize_t) shared_file_size(shared), 0);
+    free(shared->chain.clusters);
+    free(shared);
+}
+
+#define FAT_FOLD_LIMIT 0x0500 //Code points below fold through fold_table, the others compare as they are
+
+static uint16_t fold_table[FAT_FOLD_LIMIT];
+static pthread_once_t fold_once = PTHREAD_ONCE_INIT;
+
+// Simple case folding (to lower case) of Latin-1, Latin Extended-A, Greek and Cyrillic
+static void fold_init(void) {
+    for (uint32_t c = 0; c < FAT_FOLD_LIMIT; c++) {
+        fold_table[c] = (uint16_t) c;
+    }
+    for (uint32_t c = 'A'; c <= 'Z'; c++) {
+        fold_table[c] = (uint16_t) (c + 0x20);
+    }
+    for (uint32_t c = 0xC0; c <= 0xDE; c++) {
+        if (c != 0xD7) {
+            fold_table[c] = (uint16_t) (c + 0x20);
+        }
+    }
+    // Latin Extended-A pairs the upper case letter with the code point after it; U+0130 has no simple folding
+    for (uint32_t c = 0x100; c < 0x138; c += 2) {
+        if (c != 0x130) {
+            fold_table[c] = (uint16_t) (c + 1);
+        }
+    }
+    for (uint32_t c = 0x139; c < 0x149; c += 2) {
+        fold_table[c] = (uint16_t) (c + 1);
+    }
+    for (uint32_t c = 0x14A; c < 0x178; c += 2) {
+        fold_table[c] = (uint16_t) (c + 1);
+    }
+    fold_table[0x178] = 0xFF;
+    for (uint32_t c = 0x179; c < 0x17F; c += 2) {
+        fold_table[c] = (uint16_t) (c + 1);
+    }
+    fold_table[0x386] = 0x3AC;
+    for (uint32_t c = 0x388; c <= 0x38A; c++) {
+        fold_table[c] = (uint16_t) (c + 0x25);
+    }
+    fold_table[0x38C] = 0x3CC;
+    fold_table[0x38E] = 0x3CD;
+    fold_table[0x38F] = 0x3CE;
+    for (uint32_t c = 0x391; c <= 0x3A9; c++) {
+        if (c != 0x3A2) {
+            fold_table[c] = (uint16_t) (c + 0x20);
+        }
+    }
+    fold_table[0x3C2] = 0x3C3;
+    for (uint32_t c = 0x400; c < 0x410; c++) {
+        fold_table[c] = (uint16_t) (c + 0x50);
+    }
+    for (uint32_t c = 0x410; c < 0x430; c++) {
+        fold_table[c] = (uint16_t) (c + 0x20);
+    }
+    for (uint32_t c = 0x460; c < 0x482; c += 2) {
+        fold_table[c] = (uint16_t) (c + 1);
+    }
+    for (uint32_t c = 0x48A; c < 0x4C0; c += 2) {
+        fold_table[c] = (uint16_t) (c + 1);
+    }
+    fold_table[0x4C0] = 0x4CF;
+    for (uint32_t c = 0x4C1; c < 0x4CF; c += 2) {
+        fold_table[c] = (uint16_t) (c + 1);
+    }
+    for (uint32_t c = 0x4D0; c < 0x500; c += 2) {
+        fold_table[c] = (uint16_t) (c + 1);
+    }
+}
+
+// Next code point of a UTF-8 string; malformed bytes come back one at a time above U+10FFFF so they stay distinct
+static uint32_t utf8_next(const uint8_t **text) {
+    const uint8_t *p = *text;
+    uint32_t c = p[0];
+    int extra = c >= 0xF0 && c < 0xF5 ? 3 : c >= 0xE0 && c < 0xF0 ? 2 : c >= 0xC2 && c < 0xE0 ? 1 : 0;
+    if (c < 0x80 || extra == 0) {
+        *text = p + 1;
+        return c < 0x80 ? c : 0x110000 + c;
+    }
+    c &= 0x3F >> extra;
+    for (int i = 1; i <= extra; i++) {
+        if ((p[i] & 0xC0) != 0x80) {
+            *text = p + 1;
+            return 0x110000 + p[0];
+        }
+        c = c << 6 | (p[i] & 0x3F);
+    }
+    *text = p + 1 + extra;
+    return c;
+}
+
+static size_t utf8_put(char *out, uint32_t c) {
+    if (c < 0x80) {
+        out[0] = (char) c;
+        return 1;
+    }
+    if (c < 0x800) {
+        out[0] = (char) (0xC0 | c >> 6);
+        out[1] = (char) (0x80 | (c & 0x3F));
+        return 2;
+    }
+    if (c < 0x10000) {
+        out[0] = (char) (0xE0 | c >> 12);
+        out[1] = (char) (0x80 | (c >> 6 & 0x3F));
+        out[2] = (char) (0x80 | (c & 0x3F));
+        return 3;
+    }
+    out[0] = (char) (0xF0 | c >> 18);
+    out[1] = (char) (0x80 | (c >> 12 & 0x3F));
+    out[2] = (char) (0x80 | (c >> 6 & 0x3F));
+    out[3] = (char) (0x80 | (c & 0x3F));
+    return 4;
+}
+
+int fat_name_compare(const char *a, const char *b) {
+    if (a == NULL || b == NULL) {
+        return a == b ? 0 : (a == NULL ? -1 : 1);
+    }
+    pthread_once(&fold_once, fold_init);
+    const uint8_t *x = (const uint8_t *) a;
+    const uint8_t *y = (const uint8_t *) b;
+    while (1) {
+        uint32_t cx = utf8_next(&x);
+        uint32_t cy = utf8_next(&y);
+        cx = cx < FAT_FOLD_LIMIT ? fold_table[cx] : cx;
+        cy = cy < FAT_FOLD_LIMIT ? fold_table[cy] : cy;
+        if (cx != cy) {
+            return cx < cy ? -1 : 1;
+        }
+        if (cx == 0) {
+            return 0;
+        }
+    }
+}
+
+// Unpaired surrogates become U+FFFD; out must hold 3 bytes per unit
+static size_t utf16_to_utf8(const uint16_t *units, size_t count, char *out) {
+    size_t i = 0;
+    size_t length = 0;
+    while (i < count) {
+#if defined(__SSE2__)
+        // ASCII runs: eight units narrowed and stored at once
+        const __m128i high_bits = _mm_set1_epi16((short) 0xFF80);
+        while (i + 8 <= count) {
+            __m128i block = _mm_loadu_si128((const __m128i *) (units + i));
+            __m128i ascii = _mm_cmpeq_epi16(_mm_and_si128(block, high_bits), _mm_setzero_si128());
+            if (_mm_movemask_epi8(ascii) != 0xFFFF) {
+                break;
+            }
+            _mm_storel_epi64((__m128i *) (out + length), _mm_packus_epi16(block, block));
+            i += 8;
+            length += 8;
+        }
+#endif
+        // Up to the end of the block that was not all ASCII, one code point at a time
+        size_t block_end = i + 8 < count ? i + 8 : count;
+        while (i < block_end) {
+            uint32_t c = units[i++];
+            if (c >= 0xD800 && c < 0xDC00 && i < count && units[i] >= 0xDC00 && units[i] < 0xE000) {
+                c = 0x10000 + ((c - 0xD800) << 10) + (uint32_t) (units[i++] - 0xDC00);
+            } else if (c >= 0xD800 && c < 0xE000) {
+                c = 0xFFFD;
+            }
+            length += utf8_put(out + length, c);
+        }
+    }
+    return length;
+}
+
+uint8_t fat_lfn_checksum(const struct SFN *entry) {
+    uint8_t sum = 0;
+    for (int i = 0; i < 11; i++) {
+        sum = (uint8_t) (((sum & 1) << 7) + (sum >> 1) + (uint8_t) entry->filename[i]);
+    }
+    return sum;
+}
+
+// UTF-8 long name of the LFN sequence before entries[index], or -1 when the sequence is broken, belongs to another
+// SFN or would start before entries
+static int lfn_decode(const struct SFN *entries, uint32_t index, char *name) {
+    uint16_t units[LFN_MAX_ENTRIES * 13];
+    const struct SFN *entry = entries + index;
+    uint8_t checksum = fat_lfn_checksum(entry);
+    size_t count = 0;
+    for (uint32_t k = 1; k <= LFN_MAX_ENTRIES && k <= index; k++) {
+        const struct LFN *lfn = (const struct LFN *) (entry - k);
+        if (lfn->file_attributes != FAT_ATTR_LONG_NAME || (lfn->sequence_number & 0x1F) != k ||
+            lfn->checksum != checksum) {
+            return -1;
+        }
+        memcpy(units + count, lfn->filename1, sizeof(lfn->filename1));
+        memcpy(units + count + 5, lfn->filename2, sizeof(lfn->filename2));
+        memcpy(units + count + 11, lfn->filename3, sizeof(lfn->filename3));
+        count += 13;
+        if (lfn->sequence_number & 0x40) {
+            // The name ends at a 0x0000 unit unless it fills the last entry; 0xFFFF pads the rest
+            size_t end = count - 13;
+            while (end < count && units[end] != 0x0000) {
+                end++;
+            }
+            if (end == 0) {
+                return -1;
+            }
+            size_t length = utf16_to_utf8(units, end, name);
+            name[length] = '\0';
+            return (int) length;
+        }
+    }
+    return -1;
+}
+
+// Long name (when the LFN sequence before entries[index] is valid) or short name of entries[index] equals name,
+// case folded
+static bool entry_name_equal(const struct SFN *entries, uint32_t index, int is_lfn, const char *name) {
+    char entry_name[LFN_MAX_NAME_LENGTH + 1];
+    fat_short_name(entries + index, entry_name);
+    if (fat_name_compare(entry_name, name) == 0) {
+        return true;
+    }
+    return is_lfn && lfn_decode(entries, index, entry_name) >= 0 && fat_name_compare(entry_name, name) == 0;
+}
+
+static struct file_t *file_open_untraced(struct volume_t *pvolume, const char *file_name) {
+    if (pvolume == NULL || file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    // Components are compared case folded by entry_name_equal, so the path is used as given
+    int max_dirs = 2;
+    for (int i = 0; file_name[i] != '\0'; i++) {
+        if (i != 0 && file_name[i] == '\\') {
+            max_dirs++;
+        }
+    }
+    struct file_t *file = malloc(sizeof(struct file_t));
+    if (file == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    uint32_t root_entries;
+    struct SFN *boot_record = fat_load_directory(pvolume, 0, &root_entries);
+    if (boot_record == NULL) {
+        free(file);
+        return NULL;
+    }
+    file->volume = pvolume;
+    file->offset = 0;
+    file->entry = NULL;
+    file->shared = NULL;
+    file->writable = false;
+    struct SFN **dirs = malloc(sizeof(struct SFN *) * max_dirs);
+    if (dirs == NULL) {
+        free(file);
+        free(boot_record);
+        errno = ENOMEM;
+        return NULL;
+    }
+    int path_index = file_name[0] == '\\' ? 1 : 0;
+    int current_dir_index = 0;
+    *dirs = boot_record;
+    uint32_t dir_sizes[max_dirs];
+    dir_sizes[0] = root_entries;
+    char *expected_name = NULL;
+    for (int i = 0; i < max_dirs - 1; i++) {
+        int temp = 0;
+        for (; file_name[path_index] != '\0'; path_index++) {
+            expected_name = realloc(expected_name, temp + 2);
+            if (file_name[path_index] == '\\') {
+                path_index++;
+                break;
+            }
+            expected_name[temp] = file_name[path_index];
+            expected_name[temp + 1] = '\0';
+            temp++;
+        }
+        if (expected_name == NULL) {
+            // Nothing but separators, which names the root directory
+            errno = EISDIR;
+            free(file);
+            free(dirs[0]);
+            free(dirs);
+            return NULL;
+        }
+        if (strcmp(expected_name, ".") == 0) {
+            continue;
+        } else if (strcmp(expected_name, "..") == 0) {
+            if (current_dir_index == 0) {
+                errno = ENOENT;
+                free(file);
+                free(expected_name);
+                for (int a = 0; a <= current_dir_index; a++) {
+                    free(dirs[a]);
                 }
                 free(dirs);
                 return NULL;
@@ -268,87 +1184,26 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
         } else {
             int found = 0;
             int is_lfn = 0;
-            for (int j = 0;; j++) {
-                char *name = calloc(1, 13);
-                temp = 0;
-                if (dirs[current_dir_index][j].file_attributes == 0x0F) {
-                    is_lfn = 1;
-                    free(name);
-                    continue;
-                }
-                if (dirs[current_dir_index][j].filename[0] == 0x00) {
-                    free(name);
+            for (int j = 0; j < (int) dir_sizes[current_dir_index]; j++) {
+                struct SFN *curr = dirs[current_dir_index] + j;
+                if (curr->filename[0] == 0x00) {
                     break;
                 }
-                if (!is_lfn) {
-                    struct SFN *curr = dirs[current_dir_index] + j;
-                    for (int k = 0; k < 8; k++) {
-                        char letter = curr->filename[k];
-                        if (isprint(letter) && letter != ' ') {
-                            name[temp] = letter;
-                            temp++;
-                        }
-                    }
-                    for (int k = 8; k < 11; k++) {
-                        char letter = dirs[current_dir_index][j].filename[k];
-                        if (isprint(letter) && letter != ' ') {
-                            if (k == 8) {
-                                name[temp] = '.';
-                                temp++;
-                            }
-                            name[temp] = letter;
-                            temp++;
-                        }
-                    }
-                } else {
-                    for (int k = 1;; k++) {
-                        struct SFN *mainn = dirs[current_dir_index] + j;
-                        char p = mainn->filename[0];
-                        if (p == '\0') {
-                            break;
-                        }
-                        struct LFN *curr = (struct LFN *) (dirs[current_dir_index] + (j - k));
-                        for (int l = 0; l < 10; l++) {
-                            char letter = ((struct LFN *) (curr))->filename1[l];
-                            if (isprint(letter)) {
-                                name = realloc(name, temp + 2);
-                                name[temp] = toupper(letter);
-                                name[temp + 1] = '\0';
-                                temp++;
-                            }
-                        }
-                        for (int l = 0; l < 12; l++) {
-                            char letter = ((struct LFN *) (dirs[current_dir_index] + (j - k)))->filename2[l];
-                            if (isprint(letter)) {
-                                name = realloc(name, temp + 2);
-                                name[temp] = toupper(letter);
-                                name[temp + 1] = '\0';
-                                temp++;
-                            }
-                        }
-                        for (int l = 0; l < 4; l++) {
-                            char letter = ((struct LFN *) (dirs[current_dir_index] + (j - k)))->filename3[l];
-                            if (isprint(letter)) {
-                                name = realloc(name, temp + 2);
-                                name[temp] = toupper(letter);
-                                name[temp + 1] = '\0';
-                                temp++;
-                            }
-                        }
-                        if (((struct LFN *) (dirs[current_dir_index] + (j - k)))->sequence_number >= 0x40) {
-                            is_lfn = 0;
-                            break;
-                        }
-                    }
-
+                if (curr->filename[0] == (char) 0xE5) {
+                    is_lfn = 0;
+                    continue;
                 }
-                if (strcmp(expected_upper_name, name) == 0) {
+                if (curr->file_attributes == FAT_ATTR_LONG_NAME) {
+                    is_lfn = 1;
+                    continue;
+                }
+                bool matches = entry_name_equal(dirs[current_dir_index], (uint32_t) j, is_lfn, expected_name);
+                is_lfn = 0;
+                if (matches) {
                     if (dirs[current_dir_index][j].file_attributes & 0x08) {
                         errno = ENOTDIR;
                         free(file);
-                        free(upper_path);
-                        free(name);
-                        free(expected_upper_name);
+                        free(expected_name);
                         for (int a = 0; a <= current_dir_index; a++) {
                             free(dirs[a]);
                         }
@@ -357,20 +1212,20 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
                     } else if ((dirs[current_dir_index][j].file_attributes & 0x10) == 0) {
                         if (i == max_dirs - 2) {
                             found = 1;
-                            file->clusters = get_chain_fat16(pvolume->fat, pvolume->super.size_of_fat *
-                                                                           pvolume->super.bytes_per_sector,
-                                                             dirs[current_dir_index][j].low_order_address_of_first_cluster);
-                            file->entry = malloc(sizeof(struct SFN));
-                            memcpy(file->entry, dirs[current_dir_index] + j, sizeof(struct SFN));
-                            is_lfn = 0;
-                            free(name);
+                            if (file_share(file, dirs[current_dir_index] + j) != 0) {
+                                free(file);
+                                free(expected_name);
+                                for (int a = 0; a <= current_dir_index; a++) {
+                                    free(dirs[a]);
+                                }
+                                free(dirs);
+                                return NULL;
+                            }
                             break;
                         } else {
                             errno = ENOTDIR;
                             free(file);
-                            free(upper_path);
-                            free(name);
-                            free(expected_upper_name);
+                            free(expected_name);
                             for (int a = 0; a <= current_dir_index; a++) {
                                 free(dirs[a]);
                             }
@@ -379,65 +1234,27 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
                         }
                     } else {
                         found = 1;
-                        struct clusters_chain_t *clustersChain = get_chain_fat16(pvolume->fat,
-                                                                                 pvolume->super.size_of_fat *
-                                                                                 pvolume->super.bytes_per_sector,
-                                                                                 dirs[current_dir_index][j].low_order_address_of_first_cluster);
-                        dirs[current_dir_index + 1] = malloc(
-                                clustersChain->size * SECTOR_SIZE * pvolume->super.sectors_per_clusters);
+                        dirs[current_dir_index + 1] = fat_load_directory(
+                                pvolume, dirs[current_dir_index][j].low_order_address_of_first_cluster,
+                                dir_sizes + current_dir_index + 1);
                         if (dirs[current_dir_index + 1] == NULL) {
-                            errno = ENOMEM;
                             free(file);
-                            free(name);
-                            free(upper_path);
-                            free(expected_upper_name);
-                            free(clustersChain->clusters);
-                            free(clustersChain);
+                            free(expected_name);
                             for (int a = 0; a <= current_dir_index; a++) {
                                 free(dirs[a]);
                             }
                             free(dirs);
                             return NULL;
                         }
-                        uint32_t read = 0;
-                        uint8_t *buff = malloc(SECTOR_SIZE * pvolume->super.sectors_per_clusters);
-                        for (size_t k = 0; k < clustersChain->size; k++) {
-                            if (disk_read(pvolume->disk, pvolume->data_start + pvolume->super.sectors_per_clusters *
-                                                                               (clustersChain->clusters[k] - 2), buff,
-                                          pvolume->super.sectors_per_clusters) != pvolume->super.sectors_per_clusters) {
-                                errno = ERANGE;
-                                free(file);
-                                free(name);
-                                free(expected_upper_name);
-                                free(clustersChain->clusters);
-                                free(clustersChain);
-                                free(upper_path);
-                                for (int a = 0; a <= current_dir_index; a++) {
-                                    free(dirs[a]);
-                                }
-                                free(dirs);
-                                return NULL;
-                            }
-                            memcpy((uint8_t *) (dirs[current_dir_index + 1]) + read, buff,
-                                   pvolume->super.sectors_per_clusters * SECTOR_SIZE);
-                            read += pvolume->super.sectors_per_clusters * SECTOR_SIZE;
-                        }
-                        free(buff);
-                        free(clustersChain->clusters);
-                        free(clustersChain);
                         current_dir_index++;
-                        is_lfn = 0;
-                        free(name);
                         break;
                     }
                 }
-                free(name);
             }
             if (!found) {
                 errno = ENOENT;
                 free(file);
-                free(expected_upper_name);
-                free(upper_path);
+                free(expected_name);
                 for (int a = 0; a <= current_dir_index; a++) {
                     free(dirs[a]);
                 }
@@ -450,8 +1267,7 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
     for (int i = 0; i <= current_dir_index; i++) {
         free(dirs[i]);
     }
-    free(upper_path);
-    free(expected_upper_name);
+    free(expected_name);
     free(dirs);
     if (file->entry == NULL) {
         errno = EISDIR;
@@ -461,19 +1277,66 @@ struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
     return file;
 }
 
-int file_close(struct file_t *stream) {
+fat_trace_hook_t fat_trace_hook;
+
+static uint64_t trace_clock(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + (uint64_t) now.tv_nsec;
+}
+
+// Completes event with the outcome of the traced call and hands it to hook, leaving errno as the call set it
+static void trace_end(fat_trace_hook_t hook, struct fat_trace_event_t *event, int64_t result) {
+    int error = errno;
+    event->end = trace_clock();
+    event->result = result < 0 ? -error : result;
+    hook(event);
+    errno = error;
+}
+
+struct file_t *file_open(struct volume_t *pvolume, const char *file_name) {
+    fat_trace_hook_t hook = __atomic_load_n(&fat_trace_hook, __ATOMIC_ACQUIRE);
+    if (hook == NULL) {
+        return file_open_untraced(pvolume, file_name);
+    }
+    struct fat_trace_event_t event = {.op = FAT_TRACE_FILE_OPEN, .path = file_name, .start = trace_clock()};
+    struct file_t *file = file_open_untraced(pvolume, file_name);
+    event.handle = file;
+    trace_end(hook, &event, file != NULL ? 0 : -1);
+    return file;
+}
+
+// Everything file_close does but freeing the handle, whose address must stay unused until the close is traced
+static int file_release(struct file_t *stream) {
     if (stream == NULL) {
         errno = EFAULT;
         return -1;
     }
-    free(stream->entry);
-    free(stream->clusters->clusters);
-    free(stream->clusters);
-    free(stream);
+    if (stream->shared != NULL) {
+        file_unshare(stream);
+    } else {
+        free(stream->entry);
+        free(stream->clusters->clusters);
+        free(stream->clusters);
+    }
     return 0;
 }
 
-int32_t file_seek(struct file_t *stream, int32_t offset, int whence) {
+int file_close(struct file_t *stream) {
+    fat_trace_hook_t hook = __atomic_load_n(&fat_trace_hook, __ATOMIC_ACQUIRE);
+    if (hook == NULL) {
+        int result = file_release(stream);
+        free(stream);
+        return result;
+    }
+    struct fat_trace_event_t event = {.op = FAT_TRACE_FILE_CLOSE, .handle = stream, .start = trace_clock()};
+    int result = file_release(stream);
+    trace_end(hook, &event, result);
+    free(stream);
+    return result;
+}
+
+static int32_t file_seek_untraced(struct file_t *stream, int32_t offset, int whence) {
     if (stream == NULL) {
         errno = EFAULT;
         return -1;
@@ -505,173 +1368,126 @@ int32_t file_seek(struct file_t *stream, int32_t offset, int whence) {
     return -1;
 }
 
-size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+int32_t file_seek(struct file_t *stream, int32_t offset, int whence) {
+    fat_trace_hook_t hook = __atomic_load_n(&fat_trace_hook, __ATOMIC_ACQUIRE);
+    if (hook == NULL) {
+        return file_seek_untraced(stream, offset, whence);
+    }
+    struct fat_trace_event_t event = {.op = FAT_TRACE_FILE_SEEK, .handle = stream, .offset = offset, .whence = whence,
+                                      .start = trace_clock()};
+    int32_t result = file_seek_untraced(stream, offset, whence);
+    trace_end(hook, &event, result);
+    return result;
+}
+
+static size_t file_read_untraced(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
     if (ptr == NULL || stream == NULL) {
         errno = EFAULT;
         return -1;
     }
-    if (stream->offset >= stream->entry->size) {
+    if (stream->offset >= stream->entry->size || size == 0) {
         // errno = ?????
         return 0;
     }
-    size_t read = 0;
-    uint8_t *result = ptr;
-    uint8_t *temp = malloc(stream->volume->super.sectors_per_clusters * SECTOR_SIZE);
-    if (temp == NULL) {
-        errno = ENOMEM;
-        return 0;
+    size_t length = size * nmemb;
+    if (length > stream->entry->size - stream->offset) {
+        length = stream->entry->size - stream->offset;
     }
-    if (stream->offset % (SECTOR_SIZE * stream->volume->super.sectors_per_clusters) != 0) {
-        if (disk_read(stream->volume->disk, stream->volume->data_start + stream->volume->super.sectors_per_clusters *
-                                                                         (stream->clusters->clusters[(int) (
-                                                                                 stream->offset / (SECTOR_SIZE *
-                                                                                                   stream->volume->super.sectors_per_clusters))] -
-                                                                          2), temp,
-                      stream->volume->super.sectors_per_clusters) == 0) {
-            errno = ERANGE;
-            free(temp);
-            return 0;
-        }
-        uint16_t to_read = (SECTOR_SIZE * stream->volume->super.sectors_per_clusters) -
-                           stream->offset % (SECTOR_SIZE * stream->volume->super.sectors_per_clusters);
-        if (to_read > size * nmemb) {
-            for (int j = 0;; j++) {
-                if (read == size * nmemb) {
-                    free(temp);
-                    stream->offset += nmemb * size;
-                    return nmemb;
-                } else if (stream->offset + read == stream->entry->size) {
-                    free(temp);
-                    stream->offset += (size_t) (read / size) * size;
-                    return (size_t) (read / size);
-                }
-                memcpy(result + read,
-                       temp + j + (stream->offset % (SECTOR_SIZE * stream->volume->super.sectors_per_clusters)), 1);
-                read++;
-            }
-        } else {
-            memcpy(result, temp + stream->offset % (SECTOR_SIZE * stream->volume->super.sectors_per_clusters), to_read);
-            read += to_read;
-        }
+    size_t read = stream->volume->read_kernel(stream, ptr, length);
+    stream->offset += (uint32_t) (read / size * size);
+    return read / size;
+}
+
+size_t file_read(void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+    fat_trace_hook_t hook = __atomic_load_n(&fat_trace_hook, __ATOMIC_ACQUIRE);
+    if (hook == NULL) {
+        return file_read_untraced(ptr, size, nmemb, stream);
     }
-    for (int i = (int) ((stream->offset + read) / (SECTOR_SIZE * stream->volume->super.sectors_per_clusters));; i++) {
-        if (read == size * nmemb || stream->offset + read > stream->entry->size) {
-            break;
-        }
-        if (disk_read(stream->volume->disk, stream->volume->data_start + stream->volume->super.sectors_per_clusters *
-                                                                         (stream->clusters->clusters[i] - 2), temp,
-                      stream->volume->super.sectors_per_clusters) == 0) {
-            errno = ERANGE;
-            free(temp);
-            return 0;
-        }
-        if (read + (SECTOR_SIZE * stream->volume->super.sectors_per_clusters) > size * nmemb ||
-            read + (SECTOR_SIZE * stream->volume->super.sectors_per_clusters) > stream->entry->size) {
-            for (int j = 0;; j++) {
-                if (read == size * nmemb) {
-                    free(temp);
-                    stream->offset += nmemb * size;
-                    return nmemb;
-                } else if (stream->offset + read == stream->entry->size) {
-                    free(temp);
-                    stream->offset += (size_t) (read / size) * size;
-                    return (size_t) (read / size);
-                }
-                memcpy(result + read, temp + j, 1);
-                read++;
-            }
-        } else {
-            memcpy(result + read, temp, SECTOR_SIZE * stream->volume->super.sectors_per_clusters);
-            read += SECTOR_SIZE * stream->volume->super.sectors_per_clusters;
-        }
+    struct fat_trace_event_t event = {.op = FAT_TRACE_FILE_READ, .handle = stream, .size = size, .count = nmemb,
+                                      .start = trace_clock()};
+    if (stream != NULL) {
+        event.offset = stream->offset;
     }
-    free(temp);
-    stream->offset += (size_t) (read / size) * size;
-    return (size_t) (read / size);
+    size_t read = file_read_untraced(ptr, size, nmemb, stream);
+    trace_end(hook, &event, (int64_t) read);
+    return read;
 }
 
-struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
+// Entries and long names a handle keeps until dir_close, accounted to its volume
+static size_t dir_size(const struct dir_t *pdir) {
+    return pdir->entry_count * sizeof(struct SFN) + pdir->lfn_size;
+}
+
+static struct dir_t *dir_open_untraced(struct volume_t *pvolume, const char *dir_path) {
     if (pvolume == NULL || dir_path == NULL) {
         errno = EFAULT;
         return NULL;
     }
-    char *upper_dir_path = malloc(strlen(dir_path) + 1);
-    if (upper_dir_path == NULL) {
-        errno = ENOMEM;
-        return NULL;
-    }
-    upper_dir_path[strlen(dir_path)] = '\0';
+    // Components are compared case folded by entry_name_equal, so the path is used as given
     int max_dirs = 2;
     for (int i = 0; dir_path[i] != '\0'; i++) {
-        upper_dir_path[i] = (char) toupper(dir_path[i]);
-        if (i != 0 && upper_dir_path[i] == '\\') {
+        if (i != 0 && dir_path[i] == '\\') {
             max_dirs++;
         }
     }
     struct dir_t *dir = malloc(sizeof(struct dir_t));
     if (dir == NULL) {
         errno = ENOMEM;
-        free(upper_dir_path);
         return NULL;
     }
-    uint8_t *boot_record = malloc(sizeof(struct SFN) * pvolume->super.maximum_number_of_files);
+    uint32_t root_entries;
+    struct SFN *boot_record = fat_load_directory(pvolume, 0, &root_entries);
     if (boot_record == NULL) {
         free(dir);
-        free(upper_dir_path);
-        errno = ENOMEM;
-        return NULL;
-    }
-    if (disk_read(pvolume->disk, pvolume->root_directory_position, boot_record,
-                  (int32_t) sizeof(struct SFN) * pvolume->super.maximum_number_of_files /
-                  pvolume->super.bytes_per_sector) !=
-        (int) (sizeof(struct SFN) * pvolume->super.maximum_number_of_files / pvolume->super.bytes_per_sector)) {
-        free(dir);
-        free(boot_record);
-        free(upper_dir_path);
         return NULL;
     }
     dir->lfn_count = 0;
     dir->lfn = NULL;
+    dir->lfn_size = 0;
     dir->volume = pvolume;
     dir->offset = 0;
+    dir->first_cluster = 0;
     if (strcmp(dir_path, "\\") == 0) {
-        free(upper_dir_path);
-        dir->entry = (struct SFN *) boot_record;
+        dir->entry = boot_record;
+        dir->entry_count = root_entries;
         dir->offset = 1;
+        fat_memory_charge(&pvolume->memory, (ssize_t) dir_size(dir), 0);
         return dir;
     }
     struct SFN firsts[2];
+    uint16_t dir_clusters[max_dirs];
+    dir_clusters[0] = 0;
     struct SFN **dirs = malloc(sizeof(struct SFN *) * max_dirs);
     if (dirs == NULL) {
         free(dir);
         free(boot_record);
-        free(upper_dir_path);
         errno = ENOMEM;
         return NULL;
     }
-    int path_index = upper_dir_path[0] == '\\' ? 1 : 0;
+    int path_index = dir_path[0] == '\\' ? 1 : 0;
     int current_dir_index = 0;
-    char *expected_upper_name = NULL;
-    *dirs = (struct SFN *) boot_record;
+    char *expected_name = NULL;
+    *dirs = boot_record;
+    uint32_t dir_sizes[max_dirs];
+    dir_sizes[0] = root_entries;
     for (int i = 0; i < max_dirs - 1; i++) {
         int temp = 0;
-        for (; upper_dir_path[path_index] != '\0'; path_index++) {
-            expected_upper_name = realloc(expected_upper_name, temp + 2);
-            if (upper_dir_path[path_index] == '\\') {
+        for (; dir_path[path_index] != '\0'; path_index++) {
+            expected_name = realloc(expected_name, temp + 2);
+            if (dir_path[path_index] == '\\') {
                 path_index++;
                 break;
             }
-            expected_upper_name[temp] = upper_dir_path[path_index];
-            expected_upper_name[temp + 1] = '\0';
+            expected_name[temp] = dir_path[path_index];
+            expected_name[temp + 1] = '\0';
             temp++;
         }
-        if (strcmp(expected_upper_name, ".") == 0) {
+        if (strcmp(expected_name, ".") == 0) {
             continue;
-        } else if (strcmp(expected_upper_name, "..") == 0) {
+        } else if (strcmp(expected_name, "..") == 0) {
             if (current_dir_index == 0) {
                 errno = ENOENT;
                 free(dir);
-                free(upper_dir_path);
                 for (int a = 0; a <= current_dir_index; a++) {
                     free(dirs[a]);
                 }
@@ -684,162 +1500,63 @@ struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
         } else {
             int found = 0;
             int is_lfn = 0;
-            for (int j = 0;; j++) {
-                char *name = calloc(1, 13);
-                temp = 0;
-                if (dirs[current_dir_index][j].file_attributes == 0x0F) {
-                    is_lfn = 1;
-                    free(name);
+            for (int j = 0; j < (int) dir_sizes[current_dir_index]; j++) {
+                struct SFN *curr = dirs[current_dir_index] + j;
+                if (curr->filename[0] == 0x00) {
+                    break;
+                }
+                if (curr->filename[0] == (char) 0xE5) {
+                    is_lfn = 0;
                     continue;
                 }
-                if (dirs[current_dir_index][j].filename[0] == 0x00) {
-                    free(name);
-                    break;
+                if (curr->file_attributes == FAT_ATTR_LONG_NAME) {
+                    is_lfn = 1;
+                    continue;
                 }
-                if (!is_lfn) {
-                    struct SFN *curr = dirs[current_dir_index] + j;
-                    for (int k = 0; k < 8; k++) {
-                        char letter = curr->filename[k];
-                        if (isprint(letter) && letter != ' ') {
-                            name[temp] = letter;
-                            temp++;
+                bool matches = entry_name_equal(dirs[current_dir_index], (uint32_t) j, is_lfn, expected_name);
+                is_lfn = 0;
+                if (matches) {
+                    if ((dirs[current_dir_index][j].file_attributes & 0x10) == 0 ||
+                        dirs[current_dir_index][j].file_attributes & 0x08) {
+                        errno = ENOTDIR;
+                        free(dir);
+                        free(expected_name);
+                        for (int a = 0; a <= current_dir_index; a++) {
+                            free(dirs[a]);
                         }
-                    }
-                    for (int k = 8; k < 11; k++) {
-                        char letter = dirs[current_dir_index][j].filename[k];
-                        if (isprint(letter) && letter != ' ') {
-                            if (k == 8) {
-                                name[temp] = '.';
-                                temp++;
+                        free(dirs);
+                        return NULL;
+                    } else {
+                        found = 1;
+                        struct SFN *loaded = fat_load_directory(
+                                pvolume, dirs[current_dir_index][j].low_order_address_of_first_cluster,
+                                dir_sizes + current_dir_index + 1);
+                        if (loaded == NULL) {
+                            free(dir);
+                            free(expected_name);
+                            for (int a = 0; a <= current_dir_index; a++) {
+                                free(dirs[a]);
                             }
-                            name[temp] = letter;
-                            temp++;
+                            free(dirs);
+                            return NULL;
                         }
-                    }
-                } else {
-                    for (int k = 1;; k++) {
-                        struct SFN *mainn = dirs[current_dir_index] + j;
-                        char p = mainn->filename[0];
-                        if (p == '\0') {
-                            break;
-                        }
-                        struct LFN *curr = (struct LFN *) (dirs[current_dir_index] + (j - k));
-                        for (int l = 0; l < 10; l++) {
-                            char letter = ((struct LFN *) (curr))->filename1[l];
-                            if (isprint(letter)) {
-                                name = realloc(name, temp + 2);
-                                name[temp] = toupper(letter);
-                                name[temp + 1] = '\0';
-                                temp++;
-                            }
-                        }
-                        for (int l = 0; l < 12; l++) {
-                            char letter = ((struct LFN *) (dirs[current_dir_index] + (j - k)))->filename2[l];
-                            if (isprint(letter)) {
-                                name = realloc(name, temp + 2);
-                                name[temp] = toupper(letter);
-                                name[temp + 1] = '\0';
-                                temp++;
-                            }
-                        }
-                        for (int l = 0; l < 4; l++) {
-                            char letter = ((struct LFN *) (dirs[current_dir_index] + (j - k)))->filename3[l];
-                            if (isprint(letter)) {
-                                name = realloc(name, temp + 2);
-                                name[temp] = toupper(letter);
-                                name[temp + 1] = '\0';
-                                temp++;
-                            }
-                        }
-                        if (((struct LFN *) (dirs[current_dir_index] + (j - k)))->sequence_number >= 0x40) {
-                            is_lfn = 0;
-                            break;
-                        }
-                    }
-
-                }
-                if (strcmp(expected_upper_name, name) == 0) {
-                    if ((dirs[current_dir_index][j].file_attributes & 0x10) == 0 ||
-                        dirs[current_dir_index][j].file_attributes & 0x08) {
-                        errno = ENOTDIR;
-                        free(dir);
-                        free(upper_dir_path);
-                        free(name);
-                        free(expected_upper_name);
-                        for (int a = 0; a <= current_dir_index; a++) {
-                            free(dirs[a]);
-                        }
-                        free(dirs);
-                        return NULL;
-                    } else {
-                        found = 1;
-                        struct clusters_chain_t *clustersChain = get_chain_fat16(pvolume->fat,
-                                                                                 pvolume->super.size_of_fat *
-                                                                                 pvolume->super.bytes_per_sector,
-                                                                                 dirs[current_dir_index][j].low_order_address_of_first_cluster);
-                        dirs[current_dir_index + 1] = malloc(
-                                clustersChain->size * SECTOR_SIZE * pvolume->super.sectors_per_clusters);
-                        if (dirs[current_dir_index + 1] == NULL) {
-                            errno = ENOMEM;
-                            free(dir);
-                            free(upper_dir_path);
-                            free(name);
-                            free(expected_upper_name);
-                            free(clustersChain->clusters);
-                            free(clustersChain);
-                            for (int a = 0; a <= current_dir_index; a++) {
-                                free(dirs[a]);
-                            }
-                            free(dirs);
-                            return NULL;
-                        }
-                        uint32_t read = 0;
-                        uint8_t *buff = malloc(SECTOR_SIZE * pvolume->super.sectors_per_clusters);
-                        for (size_t k = 0; k < clustersChain->size; k++) {
-                            if (disk_read(pvolume->disk, pvolume->data_start + pvolume->super.sectors_per_clusters *
-                                                                               (clustersChain->clusters[k] - 2), buff,
-                                          pvolume->super.sectors_per_clusters) != pvolume->super.sectors_per_clusters) {
-                                errno = ERANGE;
-                                free(dir);
-                                free(clustersChain->clusters);
-                                free(clustersChain);
-                                free(upper_dir_path);
-                                free(name);
-                                free(expected_upper_name);
-                                for (int a = 0; a <= current_dir_index; a++) {
-                                    free(dirs[a]);
-                                }
-                                free(dirs);
-                                return NULL;
-                            }
-                            if (k == 0) {
-                                memcpy((uint8_t *) (dirs[current_dir_index + 1]) + read,
-                                       buff + (sizeof(struct SFN) * 2),
-                                       pvolume->super.sectors_per_clusters * SECTOR_SIZE - sizeof(struct SFN) * 2);
-                                read += pvolume->super.sectors_per_clusters * SECTOR_SIZE - sizeof(struct SFN) * 2;
-                                memcpy(firsts, buff, sizeof(struct SFN) * 2);
-                            } else {
-                                memcpy((uint8_t *) (dirs[current_dir_index + 1]) + read, buff,
-                                       pvolume->super.sectors_per_clusters * SECTOR_SIZE);
-                                read += pvolume->super.sectors_per_clusters * SECTOR_SIZE;
-                            }
-                        }
-                        free(buff);
-                        free(clustersChain->clusters);
-                        free(clustersChain);
+                        // "." and ".." are listed last, after every other entry
+                        uint32_t loaded_entries = dir_sizes[current_dir_index + 1];
+                        memcpy(firsts, loaded, sizeof(struct SFN) * 2);
+                        memmove(loaded, loaded + 2, sizeof(struct SFN) * (loaded_entries - 2));
+                        memset(loaded + loaded_entries - 2, 0, sizeof(struct SFN) * 2);
+                        dirs[current_dir_index + 1] = loaded;
+                        dir_clusters[current_dir_index + 1] =
+                                dirs[current_dir_index][j].low_order_address_of_first_cluster;
                         current_dir_index++;
-                        is_lfn = 0;
-                        free(name);
                         break;
                     }
                 }
-                free(name);
             }
             if (!found) {
                 errno = ENOENT;
                 free(dir);
-                free(expected_upper_name);
-                free(upper_dir_path);
+                free(expected_name);
                 for (int a = 0; a <= current_dir_index; a++) {
                     free(dirs[a]);
                 }
@@ -850,7 +1567,9 @@ struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
         }
     }
     dir->entry = dirs[current_dir_index];
-    for (int i = 0;; i++) {
+    dir->entry_count = dir_sizes[current_dir_index];
+    dir->first_cluster = dir_clusters[current_dir_index];
+    for (uint32_t i = 0; i + 2 <= dir->entry_count; i++) {
         if (dir->entry[i].filename[0] == 0x00) {
             memcpy(dir->entry + i, firsts, sizeof(struct SFN) * 2);
             break;
@@ -859,128 +1578,666 @@ struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
     for (int i = 0; i < current_dir_index; i++) {
         free(dirs[i]);
     }
-    free(expected_upper_name);
-    free(upper_dir_path);
+    free(expected_name);
     free(dirs);
+    fat_memory_charge(&pvolume->memory, (ssize_t) dir_size(dir), 0);
     return dir;
 }
 
-int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
-    if (pdir == NULL || pentry == NULL) {
-        errno = EFAULT;
-        return -1;
+size_t fat_short_name(const struct SFN *entry, char *name) {
+    size_t length = 0;
+    for (int k = 0; k < 8; k++) {
+        char letter = entry->filename[k];
+        if (isprint(letter) && letter != ' ') {
+            name[length++] = letter;
+        }
     }
-    int is_lfn = 0;
-    for (uint32_t i = pdir->offset; i < pdir->volume->super.maximum_number_of_files; i++) {
-        char *name = calloc(1, 13);
+    for (int k = 8; k < 11; k++) {
+        char letter = entry->filename[k];
+        if (isprint(letter) && letter != ' ') {
+            if (k == 8) {
+                name[length++] = '.';
+            }
+            name[length++] = letter;
+        }
+    }
+    name[length] = '\0';
+    return length;
+}
+
+// entries[index] is the SFN that follows its LFN sequence; name must hold LFN_MAX_NAME_LENGTH + 1 bytes
+size_t fat_long_name(const struct SFN *entries, uint32_t index, char *name) {
+    int length = lfn_decode(entries, index, name);
+    return length < 0 ? fat_short_name(entries + index, name) : (size_t) length;
+}
+
+// Advances pdir to its next visible entry; returns NULL at the end of the directory
+static struct SFN *dir_next_entry(struct dir_t *pdir, int *is_lfn) {
+    *is_lfn = 0;
+    for (uint32_t i = pdir->offset; i < pdir->entry_count; i++) {
         pdir->offset++;
         if (pdir->entry[i].filename[0] == 0x00) {
-            free(name);
             break;
         }
         if (pdir->entry[i].filename[0] == (char) 0xE5 || pdir->entry[i].filename[0] == (char) 0x05) {
-            free(name);
             continue;
         }
-        if (pdir->entry[i].file_attributes == 0x0F) {
-            is_lfn = 1;
-            free(name);
+        if (pdir->entry[i].file_attributes == FAT_ATTR_LONG_NAME) {
+            *is_lfn = 1;
             continue;
         }
-        int temp = 0;
-        if (!is_lfn) {
-            struct SFN *curr = pdir->entry + i;
-            for (int k = 0; k < 8; k++) {
-                char letter = curr->filename[k];
-                if (isprint(letter) && letter != ' ') {
-                    name[temp] = letter;
-                    temp++;
-                }
-            }
-            for (int k = 8; k < 11; k++) {
-                char letter = pdir->entry[i].filename[k];
-                if (isprint(letter) && letter != ' ') {
-                    if (k == 8) {
-                        name[temp] = '.';
-                        temp++;
-                    }
-                    name[temp] = letter;
-                    temp++;
-                }
+        return pdir->entry + i;
+    }
+    return NULL;
+}
+
+struct dir_t *dir_open(struct volume_t *pvolume, const char *dir_path) {
+    fat_trace_hook_t hook = __atomic_load_n(&fat_trace_hook, __ATOMIC_ACQUIRE);
+    if (hook == NULL) {
+        return dir_open_untraced(pvolume, dir_path);
+    }
+    struct fat_trace_event_t event = {.op = FAT_TRACE_DIR_OPEN, .path = dir_path, .start = trace_clock()};
+    struct dir_t *dir = dir_open_untraced(pvolume, dir_path);
+    event.handle = dir;
+    trace_end(hook, &event, dir != NULL ? 0 : -1);
+    return dir;
+}
+
+static int dir_read_untraced(struct dir_t *pdir, struct dir_entry_t *pentry) {
+    if (pdir == NULL || pentry == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    int is_lfn;
+    struct SFN *entry = dir_next_entry(pdir, &is_lfn);
+    if (entry == NULL) {
+        return 1;
+    }
+    char name[LFN_MAX_NAME_LENGTH + 1];
+    int long_length = is_lfn ? lfn_decode(pdir->entry, (uint32_t) (entry - pdir->entry), name) : -1;
+    is_lfn = long_length >= 0;
+    size_t length = is_lfn ? (size_t) long_length : fat_short_name(entry, name);
+    if (length >= sizeof(pentry->name)) {
+        // Cut a long name where a UTF-8 sequence starts
+        length = sizeof(pentry->name) - 1;
+        while (length > 0 && ((uint8_t) name[length] & 0xC0) == 0x80) {
+            length--;
+        }
+    }
+    memcpy(pentry->name, name, length);
+    pentry->name[length] = '\0';
+    pentry->size = entry->size;
+    pentry->is_readonly = ((entry->file_attributes >> 0) & 1);
+    pentry->is_hidden = ((entry->file_attributes >> 1) & 1);
+    pentry->is_system = ((entry->file_attributes >> 2) & 1);
+    pentry->is_archived = ((entry->file_attributes >> 5) & 1);
+    pentry->is_directory = entry->size == 0;
+    pentry->entry = entry;
+    if (is_lfn) {
+        // Kept until dir_close, at the length of the decoded name
+        char *long_name = malloc((size_t) long_length + 1);
+        char **lfn = realloc(pdir->lfn, sizeof(char *) * (pdir->lfn_count + 1));
+        if (long_name == NULL || lfn == NULL) {
+            free(long_name);
+            if (lfn != NULL) {
+                pdir->lfn = lfn;
             }
-        } else {
-            for (int k = 1;; k++) {
-                struct SFN *mainn = pdir->entry + i;
-                char p = mainn->filename[0];
-                if (p == '\0') {
-                    break;
-                }
-                struct LFN *curr = (struct LFN *) (pdir->entry + (i - k));
-                for (int l = 0; l < 10; l++) {
-                    char letter = ((struct LFN *) (curr))->filename1[l];
-                    if (isprint(letter)) {
-                        name = realloc(name, temp + 2);
-                        name[temp] = letter;
-                        name[temp + 1] = '\0';
-                        temp++;
-                    }
-                }
-                for (int l = 0; l < 12; l++) {
-                    char letter = ((struct LFN *) (pdir->entry + (i - k)))->filename2[l];
-                    if (isprint(letter)) {
-                        name = realloc(name, temp + 2);
-                        name[temp] = letter;
-                        name[temp + 1] = '\0';
-                        temp++;
-                    }
-                }
-                for (int l = 0; l < 4; l++) {
-                    char letter = ((struct LFN *) (pdir->entry + (i - k)))->filename3[l];
-                    if (isprint(letter)) {
-                        name = realloc(name, temp + 2);
-                        name[temp] = letter;
-                        name[temp + 1] = '\0';
-                        temp++;
-                    }
-                }
-                if (((struct LFN *) (pdir->entry + (i - k)))->sequence_number >= 0x40) {
-                    break;
-                }
+            errno = ENOMEM;
+            return -1;
+        }
+        memcpy(long_name, name, (size_t) long_length + 1);
+        pdir->lfn = lfn;
+        pdir->lfn[pdir->lfn_count++] = long_name;
+        pdir->lfn_size += (size_t) long_length + 1;
+        fat_memory_charge(&pdir->volume->memory, (ssize_t) long_length + 1, 0);
+        pentry->has_long_name = true;
+        pentry->long_name = long_name;
+    } else {
+        pentry->has_long_name = false;
+        pentry->long_name = NULL;
+    }
+    return 0;
+}
+
+int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry) {
+    fat_trace_hook_t hook = __atomic_load_n(&fat_trace_hook, __ATOMIC_ACQUIRE);
+    if (hook == NULL) {
+        return dir_read_untraced(pdir, pentry);
+    }
+    struct fat_trace_event_t event = {.op = FAT_TRACE_DIR_READ, .handle = pdir, .start = trace_clock()};
+    int result = dir_read_untraced(pdir, pentry);
+    trace_end(hook, &event, result);
+    return result;
+}
+
+struct dir_batch_t *dir_batch_create(size_t capacity) {
+    if (capacity == 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct dir_batch_t *batch = calloc(1, sizeof(struct dir_batch_t));
+    if (batch == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    batch->capacity = capacity;
+    batch->names_capacity = capacity * 16;
+    batch->sizes = malloc(sizeof(uint32_t) * capacity);
+    batch->attributes = malloc(sizeof(uint8_t) * capacity);
+    batch->first_clusters = malloc(sizeof(uint16_t) * capacity);
+    batch->name_offsets = malloc(sizeof(uint32_t) * capacity);
+    batch->names = malloc(batch->names_capacity);
+    if (batch->sizes == NULL || batch->attributes == NULL || batch->first_clusters == NULL ||
+        batch->name_offsets == NULL || batch->names == NULL) {
+        dir_batch_free(batch);
+        errno = ENOMEM;
+        return NULL;
+    }
+    return batch;
+}
+
+void dir_batch_free(struct dir_batch_t *batch) {
+    if (batch == NULL) {
+        return;
+    }
+    free(batch->sizes);
+    free(batch->attributes);
+    free(batch->first_clusters);
+    free(batch->name_offsets);
+    free(batch->names);
+    free(batch);
+}
+
+int dir_read_batch(struct dir_t *pdir, struct dir_batch_t *batch) {
+    if (pdir == NULL || batch == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    batch->count = 0;
+    batch->names_size = 0;
+    while (batch->count < batch->capacity) {
+        if (batch->names_capacity - batch->names_size < LFN_MAX_NAME_LENGTH + 1) {
+            char *names = realloc(batch->names, batch->names_capacity * 2);
+            if (names == NULL) {
+                errno = ENOMEM;
+                return batch->count == 0 ? -1 : (int) batch->count;
             }
+            batch->names = names;
+            batch->names_capacity *= 2;
         }
-        memcpy(pentry->name, name, 13);
-        pentry->size = pdir->entry[i].size;
-        pentry->is_readonly = ((pdir->entry[i].file_attributes >> 0) & 1);
-        pentry->is_hidden = ((pdir->entry[i].file_attributes >> 1) & 1);
-        pentry->is_system = ((pdir->entry[i].file_attributes >> 2) & 1);
-        pentry->is_archived = ((pdir->entry[i].file_attributes >> 5) & 1);
-        pentry->is_directory = pdir->entry[i].size == 0;
-        if (is_lfn) {
-            pentry->has_long_name = true;
-            pentry->long_name = name;
-            pdir->lfn_count++;
-            pdir->lfn = realloc(pdir->lfn, sizeof(char *) * pdir->lfn_count);
-            pdir->lfn[pdir->lfn_count - 1] = name;
-        } else {
-            pentry->has_long_name = false;
-            pentry->long_name = NULL;
-            free(name);
+        int is_lfn;
+        struct SFN *entry = dir_next_entry(pdir, &is_lfn);
+        if (entry == NULL) {
+            break;
         }
-        return 0;
+        char *name = batch->names + batch->names_size;
+        size_t length = is_lfn ? fat_long_name(pdir->entry, (uint32_t) (entry - pdir->entry), name)
+                                : fat_short_name(entry, name);
+        batch->name_offsets[batch->count] = (uint32_t) batch->names_size;
+        batch->names_size += length + 1;
+        batch->sizes[batch->count] = entry->size;
+        batch->attributes[batch->count] = entry->file_attributes;
+        batch->first_clusters[batch->count] = entry->low_order_address_of_first_cluster;
+        batch->count++;
     }
-    return 1;
+    return (int) batch->count;
 }
 
-int dir_close(struct dir_t *pdir) {
+// Everything dir_close does but freeing the handle, see file_release
+static int dir_release(struct dir_t *pdir) {
     if (pdir == NULL) {
         errno = EFAULT;
         return -1;
     }
+    fat_memory_charge(&pdir->volume->memory, -(ssize_t) dir_size(pdir), 0);
     free(pdir->entry);
-    for (int i = 0; i < pdir->lfn_count; i++) {
+    for (uint32_t i = 0; i < pdir->lfn_count; i++) {
         free(pdir->lfn[i]);
     }
     free(pdir->lfn);
+    return 0;
+}
+
+int dir_close(struct dir_t *pdir) {
+    fat_trace_hook_t hook = __atomic_load_n(&fat_trace_hook, __ATOMIC_ACQUIRE);
+    if (hook == NULL) {
+        int result = dir_release(pdir);
+        free(pdir);
+        return result;
+    }
+    struct fat_trace_event_t event = {.op = FAT_TRACE_DIR_CLOSE, .handle = pdir, .start = trace_clock()};
+    int result = dir_release(pdir);
+    trace_end(hook, &event, result);
     free(pdir);
+    return result;
+}
+
+// Slot of name in entries, matched against the long name or the short name regardless of case; -1 if absent
+static int32_t dir_find(const struct SFN *entries, uint32_t entry_count, const char *name) {
+    int is_lfn = 0;
+    for (uint32_t i = 0; i < entry_count && entries[i].filename[0] != 0x00; i++) {
+        const struct SFN *entry = entries + i;
+        if (entry->filename[0] == (char) 0xE5) {
+            is_lfn = 0;
+            continue;
+        }
+        if (entry->file_attributes == FAT_ATTR_LONG_NAME) {
+            is_lfn = 1;
+            continue;
+        }
+        if (!(entry->file_attributes & FAT_ATTR_VOLUME_ID) && entry_name_equal(entries, i, is_lfn, name)) {
+            return (int32_t) i;
+        }
+        is_lfn = 0;
+    }
+    return -1;
+}
+
+// Finds the entry of a '\\' separated path relative to pdir, reading only the directories below it on the path
+static int dir_resolve(struct dir_t *pdir, const char *path, struct SFN *found) {
+    const struct SFN *entries = pdir->entry;
+    uint32_t entry_count = pdir->entry_count;
+    struct SFN *loaded = NULL;
+    uint16_t cluster = pdir->first_cluster;
+    // A path made only of "." names pdir itself
+    memset(found, 0, sizeof(struct SFN));
+    found->file_attributes = FAT_ATTR_DIRECTORY;
+    found->low_order_address_of_first_cluster = cluster;
+    char name[LFN_MAX_NAME_LENGTH + 1];
+    const char *p = path;
+    while (*p == '\\') {
+        p++;
+    }
+    while (*p != '\0') {
+        size_t length = 0;
+        while (p[length] != '\0' && p[length] != '\\') {
+            length++;
+        }
+        if (length > LFN_MAX_NAME_LENGTH) {
+            free(loaded);
+            errno = ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(name, p, length);
+        name[length] = '\0';
+        p += length;
+        while (*p == '\\') {
+            p++;
+        }
+        if (strcmp(name, ".") == 0) {
+            continue;
+        }
+        if (entries == NULL) {
+            loaded = fat_load_directory(pdir->volume, cluster, &entry_count);
+            if (loaded == NULL) {
+                return -1;
+            }
+            entries = loaded;
+        }
+        int32_t index = strcmp(name, "..") == 0 && cluster == 0 ? -1 : dir_find(entries, entry_count, name);
+        if (index < 0) {
+            free(loaded);
+            errno = ENOENT;
+            return -1;
+        }
+        memcpy(found, entries + index, sizeof(struct SFN));
+        if (*p != '\0') {
+            if (!(found->file_attributes & FAT_ATTR_DIRECTORY)) {
+                free(loaded);
+                errno = ENOTDIR;
+                return -1;
+            }
+            cluster = found->low_order_address_of_first_cluster;
+            free(loaded);
+            loaded = NULL;
+            entries = NULL;
+        }
+    }
+    free(loaded);
+    return 0;
+}
+
+struct file_t *file_open_entry(struct volume_t *pvolume, const struct SFN *entry) {
+    if (pvolume == NULL || entry == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (entry->file_attributes & (FAT_ATTR_DIRECTORY | FAT_ATTR_VOLUME_ID)) {
+        errno = EISDIR;
+        return NULL;
+    }
+    struct file_t *file = malloc(sizeof(struct file_t));
+    if (file == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    file->volume = pvolume;
+    file->offset = 0;
+    file->writable = false;
+    if (file_share(file, entry) != 0) {
+        free(file);
+        return NULL;
+    }
+    return file;
+}
+
+struct dir_t *dir_open_entry(struct volume_t *pvolume, const struct SFN *entry) {
+    if (pvolume == NULL || entry == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (!(entry->file_attributes & FAT_ATTR_DIRECTORY) || entry->file_attributes & FAT_ATTR_VOLUME_ID) {
+        errno = ENOTDIR;
+        return NULL;
+    }
+    struct dir_t *dir = calloc(1, sizeof(struct dir_t));
+    if (dir == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    // ".." of a directory in the root holds cluster 0
+    dir->first_cluster = entry->low_order_address_of_first_cluster;
+    dir->entry = fat_load_directory(pvolume, dir->first_cluster, &dir->entry_count);
+    if (dir->entry == NULL) {
+        free(dir);
+        return NULL;
+    }
+    dir->volume = pvolume;
+    if (dir->first_cluster == 0) {
+        // Same first slot as dir_open("\\")
+        dir->offset = 1;
+    } else if (dir->entry_count >= 2 && dir->entry[0].filename[0] == '.') {
+        // "." and ".." are listed last, as dir_open lists them
+        struct SFN firsts[2];
+        memcpy(firsts, dir->entry, sizeof(struct SFN) * 2);
+        memmove(dir->entry, dir->entry + 2, sizeof(struct SFN) * (dir->entry_count - 2));
+        memset(dir->entry + dir->entry_count - 2, 0, sizeof(struct SFN) * 2);
+        for (uint32_t i = 0; i + 2 <= dir->entry_count; i++) {
+            if (dir->entry[i].filename[0] == 0x00) {
+                memcpy(dir->entry + i, firsts, sizeof(struct SFN) * 2);
+                break;
+            }
+        }
+    }
+    fat_memory_charge(&pvolume->memory, (ssize_t) dir_size(dir), 0);
+    return dir;
+}
+
+struct file_t *file_openat(struct dir_t *pdir, const char *file_name) {
+    if (pdir == NULL || file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct SFN entry;
+    if (dir_resolve(pdir, file_name, &entry) != 0) {
+        return NULL;
+    }
+    return file_open_entry(pdir->volume, &entry);
+}
+
+struct dir_t *dir_openat(struct dir_t *pdir, const char *dir_path) {
+    if (pdir == NULL || dir_path == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct SFN entry;
+    if (dir_resolve(pdir, dir_path, &entry) != 0) {
+        return NULL;
+    }
+    return dir_open_entry(pdir->volume, &entry);
+}
+
+struct walk_task_t {
+    uint16_t cluster;
+    uint32_t depth;
+    char *path;
+    struct walk_task_t *next;
+};
+
+struct walk_state_t {
+    struct volume_t *volume;
+    fat_walk_callback_t callback;
+    void *user;
+    int flags;
+    int threads;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    struct walk_task_t *head;
+    struct walk_task_t *tail;
+    int busy; //Workers currently walking a directory
+    int stop;
+    int error;
+    uint8_t *visited; //One bit per cluster of every directory entered or queued, shared by all workers
+    uint32_t visited_count;
+};
+
+// Marks a directory cluster as entered; fails with ELOOP when it was already, i.e. the tree loops back on itself
+static int walk_visit(struct walk_state_t *state, uint16_t cluster) {
+    if (cluster >= state->visited_count) {
+        // Not a data cluster, fat_load_directory rejects it
+        return 0;
+    }
+    uint8_t bit = (uint8_t) (1u << (cluster & 7));
+    if (__atomic_fetch_or(state->visited + (cluster >> 3), bit, __ATOMIC_RELAXED) & bit) {
+        errno = ELOOP;
+        return -1;
+    }
+    return 0;
+}
+
+static int walk_enqueue(struct walk_state_t *state, uint16_t cluster, const char *path, uint32_t depth) {
+    struct walk_task_t *task = malloc(sizeof(struct walk_task_t));
+    if (task == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    task->path = strdup(path);
+    if (task->path == NULL) {
+        free(task);
+        errno = ENOMEM;
+        return -1;
+    }
+    task->cluster = cluster;
+    task->depth = depth;
+    task->next = NULL;
+    pthread_mutex_lock(&state->lock);
+    if (state->tail == NULL) {
+        state->head = task;
+    } else {
+        state->tail->next = task;
+    }
+    state->tail = task;
+    pthread_cond_signal(&state->wake);
+    pthread_mutex_unlock(&state->lock);
+    return 0;
+}
+
+static struct walk_task_t *walk_dequeue(struct walk_state_t *state) {
+    struct walk_task_t *task = state->head;
+    if (task != NULL) {
+        state->head = task->next;
+        if (state->head == NULL) {
+            state->tail = NULL;
+        }
+    }
+    return task;
+}
+
+static int walk_directory(struct walk_state_t *state, uint16_t cluster, const char *path, uint32_t depth) {
+    uint32_t entry_count;
+    struct SFN *entries = fat_load_directory(state->volume, cluster, &entry_count);
+    if (entries == NULL) {
+        return -1;
+    }
+    size_t path_length = strlen(path);
+    char *child_path = malloc(path_length + LFN_MAX_NAME_LENGTH + 2);
+    if (child_path == NULL) {
+        free(entries);
+        errno = ENOMEM;
+        return -1;
+    }
+    memcpy(child_path, path, path_length);
+    child_path[path_length] = '\\';
+    char *name = child_path + path_length + 1;
+
+    int result = 0;
+    int is_lfn = 0;
+    for (uint32_t i = 0; i < entry_count && !__atomic_load_n(&state->stop, __ATOMIC_RELAXED); i++) {
+        struct SFN *entry = entries + i;
+        if (entry->filename[0] == 0x00) {
+            break;
+        }
+        if (entry->filename[0] == (char) 0xE5 || entry->filename[0] == (char) 0x05) {
+            is_lfn = 0;
+            continue;
+        }
+        if (entry->file_attributes == FAT_ATTR_LONG_NAME) {
+            is_lfn = 1;
+            continue;
+        }
+        if (entry->file_attributes & FAT_ATTR_VOLUME_ID || entry->filename[0] == '.') {
+            is_lfn = 0;
+            continue;
+        }
+        char short_name[13];
+        fat_short_name(entry, short_name);
+        if (is_lfn) {
+            fat_long_name(entries, i, name);
+        } else {
+            strcpy(name, short_name);
+        }
+        is_lfn = 0;
+
+        struct fat_walk_entry_t walk_entry;
+        walk_entry.path = child_path;
+        walk_entry.name = name;
+        walk_entry.short_name = short_name;
+        walk_entry.entry = entry;
+        walk_entry.depth = depth;
+        walk_entry.first_cluster = entry->low_order_address_of_first_cluster;
+        walk_entry.size = entry->size;
+        walk_entry.attributes = entry->file_attributes;
+        walk_entry.is_directory = (entry->file_attributes & FAT_ATTR_DIRECTORY) != 0;
+        int action = state->callback(&walk_entry, state->user);
+        if (action == FAT_WALK_STOP) {
+            __atomic_store_n(&state->stop, 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if (!walk_entry.is_directory || action == FAT_WALK_PRUNE || walk_entry.first_cluster == 0) {
+            continue;
+        }
+        if (depth + 1 >= FAT_WALK_MAX_DEPTH) {
+            errno = ELOOP;
+            result = -1;
+            break;
+        }
+        if ((result = walk_visit(state, walk_entry.first_cluster)) != 0) {
+            break;
+        }
+        if (state->threads <= 1 && !(state->flags & FAT_WALK_BREADTH_FIRST)) {
+            result = walk_directory(state, walk_entry.first_cluster, child_path, depth + 1);
+        } else {
+            result = walk_enqueue(state, walk_entry.first_cluster, child_path, depth + 1);
+        }
+        if (result != 0) {
+            break;
+        }
+    }
+    free(child_path);
+    free(entries);
+    return result;
+}
+
+static void *walk_worker(void *arg) {
+    struct walk_state_t *state = arg;
+    pthread_mutex_lock(&state->lock);
+    while (1) {
+        while (state->head == NULL && state->busy > 0 && !state->stop) {
+            pthread_cond_wait(&state->wake, &state->lock);
+        }
+        if (state->head == NULL || state->stop) {
+            pthread_cond_broadcast(&state->wake);
+            break;
+        }
+        struct walk_task_t *task = walk_dequeue(state);
+        state->busy++;
+        pthread_mutex_unlock(&state->lock);
+
+        int result = walk_directory(state, task->cluster, task->path, task->depth);
+        int error = errno;
+        free(task->path);
+        free(task);
+
+        pthread_mutex_lock(&state->lock);
+        if (result != 0 && state->error == 0) {
+            state->error = error;
+            state->stop = 1;
+        }
+        state->busy--;
+        if (state->busy == 0 || state->stop) {
+            pthread_cond_broadcast(&state->wake);
+        }
+    }
+    pthread_mutex_unlock(&state->lock);
+    return NULL;
+}
+
+int fat_walk(struct volume_t *pvolume, uint16_t first_cluster, int flags, int threads,
+             fat_walk_callback_t callback, void *user) {
+    if (pvolume == NULL || callback == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    struct walk_state_t state;
+    memset(&state, 0, sizeof(state));
+    state.volume = pvolume;
+    state.callback = callback;
+    state.user = user;
+    state.flags = flags;
+    state.threads = threads;
+    state.visited_count = pvolume->geometry.cluster_count + 2;
+    state.visited = calloc((state.visited_count + 7) / 8, 1);
+    if (state.visited == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    pthread_mutex_init(&state.lock, NULL);
+    pthread_cond_init(&state.wake, NULL);
+
+    if (walk_visit(&state, first_cluster) != 0 || walk_enqueue(&state, first_cluster, "", 0) != 0) {
+        state.error = errno;
+    } else if (threads <= 1) {
+        walk_worker(&state);
+    } else {
+        pthread_t *workers = malloc(sizeof(pthread_t) * threads);
+        int started = 0;
+        if (workers != NULL) {
+            for (; started < threads; started++) {
+                if (pthread_create(workers + started, NULL, walk_worker, &state) != 0) {
+                    break;
+                }
+            }
+        }
+        if (started == 0) {
+            walk_worker(&state);
+        }
+        for (int i = 0; i < started; i++) {
+            pthread_join(workers[i], NULL);
+        }
+        free(workers);
+    }
+
+    struct walk_task_t *task;
+    while ((task = walk_dequeue(&state)) != NULL) {
+        free(task->path);
+        free(task);
+    }
+    pthread_cond_destroy(&state.wake);
+    pthread_mutex_destroy(&state.lock);
+    free(state.visited);
+    if (state.error != 0) {
+        errno = state.error;
+        return -1;
+    }
     return 0;
 }
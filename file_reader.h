@@ -9,9 +9,34 @@
 #include <string.h>
 #include <ctype.h>
 #include <stdbool.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+
+#include "fat_memory.h"
 
 #define SECTOR_SIZE 512
 
+#define DISK_BUFFER_SIZE (64 * 1024) //Largest FAT16 cluster
+#define DISK_BUFFER_COUNT 8
+#define DISK_DIRECT_DEFAULT_ALIGNMENT 4096
+
+#define FAT_ATTR_READONLY 0x01
+#define FAT_ATTR_HIDDEN 0x02
+#define FAT_ATTR_SYSTEM 0x04
+#define FAT_ATTR_VOLUME_ID 0x08
+#define FAT_ATTR_DIRECTORY 0x10
+#define FAT_ATTR_ARCHIVE 0x20
+#define FAT_ATTR_LONG_NAME 0x0F
+
+#define FAT_OPEN_TABLE_BUCKETS 256
+
+#define LFN_MAX_ENTRIES 20
+#define LFN_MAX_NAME_LENGTH (LFN_MAX_ENTRIES * 13 * 3) //In UTF-8 bytes, at most 3 per UTF-16 unit
+
 struct clusters_chain_t {
     uint16_t *clusters;
     size_t size;
@@ -24,9 +49,9 @@ struct date_t {
 };
 
 struct my_time_t {
-    uint16_t hours: 5;
+    uint16_t seconds: 5; //In units of 2 seconds
     uint16_t minutes: 6;
-    uint16_t seconds: 5;
+    uint16_t hours: 5;
 };
 
 struct __attribute__((__packed__)) boot_sector_fat {
@@ -81,32 +106,98 @@ struct __attribute__((__packed__)) LFN {
     char filename3[4];
 };
 
+struct compressed_image_t;
+
+// State of a disk opened with O_DIRECT: every read goes through block aligned buffers taken from pool
+struct disk_direct_t {
+    size_t block_size; //Logical block size reads are aligned to
+    size_t buffer_size; //DISK_BUFFER_SIZE plus one block, so a misaligned cluster fits in one read
+    uint8_t *pool;
+    uint8_t *free_buffers[DISK_BUFFER_COUNT];
+    int free_count;
+    int disabled; //Set once the kernel rejected an aligned read and the disk fell back to buffered reads
+    pthread_mutex_t lock;
+};
+
 struct disk_t {
     FILE *disk;
+    struct compressed_image_t *compressed; //NULL for a plain image
+    struct disk_direct_t *direct; //NULL unless opened with disk_open_from_file_direct
+    int64_t size; //Size of the image in bytes
+    bool writable; //Opened with disk_open_from_file_rw
 };
 
+// Computed once in fat_open; offsets are in bytes from the start of the disk
+struct fat_geometry_t {
+    uint32_t sector_size;
+    uint8_t sector_shift;
+    uint32_t cluster_size;
+    uint8_t cluster_shift;
+    uint32_t cluster_mask;
+    uint32_t cluster_count; //Data clusters, numbered from 2
+    uint32_t fat_size; //Bytes in one FAT copy
+    uint64_t fat_offset;
+    uint64_t root_offset;
+    uint32_t root_size;
+    uint64_t data_offset; //Cluster 2
+};
+
+// Chain and entry of an open file, shared by every read handle opened on the same directory entry
+struct fat_shared_file_t {
+    struct SFN entry;
+    struct clusters_chain_t chain;
+    uint32_t references;
+    struct fat_shared_file_t *next;
+};
+
+// Open files of a volume keyed by first cluster; entries that only share a cluster (empty files) compare unequal
+struct fat_open_table_t {
+    struct fat_shared_file_t *buckets[FAT_OPEN_TABLE_BUCKETS];
+    pthread_mutex_t lock;
+};
+
+struct file_t;
+struct fat_writer_t;
+
+// Copies length bytes of stream from its offset to out, returns the number of bytes copied
+typedef size_t (*fat_read_kernel_t)(struct file_t *stream, uint8_t *out, size_t length);
+
 struct volume_t {
     struct boot_sector_fat super;
     struct disk_t *disk;
-    uint16_t fat_1_position;
-    uint16_t root_directory_position;
-    uint8_t *fat;
-    uint16_t data_start;
+    uint16_t fat_1_position; //In volume sectors
+    uint16_t root_directory_position; //In volume sectors
+    uint8_t *fat; //NULL while evicted by the memory governor, take it with fat_acquire
+    uint32_t fat_users; //fat_acquire calls not yet released, FAT_MEMORY_RECLAIMING while the FAT is being evicted
+    pthread_mutex_t fat_lock; //Serialises reading the FAT back
+    struct fat_memory_owner_t memory;
+    uint16_t data_start; //In volume sectors
+    struct fat_geometry_t geometry;
+    fat_read_kernel_t read_kernel; //Specialised for the cluster size of the volume
+    struct fat_writer_t *writer; //Created by the first write, NULL while the volume is only read
+    struct fat_open_table_t open_files;
 };
 
 struct file_t {
-    struct SFN *entry;
+    struct SFN *entry; //Points into shared for read handles
     struct volume_t *volume;
     struct clusters_chain_t *clusters;
     uint32_t offset;
+    struct fat_shared_file_t *shared; //NULL for a writable handle, whose entry and chain are private
+    bool writable; //Opened with file_open_write
+    int write_flags;
+    uint64_t entry_offset; //Byte offset of entry on the disk, valid when writable
 };
 
 struct dir_t {
     struct SFN *entry;
     struct volume_t *volume;
+    uint16_t first_cluster; //0 for the root directory
+    uint32_t entry_count; //Slots in entry, including unused ones
     uint32_t offset;
-    uint8_t lfn_count;
+    uint32_t lfn_count;
     char **lfn;
+    size_t lfn_size; //Bytes held by the names in lfn
 };
 
 struct dir_entry_t {
@@ -119,21 +210,91 @@ struct dir_entry_t {
     bool is_directory;
     bool has_long_name;
     char *long_name;
+    const struct SFN *entry; //Points into the directory, valid until dir_close; NULL for remote listings
 };
 
+// Struct-of-arrays view of up to capacity directory entries, filled by dir_read_batch
+struct dir_batch_t {
+    size_t capacity;
+    size_t count;
+    uint32_t *sizes;
+    uint8_t *attributes; //Raw FAT_ATTR_* bits
+    uint16_t *first_clusters;
+    uint32_t *name_offsets; //Offsets of null terminated names (long name if present) into names
+    char *names;
+    size_t names_size;
+    size_t names_capacity;
+};
+
+#define FAT_WALK_DEPTH_FIRST 0
+#define FAT_WALK_BREADTH_FIRST 1
+
+#define FAT_WALK_CONTINUE 0
+#define FAT_WALK_PRUNE 1 //Do not descend into the directory just reported
+#define FAT_WALK_STOP 2
+
+#define FAT_WALK_MAX_DEPTH 256 //Deeper trees fail with ELOOP, as do directories entered twice
+
+// Everything here points into walker-owned buffers that are only valid during the callback
+struct fat_walk_entry_t {
+    const char *path; //Relative to the directory the walk started from, e.g. "\\DOCS\\README.TXT"
+    const char *name; //Long name if present, short name otherwise
+    const char *short_name;
+    const struct SFN *entry;
+    uint32_t depth; //0 for entries of the starting directory
+    uint16_t first_cluster;
+    uint32_t size;
+    uint8_t attributes;
+    bool is_directory;
+};
+
+typedef int (*fat_walk_callback_t)(const struct fat_walk_entry_t *entry, void *user);
 
 struct clusters_chain_t *get_chain_fat16(const void *const buffer, size_t size, uint16_t first_cluster);
 
 struct disk_t *disk_open_from_file(const char *volume_file_name);
 
+struct disk_t *disk_open_from_file_direct(const char *volume_file_name);
+
+struct disk_t *disk_open_from_file_rw(const char *volume_file_name);
+
 int disk_read(struct disk_t *pdisk, int32_t first_sector, void *buffer, int32_t sectors_to_read);
 
+int disk_write(struct disk_t *pdisk, int32_t first_sector, const void *buffer, int32_t sectors_to_write);
+
+void *disk_buffer_acquire(struct disk_t *pdisk, size_t size);
+
+void disk_buffer_release(struct disk_t *pdisk, void *buffer);
+
 int disk_close(struct disk_t *pdisk);
 
 struct volume_t *fat_open(struct disk_t *pdisk, uint32_t first_sector);
 
 int fat_close(struct volume_t *pvolume);
 
+// See fat_memory.h; every reader of volume_t::fat holds it between these two
+const uint8_t *fat_acquire(struct volume_t *pvolume);
+
+void fat_release(struct volume_t *pvolume);
+
+int fat_read_clusters(struct volume_t *pvolume, uint16_t first_cluster, uint32_t count, void *buffer);
+
+// Every entry slot of a directory, entry_count receives their number; cluster 0 is the root directory
+struct SFN *fat_load_directory(struct volume_t *pvolume, uint16_t first_cluster, uint32_t *entry_count);
+
+// Name of entry as dir_read reports it; name must hold 13 bytes
+size_t fat_short_name(const struct SFN *entry, char *name);
+
+// UTF-8 long name of the LFN sequence stored right before entries[index]; name must hold LFN_MAX_NAME_LENGTH + 1
+// bytes. Falls back to the short name when the sequence is broken, starts before entries or its checksum does not
+// match entries[index].
+size_t fat_long_name(const struct SFN *entries, uint32_t index, char *name);
+
+uint8_t fat_lfn_checksum(const struct SFN *entry);
+
+// Case insensitive order of UTF-8 names, folding ASCII, Latin-1, Latin Extended-A, Greek and Cyrillic letters
+int fat_name_compare(const char *a, const char *b);
+
 struct file_t *file_open(struct volume_t *pvolume, const char *file_name);
 
 int file_close(struct file_t *stream);
@@ -148,4 +309,24 @@ int dir_read(struct dir_t *pdir, struct dir_entry_t *pentry);
 
 int dir_close(struct dir_t *pdir);
 
+// Open a file or directory from an entry already in hand (dir_entry_t, fat_walk_entry_t, ...) without a path lookup
+struct file_t *file_open_entry(struct volume_t *pvolume, const struct SFN *entry);
+
+struct dir_t *dir_open_entry(struct volume_t *pvolume, const struct SFN *entry);
+
+// Resolve file_name relative to pdir, starting from its loaded entries instead of the root directory
+struct file_t *file_openat(struct dir_t *pdir, const char *file_name);
+
+struct dir_t *dir_openat(struct dir_t *pdir, const char *dir_path);
+
+struct dir_batch_t *dir_batch_create(size_t capacity);
+
+void dir_batch_free(struct dir_batch_t *batch);
+
+int dir_read_batch(struct dir_t *pdir, struct dir_batch_t *batch);
+
+// With threads > 1 subdirectories are fanned out over a pool and callback runs concurrently in any order
+int fat_walk(struct volume_t *pvolume, uint16_t first_cluster, int flags, int threads,
+             fat_walk_callback_t callback, void *user);
+
 #endif //MY_FAT_16_READER_FILE_READER_H
@@ -0,0 +1,487 @@
+#ifndef MY_FAT_16_READER_FILE_READER_HPP
+#define MY_FAT_16_READER_FILE_READER_HPP
+
+extern "C" {
+#include "file_reader.h"
+}
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <exception>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <ranges>
+#include <span>
+#include <stop_token>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+/*
+ * Header-only C++20 layer over file_reader.h. Volume, File and Dir each own one C handle, are move-only and no bigger
+ * than the pointers they hold; C API failures are thrown as std::system_error carrying the errno.
+ */
+
+namespace fat16 {
+
+inline constexpr size_t dir_range_batch = 64; //Entries fetched per dir_read_batch call by Dir::entries
+
+[[noreturn]] inline void throw_errno(const char *what) {
+    throw std::system_error(errno, std::generic_category(), what);
+}
+
+namespace detail {
+
+template<auto Close>
+struct closer {
+    template<typename T>
+    void operator()(T *handle) const noexcept {
+        Close(handle);
+    }
+};
+
+inline const char *c_str(const char *path) noexcept {
+    return path;
+}
+
+inline const char *c_str(const std::string &path) noexcept {
+    return path.c_str();
+}
+
+} // namespace detail
+
+class Volume {
+public:
+    explicit Volume(const char *image, uint32_t first_sector = 0) : disk_(disk_open_from_file(image)) {
+        if (!disk_) {
+            throw_errno(image);
+        }
+        mount(first_sector);
+    }
+
+    // Takes over a disk opened some other way (disk_open_from_file_direct, _rw), closing it if the mount fails
+    Volume(struct disk_t *disk, uint32_t first_sector) : disk_(disk) {
+        mount(first_sector);
+    }
+
+    struct volume_t *native() const noexcept {
+        return volume_.get();
+    }
+
+    const struct fat_geometry_t &geometry() const noexcept {
+        return volume_->geometry;
+    }
+
+private:
+    void mount(uint32_t first_sector) {
+        volume_.reset(fat_open(disk_.get(), first_sector));
+        if (!volume_) {
+            throw_errno("fat_open");
+        }
+    }
+
+    // Declared first so it is closed after the volume
+    std::unique_ptr<struct disk_t, detail::closer<disk_close>> disk_;
+    std::unique_ptr<struct volume_t, detail::closer<fat_close>> volume_;
+};
+
+// A run of consecutive clusters of a file
+struct Extent {
+    uint32_t file_offset;
+    uint16_t first_cluster;
+    uint32_t clusters;
+    uint64_t disk_offset; //Bytes from the start of the disk
+    uint32_t length; //Bytes of the file it holds; the last extent ends at the file size
+};
+
+// Extents of an open file, computed from its cluster chain as the range is iterated
+class ExtentRange {
+public:
+    class iterator {
+    public:
+        using value_type = Extent;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        explicit iterator(const struct file_t *file) noexcept : file_(file) {
+            advance();
+        }
+
+        const Extent &operator*() const noexcept {
+            return current_;
+        }
+
+        const Extent *operator->() const noexcept {
+            return &current_;
+        }
+
+        iterator &operator++() noexcept {
+            advance();
+            return *this;
+        }
+
+        void operator++(int) noexcept {
+            advance();
+        }
+
+        bool operator==(std::default_sentinel_t) const noexcept {
+            return done_;
+        }
+
+    private:
+        void advance() noexcept {
+            const struct clusters_chain_t *chain = file_->clusters;
+            const struct fat_geometry_t &geometry = file_->volume->geometry;
+            uint32_t size = file_->entry->size;
+            uint64_t offset = (uint64_t) next_ << geometry.cluster_shift;
+            if (next_ >= chain->size || offset >= size) {
+                done_ = true;
+                return;
+            }
+            uint32_t run = 1;
+            while (next_ + run < chain->size && chain->clusters[next_ + run] == chain->clusters[next_] + run &&
+                   offset + ((uint64_t) run << geometry.cluster_shift) < size) {
+                run++;
+            }
+            current_.file_offset = (uint32_t) offset;
+            current_.first_cluster = chain->clusters[next_];
+            current_.clusters = run;
+            current_.disk_offset = geometry.data_offset +
+                                   ((uint64_t) (current_.first_cluster - 2) << geometry.cluster_shift);
+            current_.length = (uint32_t) std::min<uint64_t>((uint64_t) run << geometry.cluster_shift, size - offset);
+            next_ += run;
+        }
+
+        const struct file_t *file_ = nullptr;
+        size_t next_ = 0;
+        Extent current_{};
+        bool done_ = false;
+    };
+
+    explicit ExtentRange(const struct file_t *file) noexcept : file_(file) {
+    }
+
+    iterator begin() const noexcept {
+        return iterator(file_);
+    }
+
+    std::default_sentinel_t end() const noexcept {
+        return {};
+    }
+
+private:
+    const struct file_t *file_;
+};
+
+class File {
+public:
+    File(Volume &volume, const char *path) : file_(file_open(volume.native(), path)) {
+        if (!file_) {
+            throw_errno(path);
+        }
+    }
+
+    // Adopts a handle from file_open, file_openat, file_open_entry, ...
+    explicit File(struct file_t *file) noexcept : file_(file) {
+    }
+
+    // Reads from the current offset straight into buffer; returns the number of bytes read, 0 at the end
+    size_t read_into(std::span<std::byte> buffer) {
+        if (buffer.empty()) {
+            return 0;
+        }
+        size_t read = file_read(buffer.data(), 1, buffer.size(), file_.get());
+        if (read == (size_t) -1) {
+            throw_errno("file_read");
+        }
+        return read;
+    }
+
+    uint32_t seek(int32_t offset, int whence = SEEK_SET) {
+        int32_t position = file_seek(file_.get(), offset, whence);
+        if (position < 0) {
+            throw_errno("file_seek");
+        }
+        return (uint32_t) position;
+    }
+
+    uint32_t tell() const noexcept {
+        return file_->offset;
+    }
+
+    uint32_t size() const noexcept {
+        return file_->entry->size;
+    }
+
+    ExtentRange extents() const noexcept {
+        return ExtentRange(file_.get());
+    }
+
+    // Calls fn(std::span<const std::byte> data, uint32_t file_offset) for the whole file, one read per extent or per
+    // buffer full of it. There is no mapped disk backend, so data is a view of buffer, which must hold a cluster.
+    template<typename F>
+    void for_each_extent(std::span<std::byte> buffer, F &&fn) const {
+        const struct fat_geometry_t &geometry = file_->volume->geometry;
+        uint32_t per_read = (uint32_t) std::min<size_t>(buffer.size() >> geometry.cluster_shift, UINT32_MAX);
+        if (per_read == 0) {
+            throw std::system_error(EINVAL, std::generic_category(), "for_each_extent");
+        }
+        for (const Extent &extent : extents()) {
+            for (uint32_t done = 0; done < extent.clusters;) {
+                uint32_t count = std::min(per_read, extent.clusters - done);
+                if (fat_read_clusters(file_->volume, (uint16_t) (extent.first_cluster + done), count,
+                                      buffer.data()) < 0) {
+                    throw_errno("fat_read_clusters");
+                }
+                uint32_t offset = done << geometry.cluster_shift;
+                size_t length = std::min<uint64_t>((uint64_t) count << geometry.cluster_shift, extent.length - offset);
+                fn(std::span<const std::byte>(buffer.data(), length), extent.file_offset + offset);
+                done += count;
+            }
+        }
+    }
+
+    struct file_t *native() const noexcept {
+        return file_.get();
+    }
+
+private:
+    std::unique_ptr<struct file_t, detail::closer<file_close>> file_;
+};
+
+// Views into the batch buffer of a DirRange: valid until the iterator crosses into the next batch
+struct DirEntry {
+    std::string_view name; //Long name if present, short name otherwise
+    uint32_t size;
+    uint8_t attributes; //Raw FAT_ATTR_* bits
+    uint16_t first_cluster;
+
+    bool is_directory() const noexcept {
+        return attributes & FAT_ATTR_DIRECTORY;
+    }
+
+    bool is_readonly() const noexcept {
+        return attributes & FAT_ATTR_READONLY;
+    }
+
+    bool is_hidden() const noexcept {
+        return attributes & FAT_ATTR_HIDDEN;
+    }
+
+    bool is_system() const noexcept {
+        return attributes & FAT_ATTR_SYSTEM;
+    }
+
+    bool is_archived() const noexcept {
+        return attributes & FAT_ATTR_ARCHIVE;
+    }
+};
+
+// Single pass over the entries left in a directory, read in batches into one reused buffer
+class DirRange {
+public:
+    class iterator {
+    public:
+        using value_type = DirEntry;
+        using difference_type = std::ptrdiff_t;
+
+        iterator() = default;
+
+        explicit iterator(DirRange *range) noexcept : range_(range) {
+        }
+
+        DirEntry operator*() const noexcept {
+            const struct dir_batch_t *batch = range_->batch_.get();
+            const char *name = batch->names + batch->name_offsets[range_->index_];
+            return {std::string_view(name), batch->sizes[range_->index_], batch->attributes[range_->index_],
+                    batch->first_clusters[range_->index_]};
+        }
+
+        iterator &operator++() {
+            if (++range_->index_ == range_->batch_->count) {
+                range_->fill();
+            }
+            return *this;
+        }
+
+        void operator++(int) {
+            ++*this;
+        }
+
+        bool operator==(std::default_sentinel_t) const noexcept {
+            return range_->index_ >= range_->batch_->count;
+        }
+
+    private:
+        DirRange *range_ = nullptr;
+    };
+
+    DirRange(struct dir_t *dir, size_t batch) : dir_(dir), batch_(dir_batch_create(batch)) {
+        if (!batch_) {
+            throw_errno("dir_batch_create");
+        }
+    }
+
+    iterator begin() {
+        if (!started_) {
+            started_ = true;
+            fill();
+        }
+        return iterator(this);
+    }
+
+    std::default_sentinel_t end() const noexcept {
+        return {};
+    }
+
+private:
+    void fill() {
+        index_ = 0;
+        if (dir_read_batch(dir_, batch_.get()) < 0) {
+            throw_errno("dir_read_batch");
+        }
+    }
+
+    struct dir_t *dir_;
+    std::unique_ptr<struct dir_batch_t, detail::closer<dir_batch_free>> batch_;
+    size_t index_ = 0;
+    bool started_ = false;
+};
+
+class Dir {
+public:
+    Dir(Volume &volume, const char *path) : dir_(dir_open(volume.native(), path)) {
+        if (!dir_) {
+            throw_errno(path);
+        }
+    }
+
+    // Relative to parent, as dir_openat
+    Dir(const Dir &parent, const char *path) : dir_(dir_openat(parent.native(), path)) {
+        if (!dir_) {
+            throw_errno(path);
+        }
+    }
+
+    explicit Dir(struct dir_t *dir) noexcept : dir_(dir) {
+    }
+
+    File open_file(const char *name) const {
+        struct file_t *file = file_openat(dir_.get(), name);
+        if (file == nullptr) {
+            throw_errno(name);
+        }
+        return File(file);
+    }
+
+    // Entries from the current position on; iterating the range moves the position, as dir_read does
+    DirRange entries(size_t batch = dir_range_batch) {
+        return DirRange(dir_.get(), batch);
+    }
+
+    struct dir_t *native() const noexcept {
+        return dir_.get();
+    }
+
+private:
+    std::unique_ptr<struct dir_t, detail::closer<dir_close>> dir_;
+};
+
+static_assert(sizeof(File) == sizeof(struct file_t *) && sizeof(Dir) == sizeof(struct dir_t *));
+static_assert(std::input_iterator<DirRange::iterator> && std::ranges::input_range<DirRange>);
+static_assert(std::input_iterator<ExtentRange::iterator> && std::ranges::input_range<ExtentRange>);
+
+// Runs fn(index, std::stop_token) for every index below count on up to threads std::jthread workers, the calling
+// thread being one of them; 0 threads means one per hardware thread. The first exception thrown by fn stops the other
+// workers before their next index and is rethrown once they have all joined.
+template<typename F>
+void parallel_for(size_t count, unsigned threads, F &&fn) {
+    if (threads == 0) {
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    threads = (unsigned) std::max<size_t>(1, std::min<size_t>(threads, count));
+    std::atomic<size_t> next{0};
+    std::stop_source stop;
+    std::exception_ptr error;
+    std::mutex error_lock;
+    auto work = [&] {
+        std::stop_token token = stop.get_token();
+        for (size_t i; !token.stop_requested() && (i = next.fetch_add(1, std::memory_order_relaxed)) < count;) {
+            try {
+                fn(i, token);
+            } catch (...) {
+                std::lock_guard<std::mutex> guard(error_lock);
+                if (!error) {
+                    error = std::current_exception();
+                }
+                stop.request_stop();
+            }
+        }
+    };
+    {
+        std::vector<std::jthread> workers;
+        try {
+            workers.reserve(threads - 1);
+            for (unsigned i = 1; i < threads; i++) {
+                workers.emplace_back(work);
+            }
+        } catch (...) {
+            // The workers already running wind down and join as the vector goes away
+            stop.request_stop();
+            throw;
+        }
+        work();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+// Opens every path of a random access range of const char * or std::string and hands it to fn(index, File &) on
+// parallel_for workers; the file is closed when fn returns
+template<std::ranges::random_access_range Paths, typename F>
+void parallel_open(Volume &volume, const Paths &paths, unsigned threads, F &&fn) {
+    parallel_for(std::ranges::size(paths), threads, [&](size_t index, std::stop_token) {
+        File file(volume, detail::c_str(std::ranges::begin(paths)[index]));
+        fn(index, file);
+    });
+}
+
+// fat_walk with a callable returning FAT_WALK_*; with threads > 1 it is called from several threads at once.
+// An exception stops the walk and is rethrown from here.
+template<typename F>
+void walk(Volume &volume, uint16_t first_cluster, int flags, int threads, F &&fn) {
+    struct state_t {
+        F &fn;
+        std::exception_ptr error;
+        std::mutex lock;
+    } state{fn, nullptr, {}};
+    auto callback = [](const struct fat_walk_entry_t *entry, void *user) -> int {
+        auto *walk_state = static_cast<state_t *>(user);
+        try {
+            return walk_state->fn(*entry);
+        } catch (...) {
+            std::lock_guard<std::mutex> guard(walk_state->lock);
+            if (!walk_state->error) {
+                walk_state->error = std::current_exception();
+            }
+            return FAT_WALK_STOP;
+        }
+    };
+    int result = fat_walk(volume.native(), first_cluster, flags, threads, callback, &state);
+    if (state.error) {
+        std::rethrow_exception(state.error);
+    }
+    if (result != 0) {
+        throw_errno("fat_walk");
+    }
+}
+
+} // namespace fat16
+
+#endif //MY_FAT_16_READER_FILE_READER_HPP
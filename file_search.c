@@ -0,0 +1,405 @@
+#include "file_search.h"
+
+#include <strings.h>
+
+static int is_separator(char c) {
+    return c == '\\' || c == '/';
+}
+
+// Upper case literal path every match of an anchored, alternation-free regex has to start with
+static char *regex_literal_prefix(const char *pattern) {
+    char *prefix = calloc(1, strlen(pattern) + 1);
+    if (prefix == NULL) {
+        return NULL;
+    }
+    if (pattern[0] != '^') {
+        return prefix;
+    }
+    for (const char *p = pattern; *p; p++) {
+        if (*p == '\\' && p[1] != '\0') {
+            p++;
+        } else if (*p == '|') {
+            return prefix;
+        }
+    }
+    size_t length = 0;
+    const char *p = pattern + 1;
+    while (*p) {
+        char letter;
+        const char *next;
+        if (*p == '\\' && p[1] != '\0' && strchr(".[]()*+?{}|^$\\", p[1]) != NULL) {
+            letter = p[1];
+            next = p + 2;
+        } else if (strchr(".[]()*+?{}|^$\\", *p) != NULL) {
+            break;
+        } else {
+            letter = *p;
+            next = p + 1;
+        }
+        if (*next == '*' || *next == '?' || *next == '{') {
+            break;
+        }
+        prefix[length++] = (char) toupper(letter);
+        p = next;
+    }
+    prefix[length] = '\0';
+    return prefix;
+}
+
+struct search_pattern_t *search_compile(const char *pattern, int syntax) {
+    if (pattern == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (syntax != SEARCH_GLOB && syntax != SEARCH_REGEX) {
+        errno = EINVAL;
+        return NULL;
+    }
+    struct search_pattern_t *compiled = calloc(1, sizeof(struct search_pattern_t));
+    if (compiled == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    compiled->syntax = syntax;
+    if (syntax == SEARCH_REGEX) {
+        if (regcomp(&compiled->regex, pattern, REG_EXTENDED | REG_NOSUB | REG_ICASE) != 0) {
+            free(compiled);
+            errno = EINVAL;
+            return NULL;
+        }
+        compiled->literal_prefix = regex_literal_prefix(pattern);
+        if (compiled->literal_prefix == NULL) {
+            regfree(&compiled->regex);
+            free(compiled);
+            errno = ENOMEM;
+            return NULL;
+        }
+        return compiled;
+    }
+
+    const char *p = pattern;
+    while (*p) {
+        while (is_separator(*p)) {
+            p++;
+        }
+        size_t length = 0;
+        while (p[length] != '\0' && !is_separator(p[length])) {
+            length++;
+        }
+        if (length == 0) {
+            break;
+        }
+        if (compiled->segment_count == SEARCH_MAX_SEGMENTS) {
+            search_pattern_free(compiled);
+            errno = EINVAL;
+            return NULL;
+        }
+        struct search_segment_t *segment = compiled->segments + compiled->segment_count;
+        segment->any_depth = length == 2 && p[0] == '*' && p[1] == '*';
+        segment->glob = malloc(length + 1);
+        if (segment->glob == NULL) {
+            search_pattern_free(compiled);
+            errno = ENOMEM;
+            return NULL;
+        }
+        for (size_t i = 0; i < length; i++) {
+            segment->glob[i] = (char) toupper(p[i]);
+        }
+        segment->glob[length] = '\0';
+        compiled->segment_count++;
+        p += length;
+    }
+    return compiled;
+}
+
+void search_pattern_free(struct search_pattern_t *pattern) {
+    if (pattern == NULL) {
+        return;
+    }
+    if (pattern->syntax == SEARCH_REGEX) {
+        regfree(&pattern->regex);
+        free(pattern->literal_prefix);
+    }
+    for (uint32_t i = 0; i < pattern->segment_count; i++) {
+        free(pattern->segments[i].glob);
+    }
+    free(pattern);
+}
+
+// Matches one character of a glob (a literal, '?' or a [...] class); *length receives the pattern bytes used
+static bool glob_match_one(const char *p, char letter, size_t *length) {
+    letter = (char) toupper(letter);
+    if (*p == '?') {
+        *length = 1;
+        return true;
+    }
+    if (*p == '[') {
+        const char *end = p + 1;
+        if (*end == '!' || *end == '^') {
+            end++;
+        }
+        if (*end == ']') {
+            end++;
+        }
+        while (*end != '\0' && *end != ']') {
+            end++;
+        }
+        if (*end == ']') {
+            const char *c = p + 1;
+            bool negate = *c == '!' || *c == '^';
+            if (negate) {
+                c++;
+            }
+            bool found = false;
+            for (const char *first = c; c < end; c++) {
+                if (c + 2 < end && c[1] == '-') {
+                    found |= letter >= c[0] && letter <= c[2];
+                    c += 2;
+                } else if (*c != ']' || c == first) {
+                    found |= letter == *c;
+                }
+            }
+            *length = (size_t) (end - p) + 1;
+            return found != negate;
+        }
+    }
+    *length = 1;
+    return *p == letter;
+}
+
+static bool glob_match(const char *p, const char *name) {
+    const char *star_p = NULL;
+    const char *star_name = NULL;
+    while (*name) {
+        size_t length;
+        if (*p == '*') {
+            star_p = ++p;
+            star_name = name;
+        } else if (*p != '\0' && glob_match_one(p, *name, &length)) {
+            p += length;
+            name++;
+        } else if (star_p != NULL) {
+            p = star_p;
+            name = ++star_name;
+        } else {
+            return false;
+        }
+    }
+    while (*p == '*') {
+        p++;
+    }
+    return *p == '\0';
+}
+
+// Bit s set = the first s segments are consumed; "**" may also consume nothing
+static uint64_t glob_closure(const struct search_pattern_t *pattern, uint64_t states) {
+    for (uint32_t s = 0; s < pattern->segment_count; s++) {
+        if ((states >> s & 1) && pattern->segments[s].any_depth) {
+            states |= (uint64_t) 1 << (s + 1);
+        }
+    }
+    return states;
+}
+
+static uint64_t glob_step(const struct search_pattern_t *pattern, uint64_t states, const char *name) {
+    uint64_t next = 0;
+    for (uint32_t s = 0; s < pattern->segment_count; s++) {
+        if (!(states >> s & 1)) {
+            continue;
+        }
+        if (pattern->segments[s].any_depth) {
+            next |= (uint64_t) 1 << s;
+        } else if (glob_match(pattern->segments[s].glob, name)) {
+            next |= (uint64_t) 1 << (s + 1);
+        }
+    }
+    return next;
+}
+
+struct search_context_t {
+    const struct search_pattern_t *pattern;
+    struct search_result_t *result;
+    size_t capacity;
+    uint64_t *states; //Glob states of the directory being listed at each depth
+    size_t *short_lengths; //Length in short_path of the directory being listed at each depth
+    size_t depth_capacity;
+    char *short_path; //Path of the entry being visited with short names only, e.g. "\\PROGRA~1\\README.TXT"
+    size_t short_path_capacity;
+    int error;
+};
+
+// Room for the per-depth state of a subdirectory of an entry at depth
+static int search_reserve_depth(struct search_context_t *context, uint32_t depth) {
+    if (depth + 2 <= context->depth_capacity) {
+        return 0;
+    }
+    size_t capacity = context->depth_capacity * 2;
+    uint64_t *states = realloc(context->states, sizeof(uint64_t) * capacity);
+    if (states == NULL) {
+        return -1;
+    }
+    context->states = states;
+    size_t *short_lengths = realloc(context->short_lengths, sizeof(size_t) * capacity);
+    if (short_lengths == NULL) {
+        return -1;
+    }
+    context->short_lengths = short_lengths;
+    context->depth_capacity = capacity;
+    return 0;
+}
+
+// Appends the short name of entry to the short path of its directory
+static int search_short_path(struct search_context_t *context, const struct fat_walk_entry_t *entry) {
+    size_t directory_length = context->short_lengths[entry->depth];
+    size_t needed = directory_length + strlen(entry->short_name) + 2;
+    if (needed > context->short_path_capacity) {
+        size_t capacity = needed > context->short_path_capacity * 2 ? needed : context->short_path_capacity * 2;
+        char *short_path = realloc(context->short_path, capacity);
+        if (short_path == NULL) {
+            return -1;
+        }
+        context->short_path = short_path;
+        context->short_path_capacity = capacity;
+    }
+    context->short_path[directory_length] = '\\';
+    strcpy(context->short_path + directory_length + 1, entry->short_name);
+    return 0;
+}
+
+static int search_add(struct search_context_t *context, const struct fat_walk_entry_t *entry) {
+    struct search_result_t *result = context->result;
+    if (result->count == context->capacity) {
+        size_t capacity = context->capacity ? context->capacity * 2 : 16;
+        struct search_match_t *matches = realloc(result->matches, sizeof(struct search_match_t) * capacity);
+        if (matches == NULL) {
+            return -1;
+        }
+        result->matches = matches;
+        context->capacity = capacity;
+    }
+    struct search_match_t *match = result->matches + result->count;
+    match->path = strdup(entry->path);
+    if (match->path == NULL) {
+        return -1;
+    }
+    strcpy(match->short_name, entry->short_name);
+    memcpy(&match->entry, entry->entry, sizeof(struct SFN));
+    match->first_cluster = entry->first_cluster;
+    match->size = entry->size;
+    match->attributes = entry->attributes;
+    match->is_directory = entry->is_directory;
+    result->count++;
+    return 0;
+}
+
+// Either the long path or the short path of entry matches; short_path must be built
+static bool regex_matches(const struct search_context_t *context, const struct fat_walk_entry_t *entry) {
+    if (regexec(&context->pattern->regex, entry->path, 0, NULL, 0) == 0) {
+        return true;
+    }
+    return strcmp(entry->path, context->short_path) != 0 &&
+           regexec(&context->pattern->regex, context->short_path, 0, NULL, 0) == 0;
+}
+
+// A directory can only hold matches if its path and the regex literal prefix agree on their common part
+static bool regex_may_descend(const struct search_pattern_t *pattern, const char *path) {
+    size_t prefix_length = strlen(pattern->literal_prefix);
+    size_t path_length = strlen(path);
+    size_t common = prefix_length < path_length ? prefix_length : path_length;
+    if (strncasecmp(pattern->literal_prefix, path, common) != 0) {
+        return false;
+    }
+    return prefix_length <= path_length || pattern->literal_prefix[path_length] == '\\';
+}
+
+static int search_visit(const struct fat_walk_entry_t *entry, void *user) {
+    struct search_context_t *context = user;
+    const struct search_pattern_t *pattern = context->pattern;
+    bool matched;
+    bool descend = entry->is_directory;
+    if (search_short_path(context, entry) != 0 || (descend && search_reserve_depth(context, entry->depth) != 0)) {
+        context->error = ENOMEM;
+        return FAT_WALK_STOP;
+    }
+    if (pattern->syntax == SEARCH_REGEX) {
+        matched = regex_matches(context, entry);
+        // Pruned only when neither path can lead to the literal prefix
+        descend = descend && (regex_may_descend(pattern, entry->path) ||
+                              regex_may_descend(pattern, context->short_path));
+    } else {
+        uint64_t final = (uint64_t) 1 << pattern->segment_count;
+        uint64_t states = context->states[entry->depth];
+        uint64_t next = glob_step(pattern, states, entry->name);
+        if (strcmp(entry->name, entry->short_name) != 0) {
+            next |= glob_step(pattern, states, entry->short_name);
+        }
+        next = glob_closure(pattern, next);
+        matched = (next & final) != 0;
+        descend = descend && (next & (final - 1)) != 0;
+        if (descend) {
+            context->states[entry->depth + 1] = next;
+        }
+    }
+    if (descend) {
+        context->short_lengths[entry->depth + 1] = strlen(context->short_path);
+    }
+    if (matched && search_add(context, entry) != 0) {
+        context->error = ENOMEM;
+        return FAT_WALK_STOP;
+    }
+    return descend ? FAT_WALK_CONTINUE : FAT_WALK_PRUNE;
+}
+
+struct search_result_t *fat_search(struct volume_t *pvolume, uint16_t first_cluster,
+                                   const struct search_pattern_t *pattern) {
+    if (pvolume == NULL || pattern == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    struct search_result_t *result = calloc(1, sizeof(struct search_result_t));
+    if (result == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct search_context_t context;
+    memset(&context, 0, sizeof(context));
+    context.pattern = pattern;
+    context.result = result;
+    context.depth_capacity = 16;
+    context.states = malloc(sizeof(uint64_t) * context.depth_capacity);
+    context.short_lengths = malloc(sizeof(size_t) * context.depth_capacity);
+    if (context.states == NULL || context.short_lengths == NULL) {
+        free(context.states);
+        free(context.short_lengths);
+        free(result);
+        errno = ENOMEM;
+        return NULL;
+    }
+    context.states[0] = glob_closure(pattern, 1);
+    context.short_lengths[0] = 0;
+
+    // Depth first on one thread: a subdirectory is walked right after its entry, so states[depth + 1] and
+    // short_lengths[depth + 1] are still its own
+    int status = fat_walk(pvolume, first_cluster, FAT_WALK_DEPTH_FIRST, 1, search_visit, &context);
+    int error = context.error ? context.error : errno;
+    free(context.states);
+    free(context.short_lengths);
+    free(context.short_path);
+    if (status != 0 || context.error != 0) {
+        search_result_free(result);
+        errno = error;
+        return NULL;
+    }
+    return result;
+}
+
+void search_result_free(struct search_result_t *result) {
+    if (result == NULL) {
+        return;
+    }
+    for (size_t i = 0; i < result->count; i++) {
+        free(result->matches[i].path);
+    }
+    free(result->matches);
+    free(result);
+}
@@ -0,0 +1,51 @@
+#ifndef MY_FAT_16_READER_FILE_SEARCH_H
+#define MY_FAT_16_READER_FILE_SEARCH_H
+
+#include "file_reader.h"
+
+#include <regex.h>
+
+#define SEARCH_GLOB 0 //'\\' or '/' separated, supports *, ?, [...] and ** for any number of directories
+#define SEARCH_REGEX 1 //POSIX extended regex matched against the whole path, with long names or short names only
+
+#define SEARCH_MAX_SEGMENTS 63
+
+struct search_segment_t {
+    char *glob;
+    bool any_depth; //"**"
+};
+
+// Compiled once, reusable for any number of searches on any volume
+struct search_pattern_t {
+    int syntax;
+    struct search_segment_t segments[SEARCH_MAX_SEGMENTS];
+    uint32_t segment_count;
+    regex_t regex;
+    char *literal_prefix; //Upper case path prefix every regex match must start with, may be empty
+};
+
+struct search_match_t {
+    char *path; //Relative to the searched directory, long names where present
+    char short_name[13];
+    struct SFN entry;
+    uint16_t first_cluster;
+    uint32_t size;
+    uint8_t attributes;
+    bool is_directory;
+};
+
+struct search_result_t {
+    size_t count;
+    struct search_match_t *matches;
+};
+
+struct search_pattern_t *search_compile(const char *pattern, int syntax);
+
+void search_pattern_free(struct search_pattern_t *pattern);
+
+struct search_result_t *fat_search(struct volume_t *pvolume, uint16_t first_cluster,
+                                   const struct search_pattern_t *pattern);
+
+void search_result_free(struct search_result_t *result);
+
+#endif //MY_FAT_16_READER_FILE_SEARCH_H
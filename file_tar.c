@@ -0,0 +1,273 @@
+#include "file_tar.h"
+
+static int tar_write(struct tar_export_t *export, const void *data, size_t length) {
+    const uint8_t *bytes = data;
+    while (length > 0) {
+        ssize_t done = write(export->fd, bytes, length);
+        if (done < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        bytes += done;
+        length -= (size_t) done;
+        export->written += (uint64_t) done;
+    }
+    return 0;
+}
+
+static int tar_pad(struct tar_export_t *export, uint64_t length) {
+    static const uint8_t zeros[TAR_BLOCK_SIZE];
+    uint32_t tail = (uint32_t) (length % TAR_BLOCK_SIZE);
+    return tail == 0 ? 0 : tar_write(export, zeros, TAR_BLOCK_SIZE - tail);
+}
+
+// Right aligned, zero filled octal digits followed by a terminating NUL, as ustar numeric fields are
+static void tar_octal(char *field, size_t width, uint64_t value) {
+    field[width - 1] = '\0';
+    for (size_t i = width - 1; i > 0; i--) {
+        field[i - 1] = (char) ('0' + (value & 7));
+        value >>= 3;
+    }
+}
+
+time_t fat_entry_mtime(const struct SFN *entry) {
+    if (entry == NULL) {
+        errno = EFAULT;
+        return (time_t) -1;
+    }
+    struct tm tm;
+    memset(&tm, 0, sizeof(tm));
+    tm.tm_year = entry->modified_date.year + 80;
+    tm.tm_mon = entry->modified_date.month - 1;
+    tm.tm_mday = entry->modified_date.day;
+    tm.tm_hour = entry->modified_time.hours;
+    tm.tm_min = entry->modified_time.minutes;
+    tm.tm_sec = entry->modified_time.seconds * 2;
+    tm.tm_isdst = -1;
+    if (entry->modified_date.month == 0 || entry->modified_date.day == 0) {
+        // Never stamped: use the FAT epoch
+        tm.tm_mon = 0;
+        tm.tm_mday = 1;
+        tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    }
+    return mktime(&tm);
+}
+
+// Splits a name over ustar name/prefix at a '/'; returns 0 when it does not fit or is not plain ASCII
+static int tar_ustar_name(char *header, const char *name, size_t length) {
+    for (size_t i = 0; i < length; i++) {
+        if ((uint8_t) name[i] >= 0x80) {
+            return 0;
+        }
+    }
+    if (length <= 100) {
+        memcpy(header, name, length);
+        return 1;
+    }
+    for (size_t split = length - 1; split > 0; split--) {
+        if (name[split] == '/' && split <= 155 && length - split - 1 <= 100 && length - split - 1 > 0) {
+            memcpy(header + 345, name, split);
+            memcpy(header, name + split + 1, length - split - 1);
+            return 1;
+        }
+        if (length - split > 101) {
+            break;
+        }
+    }
+    return 0;
+}
+
+// Returns 0 when the name had to be cut short and needs a pax path record
+static int tar_header(char *header, const char *name, size_t name_length, char type, uint32_t mode,
+                       uint64_t size, time_t mtime) {
+    memset(header, 0, TAR_BLOCK_SIZE);
+    int fits = tar_ustar_name(header, name, name_length);
+    if (!fits) {
+        // Readers that know pax use the path record; the others get as much of the name as fits
+        memcpy(header, name, name_length < 100 ? name_length : 100);
+    }
+    tar_octal(header + 100, 8, mode);
+    tar_octal(header + 108, 8, 0);
+    tar_octal(header + 116, 8, 0);
+    tar_octal(header + 124, 12, size);
+    tar_octal(header + 136, 12, mtime < 0 ? 0 : (uint64_t) mtime);
+    header[156] = type;
+    memcpy(header + 257, "ustar", 6);
+    memcpy(header + 263, "00", 2);
+    memset(header + 148, ' ', 8);
+    uint32_t checksum = 0;
+    for (int i = 0; i < TAR_BLOCK_SIZE; i++) {
+        checksum += (uint8_t) header[i];
+    }
+    tar_octal(header + 148, 7, checksum);
+    return fits;
+}
+
+// Extended header carrying the full UTF-8 path, for names ustar cannot hold
+static int tar_pax_path(struct tar_export_t *export, const char *name, size_t name_length) {
+    // "<length> path=<name>\n", where length counts its own digits
+    size_t record_length = name_length + 7;
+    size_t digits = 1;
+    for (size_t power = 10; record_length + digits >= power; power *= 10) {
+        digits++;
+    }
+    record_length += digits;
+    char *record = malloc(record_length + 1);
+    if (record == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    snprintf(record, record_length + 1, "%zu path=%.*s\n", record_length, (int) name_length, name);
+    char header[TAR_BLOCK_SIZE];
+    tar_header(header, "PaxHeader", 9, 'x', 0644, record_length, 0);
+    int result = tar_write(export, header, sizeof(header));
+    if (result == 0) {
+        result = tar_write(export, record, record_length);
+    }
+    if (result == 0) {
+        result = tar_pad(export, record_length);
+    }
+    free(record);
+    return result;
+}
+
+static int tar_member(struct tar_export_t *export, const char *name, size_t name_length, char type,
+                      const struct SFN *entry, uint64_t size) {
+    char header[TAR_BLOCK_SIZE];
+    uint32_t mode = type == '5' ? 0755 : 0644;
+    if (entry->file_attributes & FAT_ATTR_READONLY) {
+        mode &= ~0222u;
+    }
+    if (!tar_header(header, name, name_length, type, mode, size, fat_entry_mtime(entry)) &&
+        tar_pax_path(export, name, name_length) != 0) {
+        return -1;
+    }
+    return tar_write(export, header, sizeof(header));
+}
+
+// Follows the chain straight from the FAT, a run of consecutive clusters per read, so no chain array is built
+static int tar_file_data(struct tar_export_t *export, uint16_t first_cluster, uint32_t size) {
+    struct volume_t *volume = export->volume;
+    const struct fat_geometry_t *geometry = &volume->geometry;
+    const uint8_t *fat = fat_acquire(volume);
+    if (fat == NULL) {
+        return -1;
+    }
+    uint32_t limit = geometry->cluster_count + 2;
+    uint32_t remaining = size;
+    uint16_t cluster = first_cluster;
+    int result = 0;
+    while (remaining > 0) {
+        if (cluster < 2 || cluster >= limit || (uint32_t) cluster * 2 + 1 >= geometry->fat_size) {
+            errno = ERANGE;
+            result = -1;
+            break;
+        }
+        uint32_t run = 1;
+        uint16_t next = (uint16_t) (fat[cluster * 2] | fat[cluster * 2 + 1] << 8);
+        while (run < export->buffer_clusters && ((uint64_t) run << geometry->cluster_shift) < remaining &&
+               next == cluster + run && next < limit) {
+            run++;
+            next = (uint16_t) (fat[next * 2] | fat[next * 2 + 1] << 8);
+        }
+        if (fat_read_clusters(volume, cluster, run, export->buffer) < 0) {
+            result = -1;
+            break;
+        }
+        uint64_t length = (uint64_t) run << geometry->cluster_shift;
+        if (length > remaining) {
+            length = remaining;
+        }
+        if (tar_write(export, export->buffer, (size_t) length) != 0) {
+            result = -1;
+            break;
+        }
+        remaining -= (uint32_t) length;
+        cluster = next;
+    }
+    int error = errno;
+    fat_release(volume);
+    errno = error;
+    return result == 0 ? tar_pad(export, size) : -1;
+}
+
+static int tar_walk_callback(const struct fat_walk_entry_t *entry, void *user) {
+    struct tar_export_t *export = user;
+    // "\\DOCS\\README.TXT" -> "DOCS/README.TXT", directories with a trailing '/'
+    size_t length = strlen(entry->path);
+    char *name = malloc(length + 2);
+    if (name == NULL) {
+        export->error = ENOMEM;
+        return FAT_WALK_STOP;
+    }
+    size_t name_length = 0;
+    for (size_t i = entry->path[0] == '\\' ? 1 : 0; i < length; i++) {
+        name[name_length++] = entry->path[i] == '\\' ? '/' : entry->path[i];
+    }
+    int result;
+    if (entry->is_directory) {
+        name[name_length++] = '/';
+        result = tar_member(export, name, name_length, '5', entry->entry, 0);
+    } else {
+        result = tar_member(export, name, name_length, '0', entry->entry, entry->size);
+        if (result == 0 && entry->size > 0) {
+            result = tar_file_data(export, entry->first_cluster, entry->size);
+        }
+    }
+    free(name);
+    if (result != 0) {
+        export->error = errno ? errno : EIO;
+        return FAT_WALK_STOP;
+    }
+    return FAT_WALK_CONTINUE;
+}
+
+int fat_export_tar(struct volume_t *pvolume, const char *dir_path, int fd) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (fd < 0) {
+        errno = EBADF;
+        return -1;
+    }
+    uint16_t first_cluster = 0;
+    if (dir_path != NULL && strcmp(dir_path, "\\") != 0 && strcmp(dir_path, "/") != 0 && dir_path[0] != '\0') {
+        struct dir_t *dir = dir_open(pvolume, dir_path);
+        if (dir == NULL) {
+            return -1;
+        }
+        first_cluster = dir->first_cluster;
+        dir_close(dir);
+    }
+
+    struct tar_export_t export;
+    memset(&export, 0, sizeof(export));
+    export.volume = pvolume;
+    export.fd = fd;
+    uint32_t cluster_size = pvolume->geometry.cluster_size;
+    export.buffer_clusters = TAR_BUFFER_SIZE > cluster_size ? TAR_BUFFER_SIZE / cluster_size : 1;
+    export.buffer = malloc((size_t) export.buffer_clusters * cluster_size);
+    if (export.buffer == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    // Depth first on the calling thread, so every directory precedes its contents in the archive
+    int result = fat_walk(pvolume, first_cluster, FAT_WALK_DEPTH_FIRST, 1, tar_walk_callback, &export);
+    if (result == 0 && export.error != 0) {
+        errno = export.error;
+        result = -1;
+    }
+    if (result == 0) {
+        // End of archive: two zero blocks
+        memset(export.buffer, 0, TAR_BLOCK_SIZE * 2);
+        result = tar_write(&export, export.buffer, TAR_BLOCK_SIZE * 2);
+    }
+    int error = errno;
+    free(export.buffer);
+    errno = error;
+    return result;
+}
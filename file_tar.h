@@ -0,0 +1,29 @@
+#ifndef MY_FAT_16_READER_FILE_TAR_H
+#define MY_FAT_16_READER_FILE_TAR_H
+
+#include "file_reader.h"
+
+#include <time.h>
+
+#define TAR_BLOCK_SIZE 512
+#define TAR_BUFFER_SIZE (256 * 1024) //File data staged per read, rounded down to whole clusters (at least one)
+
+// Per-export memory is one data buffer, one header block and the current path, whatever the file sizes
+struct tar_export_t {
+    struct volume_t *volume;
+    int fd;
+    uint8_t *buffer;
+    uint32_t buffer_clusters;
+    uint64_t written; //Bytes of archive sent to fd so far
+    int error;
+};
+
+// Modification time of entry as seconds since the epoch; FAT stores local time, so it goes through mktime
+time_t fat_entry_mtime(const struct SFN *entry);
+
+// Streams a POSIX pax/ustar archive of dir_path (NULL or "\\" for the whole volume) to fd, which may be a pipe.
+// Member names are relative to dir_path, '/' separated, long names where present. On failure the data already
+// written to fd is a truncated archive.
+int fat_export_tar(struct volume_t *pvolume, const char *dir_path, int fd);
+
+#endif //MY_FAT_16_READER_FILE_TAR_H
@@ -0,0 +1,855 @@
+#define _GNU_SOURCE
+
+#include "file_writer.h"
+
+#include <limits.h>
+
+static uint16_t fat_get(const struct volume_t *pvolume, uint32_t cluster) {
+    return (uint16_t) (pvolume->fat[cluster * 2] | pvolume->fat[cluster * 2 + 1] << 8);
+}
+
+static void fat_set(struct volume_t *pvolume, uint32_t cluster, uint16_t value) {
+    struct fat_writer_t *writer = pvolume->writer;
+    pvolume->fat[cluster * 2] = (uint8_t) value;
+    pvolume->fat[cluster * 2 + 1] = (uint8_t) (value >> 8);
+    uint32_t sector = (cluster * 2) >> pvolume->geometry.sector_shift;
+    writer->fat_dirty[sector >> 3] |= (uint8_t) (1 << (sector & 7));
+}
+
+static bool cluster_is_free(const struct fat_writer_t *writer, uint32_t cluster) {
+    return writer->free_map[cluster >> 6] >> (cluster & 63) & 1;
+}
+
+static void cluster_mark(struct fat_writer_t *writer, uint32_t cluster, bool free_cluster) {
+    if (free_cluster) {
+        writer->free_map[cluster >> 6] |= (uint64_t) 1 << (cluster & 63);
+        writer->free_count++;
+    } else {
+        writer->free_map[cluster >> 6] &= ~((uint64_t) 1 << (cluster & 63));
+        writer->free_count--;
+    }
+}
+
+// Write state other than the dirty directory sectors, which are accounted one by one
+static size_t writer_size(const struct fat_writer_t *writer) {
+    return sizeof(struct fat_writer_t) + (writer->fat_sectors + 7) / 8 +
+           (writer->cluster_limit + 63) / 64 * sizeof(uint64_t);
+}
+
+static struct fat_writer_t *writer_get(struct volume_t *pvolume) {
+    if (pvolume->writer != NULL) {
+        return pvolume->writer;
+    }
+    if (!pvolume->disk->writable) {
+        errno = EROFS;
+        return NULL;
+    }
+    // Held until fat_writer_close: the FAT is changed in place and must not be evicted before it is flushed
+    if (fat_acquire(pvolume) == NULL) {
+        return NULL;
+    }
+    const struct fat_geometry_t *geometry = &pvolume->geometry;
+    struct fat_writer_t *writer = calloc(1, sizeof(struct fat_writer_t));
+    if (writer == NULL) {
+        fat_release(pvolume);
+        errno = ENOMEM;
+        return NULL;
+    }
+    writer->fat_sectors = geometry->fat_size >> geometry->sector_shift;
+    writer->cluster_limit = geometry->cluster_count + 2;
+    if (writer->cluster_limit > geometry->fat_size / 2) {
+        writer->cluster_limit = geometry->fat_size / 2;
+    }
+    writer->fat_dirty = calloc((writer->fat_sectors + 7) / 8, 1);
+    writer->free_map = calloc((writer->cluster_limit + 63) / 64, sizeof(uint64_t));
+    if (writer->fat_dirty == NULL || writer->free_map == NULL) {
+        free(writer->fat_dirty);
+        free(writer->free_map);
+        free(writer);
+        fat_release(pvolume);
+        errno = ENOMEM;
+        return NULL;
+    }
+    for (uint32_t cluster = 2; cluster < writer->cluster_limit; cluster++) {
+        if (fat_get(pvolume, cluster) == FAT_CLUSTER_FREE) {
+            cluster_mark(writer, cluster, true);
+        }
+    }
+    writer->next_fit = 2;
+    pvolume->writer = writer;
+    fat_memory_charge(&pvolume->memory, (ssize_t) writer_size(writer), 0);
+    return writer;
+}
+
+// First free cluster in [cluster, end), end if there is none
+static uint32_t next_free(const struct fat_writer_t *writer, uint32_t cluster, uint32_t end) {
+    while (cluster < end) {
+        uint64_t word = writer->free_map[cluster >> 6] >> (cluster & 63);
+        if (word != 0) {
+            cluster += (uint32_t) __builtin_ctzll(word);
+            return cluster < end ? cluster : end;
+        }
+        cluster += 64 - (cluster & 63);
+    }
+    return end;
+}
+
+// Number of free clusters from cluster on, stopping at end
+static uint32_t free_run(const struct fat_writer_t *writer, uint32_t cluster, uint32_t end) {
+    uint32_t start = cluster;
+    while (cluster < end) {
+        uint64_t used = ~writer->free_map[cluster >> 6] >> (cluster & 63);
+        if (used != 0) {
+            cluster += (uint32_t) __builtin_ctzll(used);
+            break;
+        }
+        cluster += 64 - (cluster & 63);
+    }
+    return (cluster < end ? cluster : end) - start;
+}
+
+// Next fit: the first run of need free clusters from the cursor on, or the longest run when none is that long
+static uint32_t find_run(const struct fat_writer_t *writer, uint32_t need, uint32_t *length) {
+    uint32_t best = 0;
+    uint32_t best_length = 0;
+    uint32_t ranges[2][2] = {{writer->next_fit, writer->cluster_limit}, {2, writer->next_fit}};
+    for (int r = 0; r < 2; r++) {
+        uint32_t cluster = ranges[r][0];
+        while ((cluster = next_free(writer, cluster, ranges[r][1])) < ranges[r][1]) {
+            uint32_t run = free_run(writer, cluster, ranges[r][1]);
+            if (run >= need) {
+                *length = need;
+                return cluster;
+            }
+            if (run > best_length) {
+                best = cluster;
+                best_length = run;
+            }
+            cluster += run;
+        }
+    }
+    *length = best_length;
+    return best;
+}
+
+// Appends count clusters to chain and links them in the FAT
+static int chain_extend(struct volume_t *pvolume, struct clusters_chain_t *chain, uint32_t count) {
+    struct fat_writer_t *writer = pvolume->writer;
+    if (count > writer->free_count) {
+        errno = ENOSPC;
+        return -1;
+    }
+    uint16_t *clusters = realloc(chain->clusters, sizeof(uint16_t) * (chain->size + count));
+    if (clusters == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    chain->clusters = clusters;
+    size_t old_size = chain->size;
+    // Growing in place right behind the last cluster keeps an appended file in one extent
+    if (chain->size > 0) {
+        uint32_t cluster = (uint32_t) clusters[chain->size - 1] + 1;
+        while (count > 0 && cluster < writer->cluster_limit && cluster_is_free(writer, cluster)) {
+            cluster_mark(writer, cluster, false);
+            clusters[chain->size++] = (uint16_t) cluster++;
+            count--;
+        }
+    }
+    while (count > 0) {
+        uint32_t length;
+        uint32_t cluster = find_run(writer, count, &length);
+        for (uint32_t i = 0; i < length; i++) {
+            cluster_mark(writer, cluster + i, false);
+            clusters[chain->size++] = (uint16_t) (cluster + i);
+        }
+        writer->next_fit = cluster + length < writer->cluster_limit ? cluster + length : 2;
+        count -= length;
+    }
+    for (size_t i = old_size == 0 ? 0 : old_size - 1; i + 1 < chain->size; i++) {
+        fat_set(pvolume, clusters[i], clusters[i + 1]);
+    }
+    fat_set(pvolume, clusters[chain->size - 1], FAT_CLUSTER_END);
+    return 0;
+}
+
+static void chain_release(struct volume_t *pvolume, uint16_t cluster) {
+    struct fat_writer_t *writer = pvolume->writer;
+    while (cluster >= 2 && cluster < writer->cluster_limit && !cluster_is_free(writer, cluster)) {
+        uint16_t next = fat_get(pvolume, cluster);
+        fat_set(pvolume, cluster, FAT_CLUSTER_FREE);
+        cluster_mark(writer, cluster, true);
+        cluster = next;
+    }
+}
+
+// Cached copy of the directory sector at offset, read from the disk the first time it is changed
+static uint8_t *dirty_sector(struct volume_t *pvolume, uint64_t offset) {
+    struct fat_sector_cache_t *cache = &pvolume->writer->directories;
+    size_t low = 0;
+    size_t high = cache->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (cache->offsets[middle] < offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low < cache->count && cache->offsets[low] == offset) {
+        return cache->sectors[low];
+    }
+    if (cache->count == cache->capacity) {
+        size_t capacity = cache->capacity ? cache->capacity * 2 : 16;
+        uint64_t *offsets = realloc(cache->offsets, sizeof(uint64_t) * capacity);
+        if (offsets == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        cache->offsets = offsets;
+        uint8_t **sectors = realloc(cache->sectors, sizeof(uint8_t *) * capacity);
+        if (sectors == NULL) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        cache->sectors = sectors;
+        cache->capacity = capacity;
+    }
+    uint32_t sector_size = pvolume->geometry.sector_size;
+    uint8_t *sector = malloc(sector_size);
+    if (sector == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    int32_t sectors = (int32_t) (sector_size / SECTOR_SIZE);
+    if (disk_read(pvolume->disk, (int32_t) (offset / SECTOR_SIZE), sector, sectors) != sectors) {
+        free(sector);
+        return NULL;
+    }
+    fat_memory_charge(&pvolume->memory, sector_size, 0);
+    memmove(cache->offsets + low + 1, cache->offsets + low, sizeof(uint64_t) * (cache->count - low));
+    memmove(cache->sectors + low + 1, cache->sectors + low, sizeof(uint8_t *) * (cache->count - low));
+    cache->offsets[low] = offset;
+    cache->sectors[low] = sector;
+    cache->count++;
+    return sector;
+}
+
+// Directory entries are 32 byte aligned, so one never straddles two sectors
+static struct SFN *dirty_entry(struct volume_t *pvolume, uint64_t entry_offset) {
+    uint64_t mask = pvolume->geometry.sector_size - 1;
+    uint8_t *sector = dirty_sector(pvolume, entry_offset & ~mask);
+    if (sector == NULL) {
+        return NULL;
+    }
+    return (struct SFN *) (sector + (entry_offset & mask));
+}
+
+void fat_writer_overlay(struct volume_t *pvolume, uint64_t offset, void *buffer, size_t length) {
+    const struct fat_sector_cache_t *cache = &pvolume->writer->directories;
+    uint32_t sector_size = pvolume->geometry.sector_size;
+    size_t low = 0;
+    size_t high = cache->count;
+    while (low < high) {
+        size_t middle = (low + high) / 2;
+        if (cache->offsets[middle] + sector_size <= offset) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    for (size_t i = low; i < cache->count && cache->offsets[i] < offset + length; i++) {
+        uint64_t start = cache->offsets[i] > offset ? cache->offsets[i] : offset;
+        uint64_t end = cache->offsets[i] + sector_size < offset + length ? cache->offsets[i] + sector_size
+                                                                         : offset + length;
+        memcpy((uint8_t *) buffer + (start - offset), cache->sectors[i] + (start - cache->offsets[i]), end - start);
+    }
+}
+
+static uint64_t directory_slot_offset(const struct volume_t *pvolume, uint16_t first_cluster, uint32_t index) {
+    const struct fat_geometry_t *geometry = &pvolume->geometry;
+    uint64_t position = (uint64_t) index * sizeof(struct SFN);
+    if (first_cluster == 0) {
+        return geometry->root_offset + position;
+    }
+    uint16_t cluster = first_cluster;
+    for (uint64_t k = position >> geometry->cluster_shift; k > 0; k--) {
+        cluster = fat_get(pvolume, cluster);
+    }
+    return geometry->data_offset + ((uint64_t) (cluster - 2) << geometry->cluster_shift) +
+           (position & geometry->cluster_mask);
+}
+
+struct fat_lookup_t {
+    uint16_t parent; //First cluster of the directory holding the entry, 0 for the root
+    bool found;
+    uint32_t index; //Slot of the SFN in parent
+    uint32_t lfn_count; //LFN slots right before it
+    struct SFN entry;
+};
+
+// 1 when name is in the directory, 0 when it is not
+static int directory_find(struct volume_t *pvolume, uint16_t first_cluster, const char *name,
+                          struct fat_lookup_t *lookup) {
+    uint32_t entry_count;
+    struct SFN *entries = fat_load_directory(pvolume, first_cluster, &entry_count);
+    if (entries == NULL) {
+        return -1;
+    }
+    char *long_name = malloc(LFN_MAX_NAME_LENGTH + 1);
+    if (long_name == NULL) {
+        free(entries);
+        errno = ENOMEM;
+        return -1;
+    }
+    int found = 0;
+    uint32_t lfn_count = 0;
+    for (uint32_t i = 0; i < entry_count && entries[i].filename[0] != 0x00; i++) {
+        struct SFN *entry = entries + i;
+        if (entry->filename[0] == (char) 0xE5) {
+            lfn_count = 0;
+            continue;
+        }
+        if (entry->file_attributes == FAT_ATTR_LONG_NAME) {
+            lfn_count++;
+            continue;
+        }
+        char short_name[13];
+        fat_short_name(entry, short_name);
+        bool match = fat_name_compare(short_name, name) == 0;
+        if (!match && lfn_count > 0 && !(entry->file_attributes & FAT_ATTR_VOLUME_ID)) {
+            fat_long_name(entries, i, long_name);
+            match = fat_name_compare(long_name, name) == 0;
+        }
+        if (match && !(entry->file_attributes & FAT_ATTR_VOLUME_ID)) {
+            lookup->parent = first_cluster;
+            lookup->found = true;
+            lookup->index = i;
+            lookup->lfn_count = lfn_count;
+            memcpy(&lookup->entry, entry, sizeof(struct SFN));
+            found = 1;
+            break;
+        }
+        lfn_count = 0;
+    }
+    free(long_name);
+    free(entries);
+    return found;
+}
+
+// Resolves every component but the last one, then looks the last one up; leaf receives its name
+static int path_lookup(struct volume_t *pvolume, const char *path, struct fat_lookup_t *lookup, char *leaf) {
+    memset(lookup, 0, sizeof(struct fat_lookup_t));
+    uint16_t cluster = 0;
+    const char *p = path;
+    while (*p == '\\') {
+        p++;
+    }
+    while (1) {
+        size_t length = 0;
+        while (p[length] != '\0' && p[length] != '\\') {
+            length++;
+        }
+        if (length == 0 || length > LFN_MAX_NAME_LENGTH) {
+            errno = length == 0 ? EINVAL : ENAMETOOLONG;
+            return -1;
+        }
+        memcpy(leaf, p, length);
+        leaf[length] = '\0';
+        p += length;
+        while (*p == '\\') {
+            p++;
+        }
+        bool last = *p == '\0';
+        if (strcmp(leaf, ".") == 0 && !last) {
+            continue;
+        }
+        if (strcmp(leaf, "..") == 0 && cluster == 0) {
+            errno = ENOENT;
+            return -1;
+        }
+        lookup->found = false;
+        int found = directory_find(pvolume, cluster, leaf, lookup);
+        if (found < 0) {
+            return -1;
+        }
+        lookup->parent = cluster;
+        if (last) {
+            return 0;
+        }
+        if (!found) {
+            errno = ENOENT;
+            return -1;
+        }
+        if (!(lookup->entry.file_attributes & FAT_ATTR_DIRECTORY)) {
+            errno = ENOTDIR;
+            return -1;
+        }
+        cluster = lookup->entry.low_order_address_of_first_cluster;
+    }
+}
+
+static bool short_name_letter(char letter) {
+    return isalnum((unsigned char) letter) || strchr("!#$%&'()-@^_`{}~", letter) != NULL;
+}
+
+// Packs an 8.3 name into the blank padded, upper case form of SFN::filename
+static int make_short_name(const char *name, char *filename) {
+    const char *dot = strrchr(name, '.');
+    size_t base_length = dot != NULL ? (size_t) (dot - name) : strlen(name);
+    size_t extension_length = dot != NULL ? strlen(dot + 1) : 0;
+    if (base_length == 0 || base_length > 8 || extension_length > 3 || (dot != NULL && extension_length == 0)) {
+        errno = EINVAL;
+        return -1;
+    }
+    memset(filename, ' ', 11);
+    for (size_t i = 0; i < base_length; i++) {
+        if (!short_name_letter(name[i])) {
+            errno = EINVAL;
+            return -1;
+        }
+        filename[i] = (char) toupper(name[i]);
+    }
+    for (size_t i = 0; i < extension_length; i++) {
+        if (!short_name_letter(dot[1 + i])) {
+            errno = EINVAL;
+            return -1;
+        }
+        filename[8 + i] = (char) toupper(dot[1 + i]);
+    }
+    if (filename[0] == (char) 0xE5) {
+        filename[0] = 0x05;
+    }
+    return 0;
+}
+
+// Sets the modification time of entry to the current local time
+static void stamp_now(struct SFN *entry) {
+    time_t now = time(NULL);
+    struct tm local;
+    localtime_r(&now, &local);
+    entry->modified_date.year = (uint16_t) (local.tm_year >= 80 ? local.tm_year - 80 : 0);
+    entry->modified_date.month = (uint16_t) (local.tm_mon + 1);
+    entry->modified_date.day = (uint16_t) local.tm_mday;
+    entry->modified_time.hours = (uint16_t) local.tm_hour;
+    entry->modified_time.minutes = (uint16_t) local.tm_min;
+    entry->modified_time.seconds = (uint16_t) (local.tm_sec / 2);
+}
+
+// Stores a new SFN in the first unused slot of a directory, growing a subdirectory by one cluster when it is full
+static int directory_add(struct volume_t *pvolume, uint16_t first_cluster, const struct SFN *entry,
+                         uint64_t *entry_offset) {
+    uint32_t entry_count;
+    struct SFN *entries = fat_load_directory(pvolume, first_cluster, &entry_count);
+    if (entries == NULL) {
+        return -1;
+    }
+    uint32_t index = 0;
+    while (index < entry_count && entries[index].filename[0] != 0x00 && entries[index].filename[0] != (char) 0xE5) {
+        index++;
+    }
+    free(entries);
+    if (index == entry_count) {
+        if (first_cluster == 0) {
+            errno = ENOSPC;
+            return -1;
+        }
+        struct clusters_chain_t *chain = get_chain_fat16(pvolume->fat, pvolume->geometry.fat_size, first_cluster);
+        if (chain == NULL) {
+            errno = EINVAL;
+            return -1;
+        }
+        int result = chain_extend(pvolume, chain, 1);
+        uint16_t added = chain->clusters[chain->size - 1];
+        free(chain->clusters);
+        free(chain);
+        if (result != 0) {
+            return -1;
+        }
+        // Slots past the end of a directory must read as unused
+        uint32_t cluster_size = pvolume->geometry.cluster_size;
+        uint8_t *zeros = calloc(1, cluster_size);
+        if (zeros == NULL) {
+            errno = ENOMEM;
+            return -1;
+        }
+        uint64_t offset = pvolume->geometry.data_offset + ((uint64_t) (added - 2) << pvolume->geometry.cluster_shift);
+        int written = disk_write(pvolume->disk, (int32_t) (offset / SECTOR_SIZE), zeros,
+                                 (int32_t) (cluster_size / SECTOR_SIZE));
+        free(zeros);
+        if (written != (int32_t) (cluster_size / SECTOR_SIZE)) {
+            return -1;
+        }
+    }
+    *entry_offset = directory_slot_offset(pvolume, first_cluster, index);
+    struct SFN *slot = dirty_entry(pvolume, *entry_offset);
+    if (slot == NULL) {
+        return -1;
+    }
+    memcpy(slot, entry, sizeof(struct SFN));
+    return 0;
+}
+
+// Copies size, first cluster and modification time of stream into its directory slot
+static int entry_store(struct file_t *stream) {
+    stamp_now(stream->entry);
+    stream->entry->file_attributes |= FAT_ATTR_ARCHIVE;
+    stream->entry->low_order_address_of_first_cluster = stream->clusters->size > 0 ? stream->clusters->clusters[0] : 0;
+    struct SFN *slot = dirty_entry(stream->volume, stream->entry_offset);
+    if (slot == NULL) {
+        return -1;
+    }
+    memcpy(slot, stream->entry, sizeof(struct SFN));
+    return 0;
+}
+
+struct file_t *file_open_write(struct volume_t *pvolume, const char *file_name, int flags) {
+    if (pvolume == NULL || file_name == NULL) {
+        errno = EFAULT;
+        return NULL;
+    }
+    if (writer_get(pvolume) == NULL) {
+        return NULL;
+    }
+    char *leaf = malloc(LFN_MAX_NAME_LENGTH + 1);
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    struct fat_lookup_t lookup;
+    if (path_lookup(pvolume, file_name, &lookup, leaf) != 0) {
+        free(leaf);
+        return NULL;
+    }
+    uint64_t entry_offset;
+    if (lookup.found) {
+        free(leaf);
+        if (lookup.entry.file_attributes & (FAT_ATTR_DIRECTORY | FAT_ATTR_VOLUME_ID)) {
+            errno = EISDIR;
+            return NULL;
+        }
+        if (lookup.entry.file_attributes & FAT_ATTR_READONLY) {
+            errno = EACCES;
+            return NULL;
+        }
+        entry_offset = directory_slot_offset(pvolume, lookup.parent, lookup.index);
+    } else {
+        if (!(flags & FAT_WRITE_CREATE)) {
+            free(leaf);
+            errno = ENOENT;
+            return NULL;
+        }
+        // Only 8.3 names are created; no LFN entries are written
+        memset(&lookup.entry, 0, sizeof(struct SFN));
+        int result = make_short_name(leaf, lookup.entry.filename);
+        free(leaf);
+        if (result != 0) {
+            return NULL;
+        }
+        lookup.entry.file_attributes = FAT_ATTR_ARCHIVE;
+        stamp_now(&lookup.entry);
+        lookup.entry.creation_date = lookup.entry.modified_date;
+        lookup.entry.creation_time = lookup.entry.modified_time;
+        if (directory_add(pvolume, lookup.parent, &lookup.entry, &entry_offset) != 0) {
+            return NULL;
+        }
+    }
+
+    struct file_t *file = calloc(1, sizeof(struct file_t));
+    if (file == NULL) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    file->entry = malloc(sizeof(struct SFN));
+    uint16_t first_cluster = lookup.entry.low_order_address_of_first_cluster;
+    // An empty file owns no cluster; the chain of a written file is private to its handle
+    if (first_cluster == 0) {
+        file->clusters = calloc(1, sizeof(struct clusters_chain_t));
+    } else {
+        file->clusters = get_chain_fat16(pvolume->fat, pvolume->geometry.fat_size, first_cluster);
+    }
+    if (file->entry == NULL || file->clusters == NULL) {
+        free(file->entry);
+        free(file->clusters);
+        free(file);
+        errno = ENOMEM;
+        return NULL;
+    }
+    memcpy(file->entry, &lookup.entry, sizeof(struct SFN));
+    file->volume = pvolume;
+    file->writable = true;
+    file->write_flags = flags;
+    file->entry_offset = entry_offset;
+    if (lookup.found && (flags & FAT_WRITE_TRUNCATE) && file_truncate(file, 0) != 0) {
+        file_close(file);
+        return NULL;
+    }
+    if (flags & FAT_WRITE_APPEND) {
+        file->offset = file->entry->size;
+    }
+    return file;
+}
+
+// Makes sure the chain of stream covers length bytes
+static int file_reserve(struct file_t *stream, uint64_t length) {
+    const struct fat_geometry_t *geometry = &stream->volume->geometry;
+    size_t needed = (size_t) ((length + geometry->cluster_size - 1) >> geometry->cluster_shift);
+    if (needed <= stream->clusters->size) {
+        return 0;
+    }
+    return chain_extend(stream->volume, stream->clusters, (uint32_t) (needed - stream->clusters->size));
+}
+
+size_t file_write(const void *ptr, size_t size, size_t nmemb, struct file_t *stream) {
+    if (ptr == NULL || stream == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!stream->writable) {
+        errno = EBADF;
+        return -1;
+    }
+    if (size == 0 || nmemb == 0) {
+        return 0;
+    }
+    if (stream->write_flags & FAT_WRITE_APPEND) {
+        stream->offset = stream->entry->size;
+    }
+    uint64_t length = (uint64_t) size * nmemb;
+    if (stream->offset + length > UINT32_MAX) {
+        length = (UINT32_MAX - stream->offset) / size * size;
+        if (length == 0) {
+            errno = EFBIG;
+            return 0;
+        }
+    }
+    if (file_reserve(stream, stream->offset + length) != 0) {
+        return 0;
+    }
+
+    // File data bypasses the metadata cache: every run of consecutive clusters is one write
+    const struct fat_geometry_t *geometry = &stream->volume->geometry;
+    int fd = fileno(stream->volume->disk->disk);
+    const uint8_t *data = ptr;
+    uint64_t done = 0;
+    while (done < length) {
+        uint32_t position = stream->offset + (uint32_t) done;
+        size_t k = position >> geometry->cluster_shift;
+        size_t run = 1;
+        while (k + run < stream->clusters->size &&
+               stream->clusters->clusters[k + run] == stream->clusters->clusters[k] + run) {
+            run++;
+        }
+        uint64_t span = ((uint64_t) run << geometry->cluster_shift) - (position & geometry->cluster_mask);
+        if (span > length - done) {
+            span = length - done;
+        }
+        uint64_t offset = geometry->data_offset +
+                          ((uint64_t) (stream->clusters->clusters[k] - 2) << geometry->cluster_shift) +
+                          (position & geometry->cluster_mask);
+        ssize_t written = pwrite(fd, data + done, (size_t) span, (off_t) offset);
+        if (written <= 0) {
+            break;
+        }
+        done += (uint64_t) written;
+    }
+    done = done / size * size;
+    stream->offset += (uint32_t) done;
+    if (stream->offset > stream->entry->size) {
+        stream->entry->size = stream->offset;
+    }
+    if (done > 0 && entry_store(stream) != 0) {
+        return 0;
+    }
+    return (size_t) (done / size);
+}
+
+int file_truncate(struct file_t *stream, uint32_t length) {
+    if (stream == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (!stream->writable) {
+        errno = EBADF;
+        return -1;
+    }
+    if (length > stream->entry->size) {
+        // Growing fills the new bytes with zeros
+        static const uint8_t zeros[4096];
+        uint32_t offset = stream->offset;
+        int flags = stream->write_flags;
+        stream->write_flags |= FAT_WRITE_APPEND;
+        while (stream->entry->size < length) {
+            size_t chunk = length - stream->entry->size < sizeof(zeros) ? length - stream->entry->size : sizeof(zeros);
+            if (file_write(zeros, 1, chunk, stream) != chunk) {
+                stream->write_flags = flags;
+                stream->offset = offset;
+                return -1;
+            }
+        }
+        stream->write_flags = flags;
+        stream->offset = offset;
+        return 0;
+    }
+    const struct fat_geometry_t *geometry = &stream->volume->geometry;
+    size_t keep = (size_t) (((uint64_t) length + geometry->cluster_size - 1) >> geometry->cluster_shift);
+    struct clusters_chain_t *chain = stream->clusters;
+    if (keep < chain->size) {
+        chain_release(stream->volume, chain->clusters[keep]);
+        if (keep > 0) {
+            fat_set(stream->volume, chain->clusters[keep - 1], FAT_CLUSTER_END);
+        }
+        chain->size = keep;
+    }
+    stream->entry->size = length;
+    if (stream->offset > length) {
+        stream->offset = length;
+    }
+    return entry_store(stream);
+}
+
+int file_delete(struct volume_t *pvolume, const char *file_name) {
+    if (pvolume == NULL || file_name == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (writer_get(pvolume) == NULL) {
+        return -1;
+    }
+    char *leaf = malloc(LFN_MAX_NAME_LENGTH + 1);
+    if (leaf == NULL) {
+        errno = ENOMEM;
+        return -1;
+    }
+    struct fat_lookup_t lookup;
+    int result = path_lookup(pvolume, file_name, &lookup, leaf);
+    free(leaf);
+    if (result != 0) {
+        return -1;
+    }
+    if (!lookup.found) {
+        errno = ENOENT;
+        return -1;
+    }
+    if (lookup.entry.file_attributes & (FAT_ATTR_DIRECTORY | FAT_ATTR_VOLUME_ID)) {
+        errno = EISDIR;
+        return -1;
+    }
+    if (lookup.entry.file_attributes & FAT_ATTR_READONLY) {
+        errno = EACCES;
+        return -1;
+    }
+    // The SFN and its LFN slots are marked deleted
+    for (uint32_t i = 0; i <= lookup.lfn_count; i++) {
+        struct SFN *slot = dirty_entry(pvolume, directory_slot_offset(pvolume, lookup.parent, lookup.index - i));
+        if (slot == NULL) {
+            return -1;
+        }
+        slot->filename[0] = (char) 0xE5;
+    }
+    chain_release(pvolume, lookup.entry.low_order_address_of_first_cluster);
+    return 0;
+}
+
+// Writes count sectors of the cache starting at first, whose offsets follow each other, with one pwritev
+static int flush_directory_run(struct volume_t *pvolume, size_t first, size_t count) {
+    const struct fat_sector_cache_t *cache = &pvolume->writer->directories;
+    struct iovec iov[count];
+    for (size_t i = 0; i < count; i++) {
+        iov[i].iov_base = cache->sectors[first + i];
+        iov[i].iov_len = pvolume->geometry.sector_size;
+    }
+    ssize_t expected = (ssize_t) (count * pvolume->geometry.sector_size);
+    if (pwritev(fileno(pvolume->disk->disk), iov, (int) count, (off_t) cache->offsets[first]) != expected) {
+        if (errno == 0) {
+            errno = EIO;
+        }
+        return -1;
+    }
+    return 0;
+}
+
+static int flush_directories(struct volume_t *pvolume) {
+    struct fat_sector_cache_t *cache = &pvolume->writer->directories;
+    uint32_t sector_size = pvolume->geometry.sector_size;
+    for (size_t i = 0; i < cache->count;) {
+        size_t run = 1;
+        while (i + run < cache->count && run < IOV_MAX &&
+               cache->offsets[i + run] == cache->offsets[i] + (uint64_t) run * sector_size) {
+            run++;
+        }
+        if (flush_directory_run(pvolume, i, run) != 0) {
+            return -1;
+        }
+        i += run;
+    }
+    for (size_t i = 0; i < cache->count; i++) {
+        free(cache->sectors[i]);
+    }
+    fat_memory_charge(&pvolume->memory, -(ssize_t) (cache->count * sector_size), 0);
+    cache->count = 0;
+    return 0;
+}
+
+// Both copies get the same runs of dirty sectors, first copy first, each in ascending order
+static int flush_fat(struct volume_t *pvolume) {
+    struct fat_writer_t *writer = pvolume->writer;
+    const struct fat_geometry_t *geometry = &pvolume->geometry;
+    int fd = fileno(pvolume->disk->disk);
+    for (uint32_t copy = 0; copy < pvolume->super.number_of_fats; copy++) {
+        for (uint32_t sector = 0; sector < writer->fat_sectors;) {
+            if (!(writer->fat_dirty[sector >> 3] >> (sector & 7) & 1)) {
+                sector++;
+                continue;
+            }
+            uint32_t run = 1;
+            while (sector + run < writer->fat_sectors && writer->fat_dirty[(sector + run) >> 3] >> ((sector + run) & 7) & 1) {
+                run++;
+            }
+            size_t length = (size_t) run << geometry->sector_shift;
+            size_t start = (size_t) sector << geometry->sector_shift;
+            uint64_t offset = geometry->fat_offset + (uint64_t) copy * geometry->fat_size + start;
+            if (pwrite(fd, pvolume->fat + start, length, (off_t) offset) != (ssize_t) length) {
+                if (errno == 0) {
+                    errno = EIO;
+                }
+                return -1;
+            }
+            sector += run;
+        }
+    }
+    memset(writer->fat_dirty, 0, (writer->fat_sectors + 7) / 8);
+    return 0;
+}
+
+int fat_sync(struct volume_t *pvolume) {
+    if (pvolume == NULL) {
+        errno = EFAULT;
+        return -1;
+    }
+    if (pvolume->writer == NULL) {
+        return 0;
+    }
+    errno = 0;
+    if (flush_directories(pvolume) != 0 || flush_fat(pvolume) != 0) {
+        return -1;
+    }
+    return fdatasync(fileno(pvolume->disk->disk));
+}
+
+int fat_writer_close(struct volume_t *pvolume) {
+    struct fat_writer_t *writer = pvolume->writer;
+    int result = fat_sync(pvolume);
+    for (size_t i = 0; i < writer->directories.count; i++) {
+        free(writer->directories.sectors[i]);
+    }
+    fat_memory_charge(&pvolume->memory, -(ssize_t) (writer_size(writer) +
+                                                    writer->directories.count * pvolume->geometry.sector_size), 0);
+    free(writer->directories.sectors);
+    free(writer->directories.offsets);
+    free(writer->fat_dirty);
+    free(writer->free_map);
+    free(writer);
+    pvolume->writer = NULL;
+    fat_release(pvolume);
+    return result;
+}
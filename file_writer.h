@@ -0,0 +1,52 @@
+#ifndef MY_FAT_16_READER_FILE_WRITER_H
+#define MY_FAT_16_READER_FILE_WRITER_H
+
+#include "file_reader.h"
+
+#include <time.h>
+#include <sys/uio.h>
+
+#define FAT_WRITE_CREATE 0x01 //Create the file when it does not exist
+#define FAT_WRITE_TRUNCATE 0x02 //Drop the current contents of an existing file
+#define FAT_WRITE_APPEND 0x04 //Every file_write goes to the end of the file
+
+#define FAT_CLUSTER_FREE 0x0000
+#define FAT_CLUSTER_END 0xFFFF
+
+// Directory sectors changed since the last fat_sync, sorted by offset so a flush writes them in disk order
+struct fat_sector_cache_t {
+    uint64_t *offsets; //Byte offsets on the disk, multiples of the sector size
+    uint8_t **sectors;
+    size_t count;
+    size_t capacity;
+};
+
+// Write state of a volume: the FAT itself is volume_t::fat, only its dirty sectors are tracked here
+struct fat_writer_t {
+    uint8_t *fat_dirty; //One bit per volume sector of the FAT
+    uint32_t fat_sectors;
+    struct fat_sector_cache_t directories;
+    uint64_t *free_map; //Bit c set = cluster c is free
+    uint32_t cluster_limit; //One past the last cluster the FAT can describe
+    uint32_t free_count;
+    uint32_t next_fit; //Cluster the next allocation search starts from
+};
+
+// Single writer: a volume must not be written from several threads, or read while it is written
+struct file_t *file_open_write(struct volume_t *pvolume, const char *file_name, int flags);
+
+size_t file_write(const void *ptr, size_t size, size_t nmemb, struct file_t *stream);
+
+int file_truncate(struct file_t *stream, uint32_t length);
+
+int file_delete(struct volume_t *pvolume, const char *file_name);
+
+// Writes every pending directory sector and both FAT copies; fat_close does the same
+int fat_sync(struct volume_t *pvolume);
+
+// Copies pending directory sectors over buffer, which holds length bytes read from offset
+void fat_writer_overlay(struct volume_t *pvolume, uint64_t offset, void *buffer, size_t length);
+
+int fat_writer_close(struct volume_t *pvolume);
+
+#endif //MY_FAT_16_READER_FILE_WRITER_H